@@ -0,0 +1,455 @@
+#include "wfs.h"
+#include <fuse.h>
+#include <sys/wait.h>
+
+// Handlers are driven directly instead of through a kernel mount
+#undef fuse_main
+#define fuse_main(argc, argv, op, userData) runBenchmark(op)
+int runBenchmark(const struct fuse_operations *op);
+#define main mountMain
+#include "mount.wfs.c"
+#undef main
+
+#define BENCH_OPS 20000 // Calls timed per measurement
+#define BENCH_IO_SIZE 4096 // Bytes per timed read or write
+#define BENCH_DIR_FILES 100000 // Files in largest directory. Each create is timed
+
+const char *image = "bench.img"; // Scratch disk image
+const char *scenario; // Scenario run by child process
+uint64_t param; // Parameter of scenario
+uint64_t *samples; // Latency of each timed call in nanoseconds
+int sampleCount; // Number of samples
+
+// Order samples
+int compareSamples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Print throughput and latency percentiles of samples taken since last report, then start over
+void report(const char *op, uint64_t bytes) {
+    if (sampleCount == 0) {
+        return;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < sampleCount; i++) {
+        total += samples[i];
+    }
+    qsort(samples, sampleCount, sizeof(uint64_t), compareSamples);
+    double seconds = total / 1e9;
+    printf("%-12s %10lu  %-14s %8d calls %12.0f ops/s %9.1f MB/s %10.2f us p50 %10.2f us p99\n", scenario, (unsigned long)param, op,
+           sampleCount, sampleCount / seconds, bytes / seconds / (1024 * 1024), samples[sampleCount / 2] / 1e3, samples[sampleCount * 99 / 100] / 1e3);
+    fflush(stdout);
+    sampleCount = 0;
+}
+
+// Remember latency of call that started at start
+void sample(uint64_t start) {
+    samples[sampleCount++] = monotonicTime() - start;
+}
+
+// Forget cached lookup of path, so next lookup walks it from root
+void forgetPath(const char *path) {
+    dcache[wfs_hash(path) % DCACHE_SIZE].valid = 0;
+}
+
+// Write size bytes at offset of file through an open handle, like a process calling write(2) would
+int writeFile(const struct fuse_operations *op, const char *path, const char *buf, size_t size, off_t offset) {
+    struct fuse_file_info fi = {0};
+    int ret = op->open(path, &fi);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = op->write(path, buf, size, offset, &fi);
+    op->release(path, &fi);
+    return ret;
+}
+
+// Lookups as a function of path depth
+void benchDepth(const struct fuse_operations *op) {
+    char path[MAX_PATH_LENGTH] = "";
+    for (uint64_t i = 0; i < param; i++) {
+        sprintf(path + strlen(path), "/d%lu", (unsigned long)i);
+        op->mkdir(path, 0755);
+    }
+    int pathLen = strlen(path);
+    for (int i = 0; i < 100; i++) {
+        sprintf(path + pathLen, "/f%d", i);
+        op->mknod(path, S_IFREG | 0644, 0);
+    }
+
+    struct stat stbuf;
+    for (int i = 0; i < BENCH_OPS; i++) {
+        sprintf(path + pathLen, "/f%d", i % 100);
+        uint64_t start = monotonicTime();
+        op->getattr(path, &stbuf);
+        sample(start);
+    }
+    report("getattr", 0);
+    for (int i = 0; i < BENCH_OPS; i++) {
+        sprintf(path + pathLen, "/f%d", i % 100);
+        forgetPath(path);
+        uint64_t start = monotonicTime();
+        op->getattr(path, &stbuf);
+        sample(start);
+    }
+    report("getattr-walk", 0);
+}
+
+// Filler that only counts dentries
+int countDentry(void *buf, const char *name, const struct stat *stbuf, off_t offset) {
+    (void)name;
+    (void)stbuf;
+    (void)offset;
+    (*(int *)buf)++;
+    return 0;
+}
+
+// Creating, looking up and listing files as a function of directory size
+void benchDir(const struct fuse_operations *op) {
+    char path[MAX_PATH_LENGTH];
+    op->mkdir("/dir", 0755);
+    for (uint64_t i = 0; i < param; i++) {
+        sprintf(path, "/dir/file%lu", (unsigned long)i);
+        uint64_t start = monotonicTime();
+        op->mknod(path, S_IFREG | 0644, 0);
+        sample(start);
+    }
+    report("mknod", 0);
+
+    struct stat stbuf;
+    for (int i = 0; i < BENCH_OPS; i++) {
+        sprintf(path, "/dir/file%lu", (unsigned long)(rand() % param));
+        forgetPath(path);
+        uint64_t start = monotonicTime();
+        op->getattr(path, &stbuf);
+        sample(start);
+    }
+    report("getattr-walk", 0);
+
+    for (int i = 0; i < 20; i++) {
+        int count = 0;
+        uint64_t start = monotonicTime();
+        op->readdir("/dir", &count, countDentry, 0, NULL);
+        sample(start);
+    }
+    report("readdir", 0);
+}
+
+// Writing and reading as a function of file size
+void benchFile(const struct fuse_operations *op) {
+    char *buf = (char *)malloc(128 * 1024);
+    if (buf == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 128 * 1024; i++) {
+        buf[i] = rand();
+    }
+    op->mknod("/file", S_IFREG | 0644, 0);
+
+    // Fill file sequentially through one open handle
+    struct fuse_file_info fi = {0};
+    op->open("/file", &fi);
+    for (uint64_t offset = 0; offset < param; offset += BENCH_IO_SIZE) {
+        uint64_t start = monotonicTime();
+        op->write("/file", buf, BENCH_IO_SIZE, offset, &fi);
+        sample(start);
+    }
+    op->release("/file", &fi);
+    report("write-seq", param);
+
+    // Overwrite random blocks
+    for (int i = 0; i < BENCH_OPS / 4; i++) {
+        uint64_t start = monotonicTime();
+        writeFile(op, "/file", buf, BENCH_IO_SIZE, (rand() % (param / BENCH_IO_SIZE)) * BENCH_IO_SIZE);
+        sample(start);
+    }
+    report("write-rand", (uint64_t)BENCH_OPS / 4 * BENCH_IO_SIZE);
+
+    for (int i = 0; i < BENCH_OPS; i++) {
+        uint64_t start = monotonicTime();
+        op->read("/file", buf, BENCH_IO_SIZE, (rand() % (param / BENCH_IO_SIZE)) * BENCH_IO_SIZE, NULL);
+        sample(start);
+    }
+    report("read-rand", (uint64_t)BENCH_OPS * BENCH_IO_SIZE);
+
+    uint64_t bytes = 0;
+    while (bytes < 64 * 1024 * 1024) {
+        for (uint64_t offset = 0; offset < param; offset += 128 * 1024) {
+            uint64_t start = monotonicTime();
+            bytes += op->read("/file", buf, 128 * 1024, offset, NULL);
+            sample(start);
+        }
+    }
+    report("read-seq", bytes);
+    free(buf);
+}
+
+// Renaming a file of param bytes back and forth between two directories
+void benchRename(const struct fuse_operations *op) {
+    char buf[BENCH_IO_SIZE];
+    memset(buf, 'x', sizeof(buf));
+    op->mkdir("/a", 0755);
+    op->mkdir("/b", 0755);
+    op->mknod("/a/file", S_IFREG | 0644, 0);
+    struct fuse_file_info fi = {0};
+    op->open("/a/file", &fi);
+    for (uint64_t offset = 0; offset < param; offset += sizeof(buf)) {
+        op->write("/a/file", buf, sizeof(buf), offset, &fi);
+    }
+    op->release("/a/file", &fi);
+
+    for (int i = 0; i < BENCH_OPS; i++) {
+        uint64_t start = monotonicTime();
+        if (i % 2 == 0) {
+            op->rename("/a/file", "/b/file");
+        } else {
+            op->rename("/b/file", "/a/file");
+        }
+        sample(start);
+    }
+    report("rename", 0);
+}
+
+// Writes through an open handle that fsync every param writes, under the sync policy the scenario is named after
+void benchSync(const struct fuse_operations *op) {
+    char buf[BENCH_IO_SIZE];
+    memset(buf, 'x', sizeof(buf));
+    op->mknod("/file", S_IFREG | 0644, 0);
+    struct fuse_file_info fi = {0};
+    op->open("/file", &fi);
+
+    // Plain writes show what the policy costs writers that never ask for durability
+    for (int i = 0; i < BENCH_OPS / 8; i++) {
+        uint64_t start = monotonicTime();
+        op->write("/file", buf, sizeof(buf), (uint64_t)i * sizeof(buf), &fi);
+        sample(start);
+    }
+    report("write", (uint64_t)BENCH_OPS / 8 * sizeof(buf));
+
+    // Each sample is a write, and the fsync that follows it every param writes
+    for (int i = 0; i < BENCH_OPS / 8; i++) {
+        uint64_t start = monotonicTime();
+        op->write("/file", buf, sizeof(buf), (uint64_t)i * sizeof(buf), &fi);
+        if ((i + 1) % param == 0) {
+            op->fsync("/file", 1, &fi);
+        }
+        sample(start);
+    }
+    report("write+fsync", (uint64_t)BENCH_OPS / 8 * sizeof(buf));
+    op->release("/file", &fi);
+}
+
+// Fill log up to param bytes by overwriting a small file, for the mounts timed by benchLog
+void fillLog(const struct fuse_operations *op) {
+    char buf[BENCH_IO_SIZE];
+    memset(buf, 'x', sizeof(buf));
+    op->mkdir("/dir", 0755);
+    char path[MAX_PATH_LENGTH];
+    for (int i = 0; i < 100; i++) {
+        sprintf(path, "/dir/file%d", i);
+        op->mknod(path, S_IFREG | 0644, 0);
+    }
+    op->mknod("/file", S_IFREG | 0644, 0);
+    while (superblock->head < param) {
+        if (writeFile(op, "/file", buf, sizeof(buf), (rand() % 256) * sizeof(buf)) < 0) {
+            break;
+        }
+    }
+}
+
+// Lookups and reads as a function of log length, once mounted
+void benchLog(const struct fuse_operations *op) {
+    char path[MAX_PATH_LENGTH];
+    char buf[BENCH_IO_SIZE];
+    struct stat stbuf;
+    for (int i = 0; i < BENCH_OPS; i++) {
+        sprintf(path, "/dir/file%d", i % 100);
+        forgetPath(path);
+        uint64_t start = monotonicTime();
+        op->getattr(path, &stbuf);
+        sample(start);
+    }
+    report("getattr-walk", 0);
+    for (int i = 0; i < BENCH_OPS; i++) {
+        uint64_t start = monotonicTime();
+        op->read("/file", buf, sizeof(buf), (rand() % 256) * sizeof(buf), NULL);
+        sample(start);
+    }
+    report("read-rand", (uint64_t)BENCH_OPS * sizeof(buf));
+}
+
+uint64_t mountStart; // Time mount started at
+
+// Run scenario on mounted filesystem. Called by mount.wfs main in place of fuse_main
+int runBenchmark(const struct fuse_operations *op) {
+    // Mounting ends here
+    samples[sampleCount++] = monotonicTime() - mountStart;
+    if ((strcmp(scenario, "mount") == 0) || (strcmp(scenario, "replay") == 0)) {
+        report("mount", 0);
+    }
+    sampleCount = 0;
+
+    struct fuse_conn_info conn = {0};
+    op->init(&conn);
+    srand(1);
+    if (strcmp(scenario, "depth") == 0) {
+        benchDepth(op);
+    } else if (strcmp(scenario, "dir") == 0) {
+        benchDir(op);
+    } else if (strncmp(scenario, "file", strlen("file")) == 0) {
+        benchFile(op);
+    } else if (strcmp(scenario, "rename") == 0) {
+        benchRename(op);
+    } else if (strncmp(scenario, "sync", strlen("sync")) == 0) {
+        benchSync(op);
+    } else if (strcmp(scenario, "fill") == 0) {
+        fillLog(op);
+    } else {
+        benchLog(op);
+    }
+    op->destroy(NULL);
+
+    return 0;
+}
+
+// Make empty scratch image of size bytes, formatted with segments of segmentSize bytes
+void makeImage(uint64_t size, const char *segmentSize) {
+    int fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if ((fd == -1) || (ftruncate(fd, size) == -1)) {
+        perror("Error creating scratch image");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    char command[256];
+    snprintf(command, sizeof(command), "./mkfs.wfs -s %s %s", segmentSize, image);
+    if (system(command) != 0) {
+        fprintf(stderr, "Error formatting scratch image\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Drop both checkpoints from scratch image, so the next mount replays the whole log
+void dropCheckpoints(void) {
+    int fd = open(image, O_RDWR);
+    struct wfs_sb sb;
+    if ((fd == -1) || (pread(fd, &sb, sizeof(struct wfs_sb), 0) != sizeof(struct wfs_sb))) {
+        perror("Error reading scratch image");
+        exit(EXIT_FAILURE);
+    }
+    struct wfs_checkpoint empty;
+    memset(&empty, 0, sizeof(struct wfs_checkpoint));
+    for (int i = 0; i < 2; i++) {
+        if (pwrite(fd, &empty, sizeof(struct wfs_checkpoint), sb.checkpoints + (uint64_t)i * sb.checkpoint_size) != sizeof(struct wfs_checkpoint)) {
+            perror("Error writing scratch image");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+}
+
+// Mount scratch image in a child process and run scenario on it. Each run starts from fresh in-memory state
+void run(const char *name, uint64_t value) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Error forking");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        // Handlers report every missing path and full log on stderr
+        if (freopen("/dev/null", "w", stderr) == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        scenario = name;
+        param = value;
+        // Scenarios ending in -pwrite run on the pwrite storage engine
+        int pwrite = (strlen(name) > strlen("-pwrite")) && (strcmp(name + strlen(name) - strlen("-pwrite"), "-pwrite") == 0);
+        // Scenarios starting with sync- run under the sync policy named by the rest
+        char syncOption[64] = "--sync=none";
+        if (strncmp(name, "sync-", strlen("sync-")) == 0) {
+            snprintf(syncOption, sizeof(syncOption), "--sync=%s", name + strlen("sync-"));
+        }
+        char *argv[] = { "bench.wfs", "-f", "-s", pwrite ? "--storage=pwrite" : "--storage=mmap", syncOption, (char *)image, "/mnt", NULL };
+        mountStart = monotonicTime();
+        exit(mountMain(7, argv));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+        fprintf(stderr, "Scenario %s %lu failed\n", name, (unsigned long)value);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [<scratchImagePath>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc == 2) {
+        image = argv[1];
+    }
+    samples = (uint64_t *)malloc(((4 * BENCH_OPS > BENCH_DIR_FILES) ? 4 * BENCH_OPS : BENCH_DIR_FILES) * sizeof(uint64_t));
+    if (samples == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    // Path depth
+    uint64_t depths[] = { 1, 4, 16 };
+    for (int i = 0; i < 3; i++) {
+        makeImage(16 * 1024 * 1024, "64K");
+        run("depth", depths[i]);
+    }
+
+    // Directory size. Each create rewrites one bucket, so the image needs room for about a bucket's worth of log per file
+    uint64_t dirSizes[] = { 100, 2000, BENCH_DIR_FILES };
+    for (int i = 0; i < 3; i++) {
+        makeImage(((dirSizes[i] > 2000) ? 512 : 128) * 1024 * 1024, "1M");
+        run("dir", dirSizes[i]);
+    }
+
+    // File size
+    uint64_t fileSizes[] = { 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+    for (int i = 0; i < 3; i++) {
+        makeImage(128 * 1024 * 1024, "64K");
+        run("file", fileSizes[i]);
+        makeImage(128 * 1024 * 1024, "64K");
+        run("file-pwrite", fileSizes[i]);
+    }
+
+    // Renaming, as a function of file size
+    uint64_t renameSizes[] = { 0, 1024 * 1024, 16 * 1024 * 1024 };
+    for (int i = 0; i < 3; i++) {
+        makeImage(128 * 1024 * 1024, "1M");
+        run("rename", renameSizes[i]);
+    }
+
+    // Sync policy, as a function of writes per fsync
+    const char *syncModes[] = { "sync-none", "sync-group", "sync-strict" };
+    uint64_t fsyncIntervals[] = { 1, 16, 256 };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            makeImage(64 * 1024 * 1024, "1M");
+            run(syncModes[j], fsyncIntervals[i]);
+        }
+    }
+
+    // Log length, from a checkpoint and replaying the whole log
+    uint64_t logLengths[] = { 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024 };
+    for (int i = 0; i < 3; i++) {
+        makeImage(128 * 1024 * 1024, "64K");
+        run("fill", logLengths[i]);
+        run("mount", logLengths[i]);
+        dropCheckpoints();
+        run("replay", logLengths[i]);
+    }
+
+    unlink(image);
+    free(samples);
+
+    return EXIT_SUCCESS;
+}
@@ -1,6 +1,247 @@
 #include "wfs.h"
 
+uint64_t *latestEntries; // Offset of latest log entry of each inode number
+struct wfs_extent_map *fileExtents; // Extents of each file and buckets of each directory not overwritten since, indexed by inode number
+int latestEntriesSize; // Number of slots in latestEntries and fileExtents
+uint64_t *chunkEntries; // Offset of latest copy of each chunk, indexed by chunk id
+char *chunkUsed; // 1 if a live shared extent log entry lists chunk, indexed by chunk id
+uint32_t chunkEntriesSize; // Number of slots in chunkEntries and chunkUsed
+uint64_t *liveEntries; // Offsets of log entries that survive compaction, sorted
+uint64_t liveCount; // Number of offsets in liveEntries
+uint64_t liveCapacity; // Slots in liveEntries
+
+// Remember log entry as latest for its inode number, growing arrays as needed
+void setLatest(int inodeNum, uint64_t offset) {
+    if (inodeNum >= latestEntriesSize) {
+        int newSize = (latestEntriesSize == 0) ? MAX_INODES : latestEntriesSize;
+        while (newSize <= inodeNum) {
+            newSize *= 2;
+        }
+        uint64_t *newEntries = (uint64_t *)realloc(latestEntries, newSize * sizeof(uint64_t));
+        struct wfs_extent_map *newExtents = (struct wfs_extent_map *)realloc(fileExtents, newSize * sizeof(struct wfs_extent_map));
+        if ((newEntries == NULL) || (newExtents == NULL)) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        memset(newEntries + latestEntriesSize, 0, (newSize - latestEntriesSize) * sizeof(uint64_t));
+        memset(newExtents + latestEntriesSize, 0, (newSize - latestEntriesSize) * sizeof(struct wfs_extent_map));
+        latestEntries = newEntries;
+        fileExtents = newExtents;
+        latestEntriesSize = newSize;
+    }
+    latestEntries[inodeNum] = offset;
+}
+
+// Remember log entry as latest copy of its chunk, growing arrays as needed
+void setChunk(uint32_t id, uint64_t offset) {
+    if (id >= chunkEntriesSize) {
+        uint32_t newSize = (chunkEntriesSize == 0) ? MAX_INODES : chunkEntriesSize;
+        while (newSize <= id) {
+            newSize *= 2;
+        }
+        uint64_t *newEntries = (uint64_t *)realloc(chunkEntries, newSize * sizeof(uint64_t));
+        char *newUsed = (char *)realloc(chunkUsed, newSize * sizeof(char));
+        if ((newEntries == NULL) || (newUsed == NULL)) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        memset(newEntries + chunkEntriesSize, 0, (newSize - chunkEntriesSize) * sizeof(uint64_t));
+        memset(newUsed + chunkEntriesSize, 0, (newSize - chunkEntriesSize) * sizeof(char));
+        chunkEntries = newEntries;
+        chunkUsed = newUsed;
+        chunkEntriesSize = newSize;
+    }
+    chunkEntries[id] = offset;
+}
+
+// Drop every extent of file
+void clearExtents(int inodeNum) {
+    free(fileExtents[inodeNum].extents);
+    fileExtents[inodeNum].extents = NULL;
+    fileExtents[inodeNum].count = 0;
+    fileExtents[inodeNum].capacity = 0;
+}
+
+// Add extent to file's extents, trimming the parts of older extents it overwrites, like mount does
+void addExtent(int inodeNum, uint64_t offset, uint64_t length, uint64_t data, uint64_t entry) {
+    struct wfs_extent_map *map = &fileExtents[inodeNum];
+    uint64_t end = offset + length;
+
+    // Old extents from first up to last overlap new one
+    uint32_t first = 0;
+    while ((first < map->count) && (map->extents[first].offset + map->extents[first].length <= offset)) {
+        first++;
+    }
+    uint32_t last = first;
+    while ((last < map->count) && (map->extents[last].offset < end)) {
+        last++;
+    }
+
+    // They are replaced by the new extent and what's left of the first and last of them
+    struct wfs_extent_ref replacement[3];
+    uint32_t replacementCount = 0;
+    if ((first < last) && (map->extents[first].offset < offset)) { // Keep part before
+        struct wfs_extent_ref old = map->extents[first];
+        struct wfs_extent_ref before = { old.offset, offset - old.offset, old.data, old.entry };
+        replacement[replacementCount++] = before;
+    }
+    struct wfs_extent_ref newExtent = { offset, length, data, entry };
+    replacement[replacementCount++] = newExtent;
+    if ((first < last) && (map->extents[last - 1].offset + map->extents[last - 1].length > end)) { // Keep part after
+        struct wfs_extent_ref old = map->extents[last - 1];
+        struct wfs_extent_ref after = { end, old.offset + old.length - end, old.data + (end - old.offset), old.entry };
+        replacement[replacementCount++] = after;
+    }
+
+    uint32_t count = map->count - (last - first) + replacementCount;
+    if (count > map->capacity) {
+        uint32_t newCapacity = (map->capacity == 0) ? 4 : 2 * map->capacity;
+        while (newCapacity < count) {
+            newCapacity *= 2;
+        }
+        struct wfs_extent_ref *extents = (struct wfs_extent_ref *)realloc(map->extents, newCapacity * sizeof(struct wfs_extent_ref));
+        if (extents == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        map->extents = extents;
+        map->capacity = newCapacity;
+    }
+    memmove(&map->extents[first + replacementCount], &map->extents[last], (map->count - last) * sizeof(struct wfs_extent_ref));
+    memcpy(&map->extents[first], replacement, replacementCount * sizeof(struct wfs_extent_ref));
+    map->count = count;
+}
+
+// Replay log entry at disk offset curr, like mount does. The latest log entry of each inode wins, and file data and
+// directory buckets are indexed in log order. A tombstone removes its inode, and log entries an open handle appended after it die with it.
+// The deleted flag is ignored, since it is set in place and may have reached disk before the log entries that made it true
+void replayLogEntry(uint64_t curr) {
+    struct wfs_log_entry *logEntry = (struct wfs_log_entry *)(tail + curr);
+    if (logEntry->inode.flags & WFS_LOG_CHUNK) { // Chunk ids aren't inode numbers
+        setChunk(logEntry->inode.inode_number, curr);
+        return;
+    }
+    int inodeNum = logEntry->inode.inode_number;
+    uint64_t latest = (inodeNum < latestEntriesSize) ? latestEntries[inodeNum] : 0;
+    if ((latest != 0) && (((struct wfs_log_entry *)(tail + latest))->inode.flags & WFS_LOG_REMOVED)) {
+        if (logEntry->inode.flags & WFS_LOG_REMOVED) {
+            setLatest(inodeNum, curr); // Cleaner's copy of tombstone
+        }
+        return;
+    }
+    setLatest(inodeNum, curr);
+    if (logEntry->inode.flags & WFS_LOG_REMOVED) {
+        clearExtents(inodeNum);
+    } else if ((logEntry->inode.mode & S_IFREG) && (logEntry->inode.flags & WFS_LOG_EXTENT)) {
+        // Extent overwrites part of file
+        struct wfs_extent *extent = (struct wfs_extent *)logEntry->data;
+        if (extent->length > 0) {
+            addExtent(inodeNum, extent->offset, extent->length, curr + sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent), curr);
+        }
+    } else if (logEntry->inode.mode & S_IFREG) {
+        // Whole file replaces all extents
+        clearExtents(inodeNum);
+        uint32_t dataSize = logEntry->inode.size - sizeof(struct wfs_log_entry);
+        if (dataSize > 0) {
+            addExtent(inodeNum, 0, dataSize, curr + sizeof(struct wfs_log_entry), curr);
+        }
+    } else {
+        // Bucket replaces the bucket's earlier log entry
+        addExtent(inodeNum, ((struct wfs_dir *)logEntry->data)->bucket, 1, curr, curr);
+    }
+}
+
+// Drop inodes a checkpoint lists as unlinked while open. The cleaner may have let their tombstones go once no
+// checkpoint predated them, so the list may be all that says they are gone. Inode numbers are never handed out twice,
+// so an inode either checkpoint lists stays gone
+void dropOrphans(void) {
+    for (int i = 0; i < 2; i++) {
+        struct wfs_checkpoint *checkpoint = (struct wfs_checkpoint *)(tail + superblock->checkpoints + (uint64_t)i * superblock->checkpoint_size);
+        if ((checkpoint->seq == 0) || (checkpoint->size > superblock->checkpoint_size - sizeof(struct wfs_checkpoint)) ||
+            (checkpoint->orphan_count > checkpoint->size / sizeof(uint32_t))) {
+            continue;
+        }
+        if (checkpoint->checksum != wfs_crc32c(0, &checkpoint->head_seq, sizeof(struct wfs_checkpoint) - offsetof(struct wfs_checkpoint, head_seq) + checkpoint->size)) {
+            continue;
+        }
+        // Orphans follow chunks, at the end of checkpoint
+        uint32_t *orphans = (uint32_t *)((char *)(checkpoint + 1) + checkpoint->size) - checkpoint->orphan_count;
+        for (uint32_t j = 0; j < checkpoint->orphan_count; j++) {
+            if ((int)orphans[j] < latestEntriesSize) {
+                latestEntries[orphans[j]] = 0;
+                clearExtents(orphans[j]);
+            }
+        }
+    }
+}
+
+// Add log entry at disk offset to the ones that survive compaction
+void addLive(uint64_t offset) {
+    if (liveCount == liveCapacity) {
+        liveCapacity = (liveCapacity == 0) ? MAX_INODES : 2 * liveCapacity;
+        uint64_t *newEntries = (uint64_t *)realloc(liveEntries, liveCapacity * sizeof(uint64_t));
+        if (newEntries == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        liveEntries = newEntries;
+    }
+    liveEntries[liveCount++] = offset;
+}
+
+// Order disk offsets
+int compareOffsets(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Collect log entries that survive compaction once log is replayed: the latest log entry of each inode still there,
+// the log entries holding its live file data or directory buckets, and chunks a live shared extent log entry lists. Tombstones are dropped,
+// since compaction leaves no older log entry of their inode and no checkpoint for them to outlive
+void collectLive(void) {
+    for (int i = 0; i < latestEntriesSize; i++) {
+        if ((latestEntries[i] == 0) || (((struct wfs_log_entry *)(tail + latestEntries[i]))->inode.flags & WFS_LOG_REMOVED)) {
+            continue;
+        }
+        addLive(latestEntries[i]);
+        for (uint32_t j = 0; j < fileExtents[i].count; j++) {
+            addLive(fileExtents[i].extents[j].entry);
+        }
+    }
+    if (liveCount > 0) {
+        qsort(liveEntries, liveCount, sizeof(uint64_t), compareOffsets);
+    }
+
+    // Chunks listed by live shared extent log entries. An extent split in two appears twice
+    uint64_t fileCount = liveCount;
+    for (uint64_t i = 0; i < fileCount; i++) {
+        struct wfs_log_entry *logEntry = (struct wfs_log_entry *)(tail + liveEntries[i]);
+        if (!(logEntry->inode.flags & WFS_LOG_SHARED) || ((i > 0) && (liveEntries[i] == liveEntries[i - 1]))) {
+            continue;
+        }
+        struct wfs_shared *shared = (struct wfs_shared *)(logEntry->data + sizeof(struct wfs_extent));
+        for (uint32_t j = 0; j < shared->count; j++) {
+            if ((shared->chunks[j] < chunkEntriesSize) && (chunkEntries[shared->chunks[j]] != 0) && !chunkUsed[shared->chunks[j]]) {
+                chunkUsed[shared->chunks[j]] = 1;
+                addLive(chunkEntries[shared->chunks[j]]);
+            }
+        }
+    }
+    if (liveCount > 0) {
+        qsort(liveEntries, liveCount, sizeof(uint64_t), compareOffsets);
+    }
+}
+
+// Check if log entry survives compaction
+int keepLogEntry(struct wfs_log_entry *logEntry) {
+    uint64_t offset = (char *)(logEntry) - tail;
+    return bsearch(&offset, liveEntries, liveCount, sizeof(uint64_t), compareOffsets) != NULL;
+}
+
 int main(int argc, char *argv[]) {
+    wfs_crc_init();
+
     if (argc != 2) {
         fprintf(stderr, "Usage: %s <diskPath>\n", argv[0]);
         exit(EXIT_FAILURE);
@@ -23,7 +264,7 @@ int main(int argc, char *argv[]) {
         close(fd);
         exit(EXIT_FAILURE);
     }
-    int fileSize = fileStat.st_size;
+    uint64_t fileSize = fileStat.st_size;
 
     // Map file to memory
     tail = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
@@ -32,6 +273,7 @@ int main(int argc, char *argv[]) {
         close(fd);
         exit(EXIT_FAILURE);
     }
+    madvise(tail, fileSize, MADV_SEQUENTIAL); // Log is read and written front to back
     // Get superblock
     superblock = (struct wfs_sb *)tail;
     if (superblock->magic != WFS_MAGIC) {
@@ -39,64 +281,135 @@ int main(int argc, char *argv[]) {
         close(fd);
         exit(EXIT_FAILURE);
     }
+    if (superblock->version != WFS_VERSION) {
+        fprintf(stderr, "Unsupported disk format version %u\n", superblock->version);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    if ((superblock->segments + (uint64_t)superblock->segment_count * superblock->segment_size > fileSize) || (superblock->head <= superblock->segments)) {
+        fprintf(stderr, "Invalid segment layout\n");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
 
-    // Set head to end of superblock
-    head = tail + superblock->head;
+    // Head segment holds the last committed byte
+    struct wfs_segment_usage *segmentUsage = (struct wfs_segment_usage *)(tail + sizeof(struct wfs_sb));
+    uint32_t headSegment = (superblock->head - 1 - superblock->segments) / superblock->segment_size;
+    uint32_t headSeq = segmentUsage[headSegment].seq;
 
-    // Create temporary file for compacted log
-    char tempFilename[] = "/tmp/fsck_wfs_TEMP";
-    int tempFD = mkstemp(tempFilename);
-    if (tempFD == -1) {
-        perror("Error creating temporary file for compaction");
-        return -1;
+    // Sort segments by sequence number, like mount does. Segments filled after head segment never got a committed log entry
+    uint32_t *segments = (uint32_t *)malloc(superblock->segment_count * sizeof(uint32_t));
+    uint32_t *used = (uint32_t *)malloc(superblock->segment_count * sizeof(uint32_t));
+    if ((segments == NULL) || (used == NULL)) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
     }
-
-    // Data structure to track the latest valid log entry for each inode
-    struct wfs_log_entry *latestEntries = calloc(MAX_INODES, sizeof(struct wfs_log_entry));
-    if (!latestEntries) {
-        close(tempFD);
-        unlink(tempFilename);
-        return -ENOMEM;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < superblock->segment_count; i++) {
+        if ((segmentUsage[i].seq == 0) || (segmentUsage[i].seq > headSeq)) {
+            continue;
+        }
+        uint32_t pos = count++;
+        while ((pos > 0) && (segmentUsage[segments[pos - 1]].seq > segmentUsage[i].seq)) {
+            segments[pos] = segments[pos - 1];
+            pos--;
+        }
+        segments[pos] = i;
     }
 
-    // Read through entire log from beginning
-    lseek(fd, sizeof(struct wfs_sb), SEEK_SET);  // Start after superblock
-    struct wfs_log_entry entry;
-    // Read each log entry
-    while (read(fd, &entry, sizeof(struct wfs_log_entry)) == sizeof(struct wfs_log_entry)) {
-        // If the inode is not deleted, update latestEntries array
-        if (!entry.inode.deleted) {
-            // Copy entry into latestEntries array at position of inode number
-            memcpy(&latestEntries[entry.inode.inode_number], &entry, sizeof(struct wfs_log_entry));
+    // First pass verifies log entries, replays them and finds where the intact log ends
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t start = superblock->segments + (uint64_t)segments[i] * superblock->segment_size;
+        uint64_t end = start + ((segments[i] == headSegment) ? superblock->head - start : segmentUsage[segments[i]].written);
+        uint64_t curr = start;
+        while (curr < end) {
+            uint64_t updateSize = wfs_verify_update(tail + curr, end - curr);
+            if (updateSize == 0) { // Torn or corrupt. Log ends here
+                fprintf(stderr, "Log entry at %lu is torn or corrupt, truncating log\n", (unsigned long)curr);
+                break;
+            }
+            for (uint64_t updateEnd = curr + updateSize; curr < updateEnd; curr += ((struct wfs_log_entry *)(tail + curr))->inode.size) {
+                replayLogEntry(curr);
+            }
+        }
+        used[i] = curr - start;
+        if (curr < end) {
+            count = i + 1;
         }
     }
+    if ((count == 0) || (used[0] == 0)) {
+        fprintf(stderr, "Root directory is corrupt\n");
+        exit(EXIT_FAILURE);
+    }
+    dropOrphans();
+    collectLive();
 
-    // Write compacted log entries back to temp file
-    for (int i = 0; i < MAX_INODES; i++) {
-        // If the inode is not deleted, write it to the temp file
-        if (latestEntries[i].inode.inode_number != 0) {
-            write(tempFD, &latestEntries[i], sizeof(struct wfs_log_entry));
+    // Second pass slides surviving log entries forward through the same segments in the same order. Packing a subset of
+    // the log entries never gets ahead of where they were read from, so each move only overwrites log entries already passed
+    uint32_t out = 0; // Index of segment being filled
+    uint64_t outUsed = 0; // Bytes used in it
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t curr = superblock->segments + (uint64_t)segments[i] * superblock->segment_size;
+        uint64_t end = curr + used[i];
+        while (curr < end) {
+            struct wfs_log_entry *currLogEntry = (struct wfs_log_entry *)(tail + curr);
+            uint32_t size = currLogEntry->inode.size;
+            if (keepLogEntry(currLogEntry)) {
+                // Log entries never straddle segments
+                if (outUsed + size > superblock->segment_size) {
+                    used[out++] = outUsed;
+                    outUsed = 0;
+                }
+                char *dest = tail + superblock->segments + (uint64_t)segments[out] * superblock->segment_size + outUsed;
+                if (dest != (char *)currLogEntry) {
+                    memmove(dest, currLogEntry, size);
+                }
+                // Every update is complete once compacted, and some of its log entries may be gone
+                struct wfs_log_entry *newLogEntry = (struct wfs_log_entry *)dest;
+                newLogEntry->inode.deleted = 0;
+                if (newLogEntry->inode.flags & WFS_LOG_CONTINUED) {
+                    newLogEntry->inode.flags &= ~WFS_LOG_CONTINUED;
+                    newLogEntry->inode.checksum = wfs_log_entry_checksum(newLogEntry);
+                }
+                outUsed += size;
+            }
+            curr += size;
         }
     }
+    used[out] = outUsed;
 
-    // Copy compacted log from temp file back to original disk file
-    lseek(tempFD, 0, SEEK_SET);
-    lseek(fd, sizeof(struct wfs_sb), SEEK_SET);  // Start after superblock
-    // Read each log entry from temp file and write to disk file
-    while (read(tempFD, &entry, sizeof(struct wfs_log_entry)) == sizeof(struct wfs_log_entry)) {
-        write(fd, &entry, sizeof(struct wfs_log_entry));
+    // Filled segments keep their order. Every other segment is free
+    for (uint32_t i = 0; i < superblock->segment_max; i++) {
+        segmentUsage[i].seq = 0;
+        segmentUsage[i].live = 0;
+        segmentUsage[i].written = 0;
     }
+    for (uint32_t i = 0; i <= out; i++) {
+        segmentUsage[segments[i]].seq = i + 1;
+        segmentUsage[segments[i]].live = used[i];
+        segmentUsage[segments[i]].written = used[i];
+    }
+
+    // Update superblock to new end of log. Superblock is mapped, so this reaches disk at munmap
+    superblock->head = superblock->segments + (uint64_t)segments[out] * superblock->segment_size + outUsed;
 
-    // Update superblock to new end of log
-    superblock->head = lseek(fd, 0, SEEK_CUR);
-    lseek(fd, 0, SEEK_SET);  // Go back to beginning of disk
-    write(fd, &superblock, sizeof(struct wfs_sb));
+    // Checkpoints point into the old log, so drop them
+    memset(tail + superblock->checkpoints, 0, sizeof(struct wfs_checkpoint));
+    memset(tail + superblock->checkpoints + superblock->checkpoint_size, 0, sizeof(struct wfs_checkpoint));
 
     // Clean up
-    close(tempFD);
-    unlink(tempFilename);
+    free(segments);
+    free(used);
+    for (int i = 0; i < latestEntriesSize; i++) {
+        free(fileExtents[i].extents);
+    }
     free(latestEntries);
+    free(fileExtents);
+    free(chunkEntries);
+    free(chunkUsed);
+    free(liveEntries);
+    munmap(tail, fileSize);
     close(fd);
-    
+
     return EXIT_SUCCESS;
 }
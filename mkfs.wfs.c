@@ -1,14 +1,55 @@
 #include "wfs.h"
 
+// Parse size with optional K, M or G suffix
+uint64_t parseSize(const char *arg) {
+    char *end;
+    uint64_t size = strtoull(arg, &end, 0);
+    switch (toupper((unsigned char)*end)) {
+        case 'G': size *= 1024; // Fall through
+        case 'M': size *= 1024; // Fall through
+        case 'K': size *= 1024;
+    }
+    return size;
+}
+
 int main(int argc, char *argv[]) {
+    wfs_crc_init();
+
+    // Parse segment size, size the image may grow to, checkpoint region size and whether to compress and deduplicate
+    uint64_t segmentSize = SEGMENT_SIZE;
+    uint64_t maxSize = 0;
+    uint64_t checkpointSize = 0;
+    uint32_t flags = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:m:c:zd")) != -1) {
+        if (opt == 's') {
+            segmentSize = parseSize(optarg) & ~4095; // Segments are page aligned so the image can be mapped piecewise
+        } else if (opt == 'm') {
+            maxSize = parseSize(optarg);
+        } else if (opt == 'c') {
+            checkpointSize = parseSize(optarg);
+        } else if (opt == 'z') {
+            flags |= WFS_SB_COMPRESS; // Compress file data
+        } else if (opt == 'd') {
+            flags |= WFS_SB_DEDUP; // Share identical chunks of file data
+        } else {
+            optind = argc + 1; // Print usage
+            break;
+        }
+    }
+
     // Error Checking
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <diskPath>\n", argv[0]);
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-s <segmentSize>] [-m <maxDiskSize>] [-c <checkpointSize>] [-z] [-d] <diskPath>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if ((segmentSize < 4096) || (segmentSize > UINT32_MAX / 2)) {
+        fprintf(stderr, "Segment size must be between 4 KiB and 2 GiB\n");
         exit(EXIT_FAILURE);
     }
 
     // Open disk image file
-    const char *path = argv[1];
+    const char *path = argv[optind];
     int fd = open(path, O_RDWR, 0666);
     if (fd == -1) {
         perror("Error opening disk image file");
@@ -22,10 +63,61 @@ int main(int argc, char *argv[]) {
         close(fd);
         exit(EXIT_FAILURE);
     }
-    int fileSize = fileStat.st_size;
+    uint64_t fileSize = fileStat.st_size;
+    if (maxSize < fileSize) { // Image doesn't grow by default
+        maxSize = fileSize;
+    }
+
+    // Checkpoint regions scale with the largest image, so they hold the maps of a full disk
+    if (checkpointSize == 0) {
+        checkpointSize = maxSize / 128;
+    }
+    if (checkpointSize < CHECKPOINT_MIN_SIZE) {
+        checkpointSize = CHECKPOINT_MIN_SIZE;
+    }
+    checkpointSize = (checkpointSize + 4095) & ~4095; // Page align
+    if (checkpointSize > UINT32_MAX / 2) {
+        fprintf(stderr, "Checkpoint size must be at most 2 GiB\n");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
 
-    // Map file to memory
-    char* mem = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // Size segment usage table for as many segments as fit in the largest image
+    uint64_t segmentMax = (maxSize - sizeof(struct wfs_sb)) / (segmentSize + sizeof(struct wfs_segment_usage));
+    if (segmentMax > UINT32_MAX) {
+        segmentMax = UINT32_MAX;
+    }
+    uint64_t checkpoints = (sizeof(struct wfs_sb) + segmentMax * sizeof(struct wfs_segment_usage) + 4095) & ~4095; // Page align checkpoint regions
+    uint64_t segments = checkpoints + 2 * checkpointSize;
+    while ((segmentMax > 0) && (segments + segmentMax * segmentSize > maxSize)) {
+        segmentMax--;
+    }
+    uint64_t minSize = segments + (2 * CLEANER_SEGMENTS + 1) * segmentSize;
+    if (segmentMax < 2 * CLEANER_SEGMENTS + 1) {
+        fprintf(stderr, "Disk image too small for %d segments of %lu bytes\n", 2 * CLEANER_SEGMENTS + 1, (unsigned long)segmentSize);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    // Grow image file to hold the smallest filesystem
+    if (fileSize < minSize) {
+        fileSize = minSize;
+    }
+    uint64_t segmentCount = (fileSize - segments) / segmentSize;
+    if (segmentCount > segmentMax) {
+        segmentCount = segmentMax;
+    }
+    // Allocate blocks for every segment, so a full host filesystem fails here instead of on a store through a mapping
+    int err = posix_fallocate(fd, 0, segments + segmentCount * segmentSize);
+    if (err != 0) {
+        errno = err;
+        perror("Error allocating disk image file");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    // Map superblock, segment usage table, checkpoint regions and first segment
+    size_t mapSize = segments + segmentSize;
+    char* mem = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (mem == MAP_FAILED) {
         perror("Error mapping file to memory");
         exit(EXIT_FAILURE);
@@ -34,7 +126,23 @@ int main(int argc, char *argv[]) {
     // Initialize superblock
     struct wfs_sb* superblock = (struct wfs_sb*)mem;
     superblock->magic = WFS_MAGIC;
-    superblock->head = sizeof(struct wfs_sb);
+    superblock->version = WFS_VERSION;
+    superblock->segment_size = segmentSize;
+    superblock->segment_count = segmentCount;
+    superblock->segment_max = segmentMax;
+    superblock->segments = segments;
+    superblock->checkpoints = checkpoints;
+    superblock->checkpoint_size = checkpointSize;
+    superblock->flags = flags;
+    superblock->head = segments; // Log starts in first segment
+
+    // Every segment is free except the first
+    struct wfs_segment_usage *segmentUsage = (struct wfs_segment_usage *)(mem + sizeof(struct wfs_sb));
+    memset(segmentUsage, 0, segmentMax * sizeof(struct wfs_segment_usage));
+    segmentUsage[0].seq = 1;
+
+    // No checkpoint yet, so first mount replays the log
+    memset(mem + checkpoints, 0, 2 * checkpointSize);
 
     // Initialize root inode
     struct wfs_inode root;
@@ -44,20 +152,27 @@ int main(int argc, char *argv[]) {
     root.uid = getuid();
     root.gid = getgid();
     root.flags = 0;
-    root.size = sizeof(struct wfs_inode);
+    root.size = sizeof(struct wfs_inode) + sizeof(struct wfs_dir); // Empty directory of one bucket
     root.atime = time(NULL);
     root.mtime = time(NULL);
     root.ctime = time(NULL);
     root.links = 0;
+    root.checksum = 0;
 
     // Initialize root log entry
-    struct wfs_log_entry* rootLogEntry = (struct wfs_log_entry *)malloc(sizeof(struct wfs_log_entry));
+    struct wfs_log_entry* rootLogEntry = (struct wfs_log_entry *)malloc(root.size);
     rootLogEntry->inode = root;
+    struct wfs_dir *rootDir = (struct wfs_dir *)rootLogEntry->data;
+    rootDir->bucket = 0;
+    rootDir->buckets = 1;
+    rootDir->entries = 0; // No dentries yet
+    rootDir->count = 0;
+    rootLogEntry->inode.checksum = wfs_log_entry_checksum(rootLogEntry);
     memcpy((char *)(mem + superblock->head), rootLogEntry, rootLogEntry->inode.size);
 
     superblock->head += rootLogEntry->inode.size; // Update superblock head
-    totalSize += rootLogEntry->inode.size + sizeof(struct wfs_sb); // Update total size
-    munmap(mem, fileStat.st_size); // Write to disk
+    segmentUsage[0].live = rootLogEntry->inode.size;
+    munmap(mem, mapSize); // Write to disk
 
     free(rootLogEntry);
     close(fd);
@@ -1,637 +1,4300 @@
 #include "wfs.h"
 #include <fuse.h>
+#include <zlib.h>
 
-// Remove mount point from path
-char *parsePath(const char *path) {
+// Remove mount point from path. Returns the rest of path, without copying it
+const char *parsePath(const char *path) {
     // Error Checking
-    int pathLen = strlen(path);
-    int mntLen = strlen(mnt);
-    if ((path == NULL) || (mnt == NULL) || (pathLen == 0) || (mntLen == 0)) {
+    if ((path == NULL) || (mnt == NULL) || (*path == '\0') || (*mnt == '\0')) {
         return NULL;
     }
 
-    // Check if path is root
-    if(strncmp(path, "/", pathLen) == 0) {
-        // Path is root, return empty string
-        return strdup(path);
+    // FUSE hands over paths relative to mount point, so it is usually not in path
+    const char *pointer = strstr(path, mnt);
+    if ((strcmp(path, "/") == 0) || (pointer == NULL)) {
+        return path;
+    }
+
+    // Rest of path after mount point
+    return pointer + strlen(mnt);
+}
+
+// Get segment holding disk offset
+uint32_t segmentOf(uint64_t offset) {
+    return (offset - superblock->segments) / superblock->segment_size;
+}
+
+// Get disk offset of segment
+uint64_t segmentOffset(uint32_t segment) {
+    return superblock->segments + (uint64_t)segment * superblock->segment_size;
+}
+
+// Add segment to the ones calling thread holds under key, growing its list as needed
+void holdSegment(pthread_key_t key, uint32_t segment) {
+    struct wfs_pins *pins = (struct wfs_pins *)pthread_getspecific(key);
+    if ((pins == NULL) || (pins->count == pins->capacity)) {
+        uint32_t capacity = (pins == NULL) ? 16 : 2 * pins->capacity;
+        struct wfs_pins *newPins = (struct wfs_pins *)realloc(pins, sizeof(struct wfs_pins) + capacity * sizeof(uint32_t));
+        if (newPins == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        if (pins == NULL) {
+            newPins->count = 0;
+        }
+        newPins->capacity = capacity;
+        pins = newPins;
+        pthread_setspecific(key, pins);
+    }
+    pins->segments[pins->count++] = segment;
+}
+
+// Keep segment mapped until calling thread calls cacheRelease. The pwrite engine maps it if it isn't, in place of a
+// segment no thread holds and none used since cacheHand last passed it. While threads hold more than cacheSlots
+// segments, all of them stay mapped. Everything else in the segment range is PROT_NONE, so a stray access crashes
+void cacheGet(uint32_t segment) {
+    struct wfs_pins *held = (struct wfs_pins *)pthread_getspecific(cacheKey);
+    for (uint32_t i = (held == NULL) ? 0 : held->count; i > 0; i--) {
+        if (held->segments[i - 1] == segment) { // Held already
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&cacheLock);
+    if (!cacheMapped[segment]) {
+        uint32_t segmentSize = superblock->segment_size;
+        for (uint32_t tries = 0; (cacheCount >= cacheSlots) && (tries < 2 * cacheCount); tries++) {
+            cacheHand %= cacheCount;
+            uint32_t victim = cacheRing[cacheHand];
+            if ((cacheRefs[victim] > 0) || (cacheMapped[victim] == 2)) { // Held, or second chance
+                cacheMapped[victim] = (cacheRefs[victim] > 0) ? cacheMapped[victim] : 1;
+                cacheHand++;
+                continue;
+            }
+            if (mmap(tail + segmentOffset(victim), segmentSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+                perror("Error unmapping segment");
+                exit(EXIT_FAILURE);
+            }
+            cacheMapped[victim] = 0;
+            cacheRing[cacheHand] = cacheRing[--cacheCount];
+        }
+        if (mmap(tail + segmentOffset(segment), segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, diskFd, segmentOffset(segment)) == MAP_FAILED) {
+            perror("Error mapping segment");
+            exit(EXIT_FAILURE);
+        }
+        cacheRing[cacheCount++] = segment;
+        cacheLoads++;
+    }
+    cacheMapped[segment] = 2;
+    cacheRefs[segment]++;
+    pthread_mutex_unlock(&cacheLock);
+    holdSegment(cacheKey, segment);
+}
+
+// Let go of segments a thread holds, so they may be unmapped again. Pointers into them are no longer safe to use
+void releaseHeld(struct wfs_pins *held) {
+    if (held->count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&cacheLock);
+    for (uint32_t i = 0; i < held->count; i++) {
+        cacheRefs[held->segments[i]]--;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    held->count = 0;
+}
+
+// Let go of segments calling thread holds. Handlers do at the end of every request
+void cacheRelease(void) {
+    struct wfs_pins *held = (struct wfs_pins *)pthread_getspecific(cacheKey);
+    if (held != NULL) {
+        releaseHeld(held);
+    }
+}
+
+// Let go of segments of a thread that exits
+void freeHeld(void *held) {
+    releaseHeld((struct wfs_pins *)held);
+    free(held);
+}
+
+// Get log entry at disk offset. Its segment stays mapped until calling thread calls cacheRelease
+struct wfs_log_entry *logEntryAt(uint64_t offset) {
+    storage->map(segmentOf(offset));
+    return (struct wfs_log_entry *)(tail + offset);
+}
+
+// Get latest log entry for inode number
+struct wfs_log_entry *getInode(int inodeNum) {
+    // Error Checking
+    if ((inodeNum < 0) || (inodeNum >= inodeMapSize) || (inodeMap[inodeNum] == 0)) {
+        return NULL;
+    }
+
+    return logEntryAt(inodeMap[inodeNum]);
+}
+
+// Point inode map at latest log entry for inode number
+void setInode(int inodeNum, struct wfs_log_entry *logEntry) {
+    // Grow inode map if inode number doesn't fit
+    if (inodeNum >= inodeMapSize) {
+        int newSize = (inodeMapSize == 0) ? MAX_INODES : inodeMapSize;
+        while (newSize <= inodeNum) {
+            newSize *= 2;
+        }
+        uint64_t *newMap = (uint64_t *)realloc(inodeMap, newSize * sizeof(uint64_t));
+        if (newMap == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        // Zero new slots
+        memset(newMap + inodeMapSize, 0, (newSize - inodeMapSize) * sizeof(uint64_t));
+        inodeMap = newMap;
+
+        // Grow extent maps alongside
+        struct wfs_extent_map *newExtentMaps = (struct wfs_extent_map *)realloc(extentMaps, newSize * sizeof(struct wfs_extent_map));
+        if (newExtentMaps == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        memset(newExtentMaps + inodeMapSize, 0, (newSize - inodeMapSize) * sizeof(struct wfs_extent_map));
+        extentMaps = newExtentMaps;
+
+        // And open files
+        struct wfs_open_file *newFiles = (struct wfs_open_file *)realloc(openFiles, newSize * sizeof(struct wfs_open_file));
+        if (newFiles == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        memset(newFiles + inodeMapSize, 0, (newSize - inodeMapSize) * sizeof(struct wfs_open_file));
+        openFiles = newFiles;
+        inodeMapSize = newSize;
+    }
+
+    // Offset 0 is the superblock, so it marks an inode without a log entry
+    inodeMap[inodeNum] = (logEntry == NULL) ? 0 : (char *)(logEntry) - tail;
+}
+
+// Get chunk list of shared extent log entry
+struct wfs_shared *sharedOf(struct wfs_log_entry *logEntry) {
+    return (struct wfs_shared *)(logEntry->data + sizeof(struct wfs_extent));
+}
+
+// Start tracking chunk held by log entry at disk offset entry, and make it findable by fingerprint
+void addChunk(uint32_t id, uint64_t entry) {
+    // Grow chunk map if chunk id doesn't fit
+    if (id >= chunkMapSize) {
+        uint32_t newSize = (chunkMapSize == 0) ? MAX_INODES : chunkMapSize;
+        while (newSize <= id) {
+            newSize *= 2;
+        }
+        struct wfs_chunk *newChunks = (struct wfs_chunk *)realloc(chunks, newSize * sizeof(struct wfs_chunk));
+        if (newChunks == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        memset(newChunks + chunkMapSize, 0, (newSize - chunkMapSize) * sizeof(struct wfs_chunk));
+        chunks = newChunks;
+        chunkMapSize = newSize;
+    }
+    if (id > chunkCounter) {
+        chunkCounter = id;
+    }
+
+    struct wfs_chunk *chunk = &chunks[id];
+    chunk->entry = entry;
+    chunk->refs = 0;
+    chunk->print = ((struct wfs_extent *)logEntryAt(entry)->data)->file_size;
+    chunk->next = chunkBuckets[chunk->print % CHUNK_BUCKETS];
+    chunkBuckets[chunk->print % CHUNK_BUCKETS] = id;
+}
+
+// Count size more live bytes in segment
+void addLive(uint32_t segment, uint32_t size) {
+    __atomic_add_fetch(&segmentUsage[segment].live, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&logLiveBytes, size, __ATOMIC_RELAXED);
+}
+
+// Count size fewer live bytes in segment
+void subLive(uint32_t segment, uint32_t size) {
+    __atomic_sub_fetch(&segmentUsage[segment].live, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&logLiveBytes, size, __ATOMIC_RELAXED);
+}
+
+// Stop tracking chunk nothing refers to anymore and mark its log entry deleted
+void removeChunk(uint32_t id) {
+    struct wfs_chunk *chunk = &chunks[id];
+    // Unlink from fingerprint hash bucket
+    uint32_t *link = &chunkBuckets[chunk->print % CHUNK_BUCKETS];
+    while (*link != id) {
+        link = &chunks[*link].next;
+    }
+    *link = chunk->next;
+
+    // Chunk log entry refers to nothing, so it's simply marked deleted
+    struct wfs_log_entry *logEntry = logEntryAt(chunk->entry);
+    if (logEntry->inode.deleted != 1) {
+        logEntry->inode.deleted = 1;
+        subLive(segmentOf(chunk->entry), logEntry->inode.size);
+    }
+    chunk->entry = 0;
+}
+
+// Count another reference to each chunk listed
+void retainChunks(uint32_t *ids, uint32_t count) {
+    pthread_mutex_lock(&chunkLock);
+    for (uint32_t i = 0; i < count; i++) {
+        if ((ids[i] < chunkMapSize) && (chunks[ids[i]].entry != 0)) {
+            chunks[ids[i]].refs++;
+        }
+    }
+    pthread_mutex_unlock(&chunkLock);
+}
+
+// Drop a reference to each chunk listed, removing chunks nothing refers to anymore. Caller holds fsLock for writing
+void releaseChunks(uint32_t *ids, uint32_t count) {
+    pthread_mutex_lock(&chunkLock);
+    for (uint32_t i = 0; i < count; i++) {
+        if ((ids[i] < chunkMapSize) && (chunks[ids[i]].entry != 0) && (chunks[ids[i]].refs > 0) && (--chunks[ids[i]].refs == 0)) {
+            removeChunk(ids[i]);
+        }
+    }
+    pthread_mutex_unlock(&chunkLock);
+}
+
+// Mark log entry deleted and take its bytes off its segment's live count
+void killLogEntry(struct wfs_log_entry *logEntry) {
+    if (logEntry->inode.deleted != 1) {
+        logEntry->inode.deleted = 1;
+        subLive(segmentOf((char *)(logEntry) - tail), logEntry->inode.size);
+        // Chunks it lists lose a reference
+        if (logEntry->inode.flags & WFS_LOG_SHARED) {
+            releaseChunks(sharedOf(logEntry)->chunks, sharedOf(logEntry)->count);
+        }
+    }
+}
+
+// Check if log entry is the latest log entry of its inode or holds live file data
+int isLive(int inodeNum, uint64_t entry) {
+    if (inodeNum >= inodeMapSize) {
+        return 0;
+    }
+    if (inodeMap[inodeNum] == entry) {
+        return 1;
+    }
+    struct wfs_extent_map *map = &extentMaps[inodeNum];
+    for (uint32_t i = 0; i < map->count; i++) {
+        if (map->extents[i].entry == entry) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Mark log entry deleted once it's neither the latest log entry of its inode nor holds live file data
+void releaseLogEntry(int inodeNum, uint64_t entry) {
+    if (!isLive(inodeNum, entry)) {
+        killLogEntry(logEntryAt(entry));
+    }
+}
+
+// Add extent to file's extent map, trimming the parts of older extents it overwrites. Only the overwritten part of the
+// map is touched. Caller holds fsLock for writing
+void addExtent(int inodeNum, uint64_t offset, uint64_t length, uint64_t data, uint64_t entry) {
+    struct wfs_extent_map *map = &extentMaps[inodeNum];
+    uint64_t end = offset + length;
+    struct wfs_extent_ref newExtent = { offset, length, data, entry };
+
+    // Binary search for first old extent ending after new one starts. Old extents it overlaps follow it
+    uint32_t first = 0;
+    uint32_t high = map->count;
+    while (first < high) {
+        uint32_t mid = first + (high - first) / 2;
+        if (map->extents[mid].offset + map->extents[mid].length <= offset) {
+            first = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    uint32_t last = first; // One past last overlapped old extent
+    while ((last < map->count) && (map->extents[last].offset < end)) {
+        last++;
+    }
+
+    // Overlapped range is replaced by the new extent and what's left of the first and last old extents around it.
+    // At worst one old extent is split in two
+    struct wfs_extent_ref replacement[3];
+    uint32_t replacementCount = 0;
+    if ((first < last) && (map->extents[first].offset < offset)) { // Keep part before
+        struct wfs_extent_ref old = map->extents[first];
+        struct wfs_extent_ref before = { old.offset, offset - old.offset, old.data, old.entry };
+        replacement[replacementCount++] = before;
+    }
+    replacement[replacementCount++] = newExtent;
+    if ((first < last) && (map->extents[last - 1].offset + map->extents[last - 1].length > end)) { // Keep part after
+        struct wfs_extent_ref old = map->extents[last - 1];
+        struct wfs_extent_ref after = { end, old.offset + old.length - end, old.data + (end - old.offset), old.entry };
+        replacement[replacementCount++] = after;
+    }
+
+    // Remember log entries whose data is entirely overwritten. They may be dead once the map no longer lists them
+    uint32_t coveredCount = 0;
+    for (uint32_t i = first; i < last; i++) {
+        struct wfs_extent_ref *old = &map->extents[i];
+        if ((old->offset >= offset) && (old->offset + old->length <= end)) {
+            if (coveredCount == coveredCapacity) {
+                uint32_t newCapacity = (coveredCapacity == 0) ? 16 : 2 * coveredCapacity;
+                uint64_t *newCovered = (uint64_t *)realloc(coveredEntries, newCapacity * sizeof(uint64_t));
+                if (newCovered == NULL) { // Memory allocation failed
+                    perror("Memory allocation error");
+                    exit(EXIT_FAILURE);
+                }
+                coveredEntries = newCovered;
+                coveredCapacity = newCapacity;
+            }
+            coveredEntries[coveredCount++] = old->entry;
+        }
+    }
+
+    // Splice replacement into map, doubling its capacity when it's full
+    uint32_t count = map->count - (last - first) + replacementCount;
+    if (count > map->capacity) {
+        uint32_t newCapacity = (map->capacity == 0) ? 4 : 2 * map->capacity;
+        while (newCapacity < count) {
+            newCapacity *= 2;
+        }
+        struct wfs_extent_ref *extents = (struct wfs_extent_ref *)realloc(map->extents, newCapacity * sizeof(struct wfs_extent_ref));
+        if (extents == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        map->extents = extents;
+        map->capacity = newCapacity;
+    }
+    memmove(&map->extents[first + replacementCount], &map->extents[last], (map->count - last) * sizeof(struct wfs_extent_ref));
+    memcpy(&map->extents[first], replacement, replacementCount * sizeof(struct wfs_extent_ref));
+    map->count = count;
+
+    for (uint32_t i = 0; i < coveredCount; i++) {
+        releaseLogEntry(inodeNum, coveredEntries[i]);
+    }
+}
+
+// Drop every extent of file and mark the log entries holding them deleted
+void clearExtents(int inodeNum) {
+    struct wfs_extent_map *map = &extentMaps[inodeNum];
+    for (uint32_t i = 0; i < map->count; i++) {
+        killLogEntry(logEntryAt(map->extents[i].entry));
+    }
+    free(map->extents);
+    map->extents = NULL;
+    map->count = 0;
+    map->capacity = 0;
+}
+
+// Index file data held by log entry
+void indexFileData(struct wfs_log_entry *logEntry) {
+    int inodeNum = logEntry->inode.inode_number;
+    uint64_t entry = (char *)(logEntry) - tail;
+    if (logEntry->inode.flags & WFS_LOG_EXTENT) {
+        // Extent overwrites part of file
+        struct wfs_extent *extent = (struct wfs_extent *)logEntry->data;
+        if (extent->length > 0) {
+            addExtent(inodeNum, extent->offset, extent->length, entry + sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent), entry);
+        }
+    } else {
+        // Whole file replaces all extents
+        clearExtents(inodeNum);
+        uint32_t dataSize = logEntry->inode.size - sizeof(struct wfs_log_entry);
+        if (dataSize > 0) {
+            addExtent(inodeNum, 0, dataSize, entry + sizeof(struct wfs_log_entry), entry);
+        }
+    }
+}
+
+// Index directory bucket held by log entry. It replaces the bucket's earlier log entry
+void indexDirBucket(struct wfs_log_entry *logEntry) {
+    uint64_t entry = (char *)(logEntry) - tail;
+    addExtent(logEntry->inode.inode_number, ((struct wfs_dir *)logEntry->data)->bucket, 1, entry, entry);
+}
+
+// Get decompressed extent cache slot of log entry
+uint32_t zcacheSlot(uint64_t entry) {
+    return (uint32_t)((entry * 0x9e3779b97f4a7c15ull) >> 32) % ZCACHE_SIZE;
+}
+
+// Write count buffers back to back at disk offset of disk image through the mapping. Log entries built in place are
+// there already. Returns 0
+int mmapWrite(uint64_t offset, struct iovec *iov, int count) {
+    for (int i = 0; i < count; i++) {
+        if (iov[i].iov_base != tail + offset) {
+            memcpy(tail + offset, iov[i].iov_base, iov[i].iov_len);
+        }
+        offset += iov[i].iov_len;
+    }
+    return 0;
+}
+
+// Write count buffers back to back at disk offset of disk image file. Whole update moves in one system call, and
+// short writes go on where they stopped. Returns 0 or -EIO
+int pwriteWrite(uint64_t offset, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = pwritev(diskFd, iov, (count < STORAGE_IOV_MAX) ? count : STORAGE_IOV_MAX, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error writing disk image");
+            return -EIO;
+        }
+        offset += written;
+        while ((count > 0) && ((size_t)written >= iov->iov_len)) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Get scratch space of calling thread under key holding at least size bytes
+char *growStage(pthread_key_t key, uint32_t size) {
+    struct wfs_stage *stage = (struct wfs_stage *)pthread_getspecific(key);
+    if ((stage == NULL) || (stage->capacity < size)) {
+        uint64_t capacity = (stage == NULL) ? 4096 : stage->capacity;
+        while (capacity < size) {
+            capacity *= 2;
+        }
+        stage = (struct wfs_stage *)realloc(stage, sizeof(struct wfs_stage) + capacity);
+        if (stage == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        stage->capacity = capacity;
+        pthread_setspecific(key, stage);
+    }
+    return stage->data;
+}
+
+// Get scratch space of calling thread holding at least size bytes. It is reused by the thread's next update
+char *stageBuffer(uint32_t size) {
+    return growStage(stageKey, size);
+}
+
+// Get scratch space of calling thread for write data holding at least size bytes. The write it holds builds its log
+// entries in stageBuffer, so the two never overlap
+char *writeStage(uint32_t size) {
+    return growStage(writeStageKey, size);
+}
+
+// Read size bytes at disk offset of disk image into buf through the mapping. Returns 0
+int mmapRead(uint64_t offset, void *buf, size_t size) {
+    memcpy(buf, tail + offset, size);
+    return 0;
+}
+
+// Read size bytes at disk offset of disk image file into buf. Pages stay in page cache without being mapped into
+// mount.wfs. Returns 0 or -EIO
+int preadRead(uint64_t offset, void *buf, size_t size) {
+    while (size > 0) {
+        ssize_t got = pread(diskFd, buf, size, offset);
+        if ((got < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (got <= 0) {
+            perror("Error reading disk image");
+            return -EIO;
+        }
+        buf = (char *)buf + got;
+        offset += got;
+        size -= got;
+    }
+    return 0;
+}
+
+// Copy length bytes of file data starting at file offset start out of extent. Compressed data is decompressed
+// once and kept in the cache, and is addressed as if it weren't compressed
+int readExtent(struct wfs_extent_ref *extent, uint64_t start, uint64_t length, char *buf) {
+    struct wfs_log_entry *logEntry = logEntryAt(extent->entry);
+    uint64_t pos = extent->data + (start - extent->offset);
+    if (!(logEntry->inode.flags & (WFS_LOG_COMPRESSED | WFS_LOG_SHARED))) {
+        return storage->read(pos, buf, length);
+    }
+    pos -= extent->entry + sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent);
+
+    // Shared data is read from the chunks it spans
+    if (logEntry->inode.flags & WFS_LOG_SHARED) {
+        struct wfs_shared *shared = sharedOf(logEntry);
+        pos += shared->skip;
+        while (length > 0) {
+            uint32_t id = shared->chunks[pos / CHUNK_SIZE];
+            if ((id >= chunkMapSize) || (chunks[id].entry == 0)) {
+                fprintf(stderr, "Missing chunk %u\n", id);
+                return -EIO;
+            }
+            uint64_t copy = CHUNK_SIZE - pos % CHUNK_SIZE;
+            if (copy > length) {
+                copy = length;
+            }
+            struct wfs_extent_ref chunk = { 0, CHUNK_SIZE, chunks[id].entry + sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent), chunks[id].entry };
+            int ret = readExtent(&chunk, pos % CHUNK_SIZE, copy, buf);
+            if (ret != 0) {
+                return ret;
+            }
+            buf += copy;
+            pos += copy;
+            length -= copy;
+        }
+        return 0;
+    }
+
+    uint32_t slot = zcacheSlot(extent->entry);
+    pthread_mutex_lock(&zcacheLocks[slot]);
+    if (zcache[slot].entry != extent->entry) {
+        // Cache miss. Replace whatever was in this slot
+        struct wfs_extent *header = (struct wfs_extent *)logEntry->data;
+        char *data = (char *)malloc(header->length);
+        if (data == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        uLongf dataLength = header->length;
+        uLong compressedLength = logEntry->inode.size - WFS_EXTENT_ENTRY_SIZE(0);
+        // Padding after compressed bytes is ignored by zlib
+        if ((uncompress((Bytef *)data, &dataLength, (Bytef *)(header + 1), compressedLength) != Z_OK) || (dataLength != header->length)) {
+            pthread_mutex_unlock(&zcacheLocks[slot]);
+            free(data);
+            fprintf(stderr, "Corrupt compressed extent at %lu\n", (unsigned long)extent->entry);
+            return -EIO;
+        }
+        free(zcache[slot].data);
+        zcache[slot].entry = extent->entry;
+        zcache[slot].data = data;
+    }
+    memcpy(buf, zcache[slot].data + pos, length);
+    pthread_mutex_unlock(&zcacheLocks[slot]);
+
+    return 0;
+}
+
+// Forget decompressed data of log entries between disk offsets start and end, before their space is reused
+void zcacheDrop(uint64_t start, uint64_t end) {
+    for (int i = 0; i < ZCACHE_SIZE; i++) {
+        pthread_mutex_lock(&zcacheLocks[i]);
+        if ((zcache[i].entry >= start) && (zcache[i].entry < end)) {
+            free(zcache[i].data);
+            zcache[i].entry = 0;
+            zcache[i].data = NULL;
+        }
+        pthread_mutex_unlock(&zcacheLocks[i]);
+    }
+}
+
+// Find published chunk holding the same CHUNK_SIZE bytes as data. Returns its id, or 0 if there is none.
+// Caller holds fsLock and chunkLock
+uint32_t findChunk(const char *data, uint32_t print) {
+    char chunkData[CHUNK_SIZE];
+    for (uint32_t id = chunkBuckets[print % CHUNK_BUCKETS]; id != 0; id = chunks[id].next) {
+        if (chunks[id].print != print) {
+            continue;
+        }
+        // Fingerprints can collide, so compare bytes
+        struct wfs_extent_ref chunk = { 0, CHUNK_SIZE, chunks[id].entry + sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent), chunks[id].entry };
+        if ((readExtent(&chunk, 0, CHUNK_SIZE, chunkData) == 0) && (memcmp(chunkData, data, CHUNK_SIZE) == 0)) {
+            return id;
+        }
+    }
+    return 0;
+}
+
+// Build extent log entry holding length bytes of file data at file offset in extentEntry, which has room for
+// WFS_EXTENT_ENTRY_SIZE(length) bytes. Bytes are compressed if that's on and saves space
+void buildExtentEntry(struct wfs_log_entry *extentEntry, struct wfs_inode *inode, const char *buf, uint32_t length, uint64_t offset, uint64_t fileSize) {
+    extentEntry->inode = *inode; // Copy inode of file
+    extentEntry->inode.deleted = 0;
+    extentEntry->inode.flags = (extentEntry->inode.flags | WFS_LOG_EXTENT) & ~(WFS_LOG_COMPRESSED | WFS_LOG_SHARED);
+    extentEntry->inode.size = WFS_EXTENT_ENTRY_SIZE(length);
+    struct wfs_extent *extent = (struct wfs_extent *)extentEntry->data;
+    extent->offset = offset;
+    extent->length = length;
+    extent->file_size = fileSize;
+    if (length == 0) {
+        return;
+    }
+
+    // Keep compressed bytes only if they're fewer. zlib fails if they don't fit in the space for the raw bytes
+    uLongf compressedLength = length;
+    if (compressData && (length >= COMPRESS_MIN) && (compress2((Bytef *)(extent + 1), &compressedLength, (const Bytef *)buf, length, Z_BEST_SPEED) == Z_OK)
+        && (WFS_EXTENT_ENTRY_SIZE(compressedLength) < extentEntry->inode.size)) {
+        extentEntry->inode.flags |= WFS_LOG_COMPRESSED;
+        extentEntry->inode.size = WFS_EXTENT_ENTRY_SIZE(compressedLength);
+        memset((char *)(extent + 1) + compressedLength, 0, length - compressedLength); // Zero padding
+    } else {
+        memcpy(extent + 1, buf, length); // Copy raw bytes
+        memset((char *)(extent + 1) + length, 0, extentEntry->inode.size - (sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent)) - length); // Zero padding
+    }
+}
+
+// Build extent log entry like buildExtentEntry, in memory of its own that the caller frees
+struct wfs_log_entry *newExtentEntry(struct wfs_inode *inode, const char *buf, uint32_t length, uint64_t offset, uint64_t fileSize) {
+    struct wfs_log_entry *extentEntry = (struct wfs_log_entry *)calloc(1, WFS_EXTENT_ENTRY_SIZE(length));
+    if (extentEntry == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    buildExtentEntry(extentEntry, inode, buf, length, offset, fileSize);
+    return extentEntry;
+}
+
+// Get bytes of log free for new log entries, including segments the image can grow by but not segments kept for the
+// cleaner and for unlink
+int64_t logFree(void) {
+    int64_t segments = (int64_t)__atomic_load_n(&freeSegments, __ATOMIC_RELAXED) - CLEANER_SEGMENTS - REMOVAL_SEGMENTS;
+    segments += superblock->segment_max - __atomic_load_n(&superblock->segment_count, __ATOMIC_RELAXED);
+    return segments * superblock->segment_size + (superblock->segment_size - __atomic_load_n(&headUsed, __ATOMIC_RELAXED));
+}
+
+// Check if few enough segments are free that the cleaner should reclaim any segment it can
+int logLow(void) {
+    uint32_t low = __atomic_load_n(&superblock->segment_count, __ATOMIC_RELAXED) / 8;
+    return __atomic_load_n(&freeSegments, __ATOMIC_RELAXED) < ((low > 2 * CLEANER_SEGMENTS) ? low : 2 * CLEANER_SEGMENTS);
+}
+
+// Wake cleaner thread
+void wakeCleaner(void) {
+    pthread_mutex_lock(&cleanerLock);
+    pthread_cond_signal(&cleanerCond);
+    pthread_mutex_unlock(&cleanerLock);
+}
+
+// Wake cleaner thread and wait for its next pass. Returns 1 if that pass reclaimed a segment, 0 if it didn't or the
+// cleaner isn't running
+int waitCleaner(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 2; // A pass waits at most a second for work, and longer only under the rate limit
+    pthread_mutex_lock(&cleanerLock);
+    uint64_t passes = cleanerPasses;
+    pthread_cond_signal(&cleanerCond);
+    while (cleanerRunning && !cleanerStop && (cleanerPasses == passes) && (pthread_cond_timedwait(&cleanedCond, &cleanerLock, &deadline) != ETIMEDOUT));
+    int reclaimed = (cleanerPasses != passes) && (cleanerReclaimed != 0);
+    pthread_mutex_unlock(&cleanerLock);
+    return reclaimed;
+}
+
+// Grow disk image, at most doubling its segments. New segments are mapped right behind the old ones, so pointers
+// into the image stay valid. The pwrite engine maps them when first used. Caller holds commitLock. Returns 0, or -1
+// if image can't grow
+int growDisk(void) {
+    uint32_t count = superblock->segment_count;
+    if ((count == superblock->segment_max) || (diskSize % sysconf(_SC_PAGESIZE) != 0)) {
+        return -1;
+    }
+    uint32_t newCount = (count > superblock->segment_max - count) ? superblock->segment_max : 2 * count;
+    uint64_t newSize = segmentOffset(newCount);
+
+    // Extend image file with blocks allocated, so a full host filesystem fails here instead of on a store through
+    // the mapping
+    int err = posix_fallocate(diskFd, diskSize, newSize - diskSize);
+    if (err != 0) {
+        errno = err;
+        perror("Error growing disk image");
+        return -1;
+    }
+    if (storage->whole && (mmap(tail + diskSize, newSize - diskSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, diskFd, diskSize) == MAP_FAILED)) {
+        perror("Error mapping grown disk image");
+        return -1;
+    }
+    diskSize = newSize;
+
+    // New segments are free
+    memset(segmentUsage + count, 0, (newCount - count) * sizeof(struct wfs_segment_usage));
+    __atomic_add_fetch(&freeSegments, newCount - count, __ATOMIC_RELAXED);
+    __atomic_store_n(&superblock->segment_count, newCount, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+// Reserve size contiguous bytes in head segment, moving to a free segment if they don't fit, as long as keep free
+// segments are left. Sets reservation to the commit order of the reserved space. Returns its disk offset, or 0 if log
+// is full
+uint64_t reserveLog(uint32_t size, uint32_t keep, uint64_t *reservation) {
+    if (size > superblock->segment_size) { // Never fits in a segment
+        return 0;
+    }
+
+    pthread_mutex_lock(&commitLock);
+    if (logFailed) { // Nothing may land past the hole a failed write left
+        pthread_mutex_unlock(&commitLock);
+        return 0;
+    }
+    if (headUsed + size > superblock->segment_size) {
+        // Only the cleaner may use the last CLEANER_SEGMENTS free segments, and only it and unlink the
+        // REMOVAL_SEGMENTS before them. Grow image before touching them
+        if ((freeSegments <= CLEANER_SEGMENTS + REMOVAL_SEGMENTS) && (growDisk() == 0)) {
+            fprintf(stderr, "Grew disk image to %u segments\n", superblock->segment_count);
+        }
+        if (freeSegments <= keep) {
+            pthread_mutex_unlock(&commitLock);
+            return 0;
+        }
+        // Close head segment and continue in first free segment
+        segmentUsage[headSegment].written = headUsed;
+        __atomic_add_fetch(&logClosedBytes, headUsed, __ATOMIC_RELAXED);
+        uint32_t segment = 0;
+        while (segmentUsage[segment].seq != 0) {
+            segment++;
+        }
+        segmentUsage[segment].seq = ++segmentSeq;
+        subLive(segment, segmentUsage[segment].live);
+        segmentUsage[segment].written = 0;
+        __atomic_sub_fetch(&freeSegments, 1, __ATOMIC_RELAXED);
+        segmentTickets[segment] = logReserved;
+        headSegment = segment;
+        __atomic_store_n(&headUsed, 0, __ATOMIC_RELAXED);
+    }
+    uint64_t offset = segmentOffset(headSegment) + headUsed;
+    __atomic_add_fetch(&headUsed, size, __ATOMIC_RELAXED);
+    *reservation = logReserved;
+    logReserved += size;
+    pthread_mutex_unlock(&commitLock);
+
+    return offset;
+}
+
+// Wait for earlier reservations to be written, then move head past reservation ending at disk offset end. A failed
+// reservation, and every one after it, leaves head where it was. Returns 0, or -EIO if head didn't move
+int commitLog(uint64_t reservation, uint32_t size, uint64_t end, int failed) {
+    pthread_mutex_lock(&commitLock);
+    while (logHead != reservation) {
+        pthread_cond_wait(&commitCond, &commitLock);
+    }
+    logHead += size;
+    if (failed) {
+        logFailed = 1;
+    }
+    if (logFailed) {
+        pthread_cond_broadcast(&commitCond);
+        pthread_mutex_unlock(&commitLock);
+        return -EIO;
+    }
+    head = tail + end; // Update head
+    superblock->head = end; // Persist head in superblock
+
+    // Remember range for next sync. Commits in one segment are back to back, so they extend the same range
+    if ((syncRangeCount > 0) && (syncRanges[syncRangeCount - 1].end == end - size)) {
+        syncRanges[syncRangeCount - 1].end = end;
+    } else {
+        if (syncRangeCount == syncRangeCapacity) {
+            uint32_t newCapacity = (syncRangeCapacity == 0) ? 16 : 2 * syncRangeCapacity;
+            struct wfs_sync_range *newRanges = (struct wfs_sync_range *)realloc(syncRanges, newCapacity * sizeof(struct wfs_sync_range));
+            if (newRanges == NULL) { // Memory allocation failed
+                perror("Memory allocation error");
+                exit(EXIT_FAILURE);
+            }
+            syncRanges = newRanges;
+            syncRangeCapacity = newCapacity;
+        }
+        syncRanges[syncRangeCount].start = end - size;
+        syncRanges[syncRangeCount].end = end;
+        syncRangeCount++;
+    }
+
+    pthread_cond_broadcast(&commitCond);
+    pthread_mutex_unlock(&commitLock);
+
+    return 0;
+}
+
+// Write disk range back to image file and wait for it. Range needn't be page aligned
+int syncRange(uint64_t start, uint64_t end) {
+    uint64_t pageStart = start & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+    // Flushes the page cache of the file, so it covers what pwritev wrote as well as what went through the mapping
+    return msync(tail + pageStart, end - pageStart, MS_SYNC);
+}
+
+// Write committed ranges back to image file through the mapping and wait for them
+int mmapSync(struct wfs_sync_range *ranges, uint32_t count) {
+    int ret = 0;
+    for (uint32_t i = 0; (i < count) && (ret == 0); i++) {
+        ret = syncRange(ranges[i].start, ranges[i].end);
+    }
+    return ret;
+}
+
+// Write committed ranges back to image file and wait for them. Segments aren't all mapped, so the whole image file is
+// flushed at once
+int pwriteSync(struct wfs_sync_range *ranges, uint32_t count) {
+    (void)ranges;
+    return (count > 0) ? fdatasync(diskFd) : 0;
+}
+
+// Whole image is mapped already
+void mmapMap(uint32_t segment) {
+    (void)segment;
+}
+
+// Storage engines --storage picks from
+const struct wfs_storage_ops mmapStorage = { "mmap", 1, mmapRead, mmapWrite, mmapSync, mmapMap };
+const struct wfs_storage_ops pwriteStorage = { "pwrite", 0, preadRead, pwriteWrite, pwriteSync, cacheGet };
+
+// Make log durable up to commit ticket target. Callers arriving while another thread syncs wait for it, and the
+// next sync covers all of them at once. Returns 0 or -EIO
+int syncLog(uint64_t target) {
+    pthread_mutex_lock(&syncLock);
+    while (syncedHead < target) {
+        if (syncing) {
+            pthread_cond_wait(&syncCond, &syncLock);
+            continue;
+        }
+        syncing = 1;
+        pthread_mutex_unlock(&syncLock);
+
+        // Take ranges committed so far. Commits go on into the other array meanwhile
+        pthread_mutex_lock(&commitLock);
+        struct wfs_sync_range *ranges = syncRanges;
+        uint32_t count = syncRangeCount;
+        uint32_t capacity = syncRangeCapacity;
+        syncRanges = syncBatch;
+        syncRangeCapacity = syncBatchCapacity;
+        syncRangeCount = 0;
+        uint64_t covered = logHead;
+        pthread_mutex_unlock(&commitLock);
+        syncBatch = ranges;
+        syncBatchCapacity = capacity;
+
+        // Log entries first, then superblock and segment usage table that lead mount to them
+        int ret = storage->sync(ranges, count);
+        if (ret == 0) {
+            ret = syncRange(0, superblock->checkpoints);
+        }
+        // Retry with the whole image file
+        if ((ret != 0) && (fdatasync(diskFd) == 0)) {
+            ret = 0;
+        }
+        // Put ranges back in front of those committed meanwhile, so the next sync covers them again
+        if (ret != 0) {
+            pthread_mutex_lock(&commitLock);
+            if (syncRangeCount + count > syncRangeCapacity) {
+                uint32_t newCapacity = 2 * (syncRangeCount + count);
+                struct wfs_sync_range *newRanges = (struct wfs_sync_range *)realloc(syncRanges, newCapacity * sizeof(struct wfs_sync_range));
+                if (newRanges == NULL) { // Memory allocation failed
+                    perror("Memory allocation error");
+                    exit(EXIT_FAILURE);
+                }
+                syncRanges = newRanges;
+                syncRangeCapacity = newCapacity;
+            }
+            memmove(syncRanges + count, syncRanges, syncRangeCount * sizeof(struct wfs_sync_range));
+            memcpy(syncRanges, ranges, count * sizeof(struct wfs_sync_range));
+            syncRangeCount += count;
+            pthread_mutex_unlock(&commitLock);
+        }
+
+        pthread_mutex_lock(&syncLock);
+        syncing = 0;
+        if (ret == 0) {
+            syncedHead = covered;
+        }
+        pthread_cond_broadcast(&syncCond);
+        if (ret != 0) {
+            pthread_mutex_unlock(&syncLock);
+            perror("Error syncing disk image");
+            return -EIO;
+        }
+    }
+    pthread_mutex_unlock(&syncLock);
+
+    return 0;
+}
+
+// Get commit ticket that covers log entry. Caller holds fsLock, so log entry can't move
+uint64_t entryTicket(struct wfs_log_entry *logEntry) {
+    uint64_t offset = (char *)logEntry - tail;
+    uint32_t segment = segmentOf(offset);
+    pthread_mutex_lock(&commitLock);
+    int64_t ticket = segmentTickets[segment] + (int64_t)(offset - segmentOffset(segment)) + logEntry->inode.size;
+    pthread_mutex_unlock(&commitLock);
+    return (ticket < 0) ? 0 : ticket; // Log entries from before mount were synced at mount
+}
+
+// Get error of an update that got no log space: -EIO once a log write failed, else -ENOSPC
+int reserveError(void) {
+    return __atomic_load_n(&logFailed, __ATOMIC_RELAXED) ? -EIO : -ENOSPC;
+}
+
+// Reserve size bytes at head of log for log entries written in place, leaving keep free segments: 0 for the cleaner,
+// CLEANER_SEGMENTS for unlink and UPDATE_SEGMENTS for every other update. Returns disk offset of reserved space, or 0 if
+// log is full or failed
+uint64_t reserveLogEntries(uint32_t size, uint32_t keep, uint64_t *reservation) {
+    uint64_t offset = reserveLog(size, keep, reservation);
+    if (offset == 0) {
+        if (keep != 0) {
+            wakeCleaner(); // Let cleaner free space for the next try
+        }
+        perror("Insufficient disk space");
+    }
+    return offset;
+}
+
+// Seal log entry of an update. Chain log entries of one update, so mount replays all of them or none
+void sealLogEntry(struct wfs_log_entry *logEntry, int last) {
+    if (last) {
+        logEntry->inode.flags &= ~WFS_LOG_CONTINUED;
+    } else {
+        logEntry->inode.flags |= WFS_LOG_CONTINUED;
+    }
+    logEntry->inode.checksum = wfs_log_entry_checksum(logEntry);
+}
+
+// Commit size bytes of sealed log entries at disk offset, unless writing them failed. Returns 0, or -EIO if they
+// weren't written, an earlier write failed, or strict mode couldn't sync them. Caller publishes them only on 0, and
+// every later update fails
+int publishLogEntries(uint64_t offset, uint32_t size, uint64_t reservation, int cleaning, int failed) {
+    addLive(segmentOf(offset), size);
+    int ret = commitLog(reservation, size, offset + size, failed);
+
+    // Strict mode returns only once update is on disk. Cleaner syncs its copies before freeing the segment they came from
+    if ((ret == 0) && (syncMode == WFS_SYNC_STRICT) && !cleaning && (syncLog(reservation + size) != 0)) {
+        pthread_mutex_lock(&commitLock);
+        logFailed = 1;
+        pthread_mutex_unlock(&commitLock);
+        ret = -EIO;
+    }
+    if (ret != 0) { // Log entries stay dead
+        subLive(segmentOf(offset), size);
+        return ret;
+    }
+
+    // Start cleaning before writers run out of segments
+    if (!cleaning && logLow()) {
+        wakeCleaner();
+    }
+
+    return 0;
+}
+
+// Append log entries back to back in one segment, leaving keep free segments like reserveLogEntries. They are sealed
+// where they are, then written as one update. Returns 0, -ENOSPC if log is full, or -EIO like publishLogEntries.
+// Nothing was appended unless it returns 0
+int appendLogEntries(struct wfs_log_entry **logEntries, int count, struct wfs_log_entry **newEntries, uint32_t keep) {
+    uint32_t size = 0;
+    for (int i = 0; i < count; i++) {
+        size += logEntries[i]->inode.size;
+        sealLogEntry(logEntries[i], i == count - 1);
+    }
+
+    // Reserve space for all log entries at once
+    uint64_t reservation;
+    uint64_t offset = reserveLogEntries(size, keep, &reservation);
+    if (offset == 0) {
+        return reserveError();
+    }
+
+    // Write log entries into reserved space. Nobody else can see it yet. Caller uses them once they are written
+    storage->map(segmentOf(offset));
+    struct iovec iov[count];
+    char *addr = tail + offset;
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = logEntries[i];
+        iov[i].iov_len = logEntries[i]->inode.size;
+        newEntries[i] = (struct wfs_log_entry *)addr;
+        addr += logEntries[i]->inode.size;
+    }
+    int ret = storage->write(offset, iov, count);
+
+    return publishLogEntries(offset, size, reservation, keep == 0, ret != 0);
+}
+
+// Lock inodes in stripe order so threads updating overlapping sets can't deadlock
+void lockInodes(int *inodes, int count) {
+    int stripes[4];
+    int stripeCount = 0;
+    // Collect distinct stripes in ascending order
+    for (int i = 0; i < count; i++) {
+        int stripe = inodes[i] % INODE_LOCK_COUNT;
+        int pos = 0;
+        while ((pos < stripeCount) && (stripes[pos] < stripe)) {
+            pos++;
+        }
+        if ((pos < stripeCount) && (stripes[pos] == stripe)) {
+            continue;
+        }
+        memmove(stripes + pos + 1, stripes + pos, (stripeCount - pos) * sizeof(int));
+        stripes[pos] = stripe;
+        stripeCount++;
+    }
+    for (int i = 0; i < stripeCount; i++) {
+        pthread_mutex_lock(&inodeLocks[stripes[i]]);
+    }
+}
+
+// Unlock inodes locked by lockInodes
+void unlockInodes(int *inodes, int count) {
+    for (int i = 0; i < count; i++) {
+        // Stripe may be shared with an inode already unlocked
+        int shared = 0;
+        for (int j = 0; j < i; j++) {
+            if (inodes[j] % INODE_LOCK_COUNT == inodes[i] % INODE_LOCK_COUNT) {
+                shared = 1;
+            }
+        }
+        if (!shared) {
+            pthread_mutex_unlock(&inodeLocks[inodes[i] % INODE_LOCK_COUNT]);
+        }
+    }
+}
+
+// Get checkpoint region i (0 or 1)
+struct wfs_checkpoint *checkpointRegion(int i) {
+    return (struct wfs_checkpoint *)(tail + superblock->checkpoints + (uint64_t)i * superblock->checkpoint_size);
+}
+
+// Write inode map and extent maps to the older checkpoint region, so the next mount only replays log entries appended since
+void writeCheckpoint(void) {
+    // Updates hold their inode locks from appending until publishing, so with every stripe locked
+    // the maps cover every committed log entry
+    for (int i = 0; i < INODE_LOCK_COUNT; i++) {
+        pthread_mutex_lock(&inodeLocks[i]);
+    }
+    pthread_rwlock_rdlock(&fsLock);
+
+    // Lay out inode map, extent counts and extents. Trailing unused inode numbers are left out
+    uint32_t inodeCount = inodeMapSize;
+    while ((inodeCount > 0) && (inodeMap[inodeCount - 1] == 0) && (extentMaps[inodeCount - 1].count == 0)) {
+        inodeCount--;
+    }
+    uint64_t extentCount = 0;
+    for (uint32_t i = 0; i < inodeCount; i++) {
+        extentCount += extentMaps[i].count;
+    }
+    uint64_t countsOffset = inodeCount * sizeof(uint64_t);
+    uint64_t extentsOffset = (countsOffset + inodeCount * sizeof(uint32_t) + 7) & ~7;
+    uint32_t chunkCount = 0;
+    for (uint32_t i = 0; i < chunkMapSize; i++) {
+        chunkCount += (chunks[i].entry != 0);
+    }
+    uint64_t chunksOffset = extentsOffset + extentCount * sizeof(struct wfs_extent_ref);
+    // Files unlinked while open are still in the maps, so mount must know to drop them
+    uint32_t orphanCount = 0;
+    for (int i = 0; i < inodeMapSize; i++) {
+        orphanCount += openFiles[i].unlinked;
+    }
+    uint64_t orphansOffset = chunksOffset + chunkCount * sizeof(uint64_t);
+    uint64_t size = orphansOffset + orphanCount * sizeof(uint32_t);
+
+    // Overwrite older checkpoint. Clearing seq first keeps a half written checkpoint from being used
+    struct wfs_checkpoint *checkpoint = checkpointRegion(0);
+    struct wfs_checkpoint *other = checkpointRegion(1);
+    if (other->seq < checkpoint->seq) {
+        checkpoint = other;
+        other = checkpointRegion(0);
+    }
+    if (sizeof(struct wfs_checkpoint) + size > superblock->checkpoint_size) {
+        pthread_rwlock_unlock(&fsLock);
+        for (int i = INODE_LOCK_COUNT - 1; i >= 0; i--) {
+            pthread_mutex_unlock(&inodeLocks[i]);
+        }
+        fprintf(stderr, "Checkpoint needs %lu bytes but region has %u\n", (unsigned long)(sizeof(struct wfs_checkpoint) + size), superblock->checkpoint_size);
+        return;
+    }
+    __atomic_store_n(&checkpoint->seq, 0, __ATOMIC_RELEASE);
+    char *body = (char *)(checkpoint + 1);
+    memcpy(body, inodeMap, inodeCount * sizeof(uint64_t));
+    uint32_t *counts = (uint32_t *)(body + countsOffset);
+    struct wfs_extent_ref *extents = (struct wfs_extent_ref *)(body + extentsOffset);
+    for (uint32_t i = 0; i < inodeCount; i++) {
+        counts[i] = extentMaps[i].count;
+        if (counts[i] > 0) {
+            memcpy(extents, extentMaps[i].extents, counts[i] * sizeof(struct wfs_extent_ref));
+            extents += counts[i];
+        }
+    }
+    uint64_t *chunkEntries = (uint64_t *)(body + chunksOffset);
+    for (uint32_t i = 0; i < chunkMapSize; i++) {
+        if (chunks[i].entry != 0) {
+            *chunkEntries++ = chunks[i].entry;
+        }
+    }
+    uint32_t *orphans = (uint32_t *)(body + orphansOffset);
+    for (int i = 0; i < inodeMapSize; i++) {
+        if (openFiles[i].unlinked) {
+            *orphans++ = i;
+        }
+    }
+    pthread_mutex_lock(&commitLock);
+    checkpoint->head = superblock->head;
+    checkpoint->head_seq = segmentUsage[headSegment].seq;
+    checkpointHead = logHead;
+    uint64_t covered = logHead;
+    pthread_mutex_unlock(&commitLock);
+    checkpointTime = time(NULL);
+    checkpoint->size = size;
+    checkpoint->extent_count = extentCount;
+    checkpoint->inode_counter = __atomic_load_n(&inodeCounter, __ATOMIC_RELAXED);
+    checkpoint->inode_count = inodeCount;
+    checkpoint->chunk_count = chunkCount;
+    checkpoint->orphan_count = orphanCount;
+
+    pthread_rwlock_unlock(&fsLock);
+    for (int i = INODE_LOCK_COUNT - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&inodeLocks[i]);
+    }
+
+    // Checkpoint must not point mount at log entries that didn't make it to disk
+    if (syncLog(covered) != 0) {
+        return;
+    }
+
+    // Seal checkpoint
+    checkpoint->checksum = wfs_crc32c(0, &checkpoint->head_seq, sizeof(struct wfs_checkpoint) - offsetof(struct wfs_checkpoint, head_seq) + size);
+    __atomic_store_n(&checkpoint->seq, other->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Check if log entry a checkpoint points at is still in the log. Its deleted flag doesn't tell: it may have reached
+// disk before the log entry that replaced it did. Replaying the log after the checkpoint drops what died since
+int checkpointValid(uint64_t offset, uint32_t headSeq) {
+    if ((offset < superblock->segments) || (segmentOf(offset) >= superblock->segment_count)) {
+        return 0;
+    }
+    // Segment may have been cleaned, or cleaned and filled again, since checkpoint was taken
+    uint32_t seq = segmentUsage[segmentOf(offset)].seq;
+    return (seq != 0) && (seq <= headSeq);
+}
+
+// Load newest valid checkpoint into inode map and extent maps. Returns it, or NULL if there is none
+struct wfs_checkpoint *loadCheckpoint(void) {
+    struct wfs_checkpoint *checkpoint = NULL;
+    for (int i = 0; i < 2; i++) {
+        struct wfs_checkpoint *region = checkpointRegion(i);
+        if ((region->seq == 0) || (region->size > superblock->checkpoint_size - sizeof(struct wfs_checkpoint))) {
+            continue;
+        }
+        if (region->checksum != wfs_crc32c(0, &region->head_seq, sizeof(struct wfs_checkpoint) - offsetof(struct wfs_checkpoint, head_seq) + region->size)) {
+            continue;
+        }
+        if ((checkpoint == NULL) || (region->seq > checkpoint->seq)) {
+            checkpoint = region;
+        }
+    }
+    if (checkpoint == NULL) {
+        return NULL;
+    }
+
+    inodeCounter = checkpoint->inode_counter;
+    char *body = (char *)(checkpoint + 1);
+    uint64_t *map = (uint64_t *)body;
+    uint64_t countsOffset = checkpoint->inode_count * sizeof(uint64_t);
+    uint32_t *counts = (uint32_t *)(body + countsOffset);
+    struct wfs_extent_ref *extents = (struct wfs_extent_ref *)(body + ((countsOffset + checkpoint->inode_count * sizeof(uint32_t) + 7) & ~7));
+    if (checkpoint->inode_count > 0) {
+        setInode(checkpoint->inode_count - 1, NULL); // Size maps
+    }
+    for (uint32_t i = 0; i < checkpoint->inode_count; i++) {
+        // Drop log entries cleaned since checkpoint. Replaying newer log entries restores the copies that replaced them
+        if ((map[i] != 0) && checkpointValid(map[i], checkpoint->head_seq)) {
+            setInode(i, logEntryAt(map[i]));
+        }
+        if (counts[i] > 0) {
+            extentMaps[i].extents = (struct wfs_extent_ref *)malloc(counts[i] * sizeof(struct wfs_extent_ref));
+            if (extentMaps[i].extents == NULL) { // Memory allocation failed
+                perror("Memory allocation error");
+                exit(EXIT_FAILURE);
+            }
+            extentMaps[i].capacity = counts[i];
+        }
+        for (uint32_t j = 0; j < counts[i]; j++) {
+            if (checkpointValid(extents[j].entry, checkpoint->head_seq)) {
+                extentMaps[i].extents[extentMaps[i].count++] = extents[j];
+            }
+        }
+        extents += counts[i];
+    }
+
+    // Chunks follow extents. Reference counts are rebuilt once log is replayed
+    uint64_t *chunkEntries = (uint64_t *)extents;
+    for (uint32_t i = 0; i < checkpoint->chunk_count; i++) {
+        if (checkpointValid(chunkEntries[i], checkpoint->head_seq)) {
+            addChunk(logEntryAt(chunkEntries[i])->inode.inode_number, chunkEntries[i]);
+        }
+    }
+
+    return checkpoint;
+}
+
+// Cut log off at disk offset end in the i-th of the count segments sorted by sequence number. Later segments are freed
+void truncateLog(uint32_t *segments, uint32_t count, uint32_t i, uint64_t end) {
+    fprintf(stderr, "Log entry at %lu is torn or corrupt, truncating log\n", (unsigned long)end);
+    uint64_t start = segmentOffset(segments[i]);
+    if (end == start) {
+        // Segment holds nothing, so log ends in the one before it
+        if (i == 0) {
+            fprintf(stderr, "Root directory is corrupt\n");
+            exit(EXIT_FAILURE);
+        }
+        end = start = segmentOffset(segments[--i]);
+        end += (segments[i] == headSegment) ? headUsed : segmentUsage[segments[i]].written;
+    }
+
+    // Only log entries before end were replayed, so recount live bytes of the new head segment
+    uint32_t live = 0;
+    for (uint64_t curr = start; curr < end; curr += logEntryAt(curr)->inode.size) {
+        if (logEntryAt(curr)->inode.deleted != 1) {
+            live += logEntryAt(curr)->inode.size;
+        }
+    }
+    segmentUsage[segments[i]].live = live;
+
+    // Free later segments
+    for (uint32_t j = i + 1; j < count; j++) {
+        segmentUsage[segments[j]].seq = 0;
+        segmentUsage[segments[j]].live = 0;
+        segmentUsage[segments[j]].written = 0;
+        freeSegments++;
+    }
+
+    // Log continues from end
+    headSegment = segments[i];
+    headUsed = end - start;
+    segmentUsage[headSegment].written = 0;
+    segmentSeq = segmentUsage[headSegment].seq;
+    superblock->head = end;
+}
+
+// Track replayed chunk log entry. A later copy made by the cleaner replaces an earlier one
+void replayChunk(struct wfs_log_entry *logEntry) {
+    uint32_t id = logEntry->inode.inode_number;
+    uint64_t entry = (char *)(logEntry) - tail;
+    if ((id < chunkMapSize) && (chunks[id].entry != 0)) {
+        // Cleaner crashed before it could mark the earlier copy deleted
+        killLogEntry(logEntryAt(chunks[id].entry));
+        chunks[id].entry = entry;
+    } else {
+        addChunk(id, entry);
+    }
+}
+
+// Append log entry to array of count log entries, growing it in powers of two
+struct wfs_log_entry **pushEntry(struct wfs_log_entry **logEntries, uint64_t *count, struct wfs_log_entry *logEntry) {
+    if ((*count & (*count - 1)) == 0) { // Full at 0, 1, 2, 4, ...
+        logEntries = (struct wfs_log_entry **)realloc(logEntries, (*count == 0 ? 1 : *count * 2) * sizeof(struct wfs_log_entry *));
+        if (logEntries == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    logEntries[(*count)++] = logEntry;
+    return logEntries;
+}
+
+// Order log entries by disk offset
+int compareEntries(const void *a, const void *b) {
+    struct wfs_log_entry *x = *(struct wfs_log_entry **)a;
+    struct wfs_log_entry *y = *(struct wfs_log_entry **)b;
+    return (x > y) - (x < y);
+}
+
+// Count references to chunks once log is replayed. Shared extent log entries that are live, whether from the
+// checkpoint or the count replayed, refer to their chunks. Ones replayed that aren't live anymore are dropped, and so are
+// chunks nothing refers to. Takes ownership of replayed
+void countChunkRefs(struct wfs_log_entry **replayed, uint64_t count) {
+    // Collect live shared extent log entries in maps as well
+    for (int i = 0; i < inodeMapSize; i++) {
+        if ((inodeMap[i] != 0) && (logEntryAt(inodeMap[i])->inode.flags & WFS_LOG_SHARED)) {
+            replayed = pushEntry(replayed, &count, logEntryAt(inodeMap[i]));
+        }
+        for (uint32_t j = 0; j < extentMaps[i].count; j++) {
+            if (logEntryAt(extentMaps[i].extents[j].entry)->inode.flags & WFS_LOG_SHARED) {
+                replayed = pushEntry(replayed, &count, logEntryAt(extentMaps[i].extents[j].entry));
+            }
+        }
+        cacheRelease();
+    }
+    if (count > 0) {
+        qsort(replayed, count, sizeof(struct wfs_log_entry *), compareEntries);
+    }
+
+    // Drop dead log entries first. No chunk has a reference yet, so none is released
+    for (uint64_t i = 0; i < count; i++) {
+        cacheRelease();
+        storage->map(segmentOf((char *)(replayed[i]) - tail));
+        if ((replayed[i]->inode.deleted != 1) && !isLive(replayed[i]->inode.inode_number, (char *)(replayed[i]) - tail)) {
+            killLogEntry(replayed[i]);
+        }
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        cacheRelease();
+        storage->map(segmentOf((char *)(replayed[i]) - tail));
+        if ((replayed[i]->inode.deleted != 1) && ((i == 0) || (replayed[i] != replayed[i - 1]))) {
+            retainChunks(sharedOf(replayed[i])->chunks, sharedOf(replayed[i])->count);
+        }
+    }
+    free(replayed);
+    cacheRelease();
+
+    for (uint32_t id = 1; id < chunkMapSize; id++) {
+        if ((chunks[id].entry != 0) && (chunks[id].refs == 0)) {
+            removeChunk(id);
+            cacheRelease();
+        }
+    }
+}
+
+// Find write buffer of open file, NULL if file isn't open or has nothing buffered yet. Caller holds fsLock
+struct wfs_write_buffer *findWriteBuffer(int inodeNum) {
+    if ((inodeNum < 0) || (inodeNum >= inodeMapSize)) {
+        return NULL;
+    }
+    return openFiles[inodeNum].buffer;
+}
+
+// Get write buffer of open file, allocating it on the first buffered write. Caller holds inode lock of file
+struct wfs_write_buffer *getWriteBuffer(int inodeNum) {
+    pthread_rwlock_wrlock(&fsLock);
+    struct wfs_write_buffer *writeBuffer = openFiles[inodeNum].buffer;
+    if (writeBuffer == NULL) {
+        writeBuffer = (struct wfs_write_buffer *)calloc(1, sizeof(struct wfs_write_buffer));
+        if (writeBuffer == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        writeBuffer->inode_number = inodeNum;
+        openFiles[inodeNum].buffer = writeBuffer;
+    }
+    pthread_rwlock_unlock(&fsLock);
+    return writeBuffer;
+}
+
+// Remove inode no directory lists anymore, and mark its log entries deleted. An open file stays readable and writable
+// through its handles until the last one is released, which removes it then. Caller holds fsLock for writing and
+// inode lock
+void removeInode(int inodeNum, struct wfs_log_entry *logEntry) {
+    if ((inodeNum < inodeMapSize) && (openFiles[inodeNum].refs > 0)) {
+        openFiles[inodeNum].unlinked = 1;
+        return;
+    }
+    killLogEntry(logEntry); // Mark as deleted
+    clearExtents(inodeNum); // Mark log entries holding file data as deleted
+    setInode(inodeNum, NULL); // Drop inode from inode map
+}
+
+// Remove inodes that were unlinked while open when checkpoint was taken. A crash before their last handle was
+// released leaves them in its maps, and their log entries live. Files unlinked after it have a tombstone in the log
+// replayed. Runs at mount, once the log is replayed
+void dropOrphans(struct wfs_checkpoint *checkpoint) {
+    if (checkpoint == NULL) {
+        return;
+    }
+    // Orphans follow chunks, at the end of checkpoint
+    uint32_t *orphans = (uint32_t *)((char *)(checkpoint + 1) + checkpoint->size) - checkpoint->orphan_count;
+    for (uint32_t i = 0; i < checkpoint->orphan_count; i++) {
+        if (getInode(orphans[i]) != NULL) {
+            removeInode(orphans[i], getInode(orphans[i]));
+        }
+    }
+}
+
+// Mark log entry live again. The maps refer to it, whatever its deleted flag says
+void reviveLogEntry(struct wfs_log_entry *logEntry) {
+    if (logEntry->inode.deleted == 1) {
+        logEntry->inode.deleted = 0;
+        addLive(segmentOf((char *)(logEntry) - tail), logEntry->inode.size);
+    }
+}
+
+// Drop inodes replay ended on a tombstone of, and revive log entries the maps refer to. A checkpoint may point at a log
+// entry whose deleted flag reached disk, while the log entry that replaced it didn't
+void reviveLogEntries(void) {
+    for (int i = 0; i < inodeMapSize; i++) {
+        struct wfs_log_entry *logEntry = getInode(i);
+        if ((logEntry != NULL) && (logEntry->inode.flags & WFS_LOG_REMOVED)) {
+            setInode(i, NULL);
+        } else if (logEntry != NULL) {
+            reviveLogEntry(logEntry);
+        }
+        for (uint32_t j = 0; j < extentMaps[i].count; j++) {
+            reviveLogEntry(logEntryAt(extentMaps[i].extents[j].entry));
+        }
+        cacheRelease();
+    }
+    for (uint32_t id = 1; id < chunkMapSize; id++) {
+        if (chunks[id].entry != 0) {
+            reviveLogEntry(logEntryAt(chunks[id].entry));
+            cacheRelease();
+        }
+    }
+}
+
+// Build inode map by replaying segments in the order they were filled, once at mount
+void buildInodeMap(void) {
+    // Head segment holds the last committed byte
+    segmentUsage = (struct wfs_segment_usage *)(tail + sizeof(struct wfs_sb));
+    headSegment = segmentOf(superblock->head - 1);
+    headUsed = superblock->head - segmentOffset(headSegment);
+    segmentSeq = segmentUsage[headSegment].seq;
+
+    // Sort segments by sequence number. Segments filled after head segment never got a committed log entry
+    uint32_t *segments = (uint32_t *)malloc(superblock->segment_count * sizeof(uint32_t));
+    if (segments == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < superblock->segment_count; i++) {
+        if ((segmentUsage[i].seq == 0) || (segmentUsage[i].seq > segmentSeq)) {
+            segmentUsage[i].seq = 0;
+            freeSegments++;
+            continue;
+        }
+        uint32_t pos = count++;
+        while ((pos > 0) && (segmentUsage[segments[pos - 1]].seq > segmentUsage[i].seq)) {
+            segments[pos] = segments[pos - 1];
+            pos--;
+        }
+        segments[pos] = i;
+    }
+
+    struct wfs_log_entry **replayed = NULL; // Shared extent log entries replayed
+    uint64_t replayedCount = 0;
+
+    // Start from checkpoint if there is one. Its segments' live counts are already right, so only a full replay recounts them
+    struct wfs_checkpoint *checkpoint = loadCheckpoint();
+    cacheRelease();
+
+    // Segments are replayed one at a time. Pointers into them stay where they are, and are dereferenced again only
+    // once their segment is held again
+    for (uint32_t i = 0; i < count; i++) {
+        cacheRelease();
+        storage->map(segments[i]);
+        char *start = tail + segmentOffset(segments[i]);
+        char *currPointer = start;
+        char *end = currPointer + ((segments[i] == headSegment) ? headUsed : segmentUsage[segments[i]].written);
+        if (checkpoint != NULL) {
+            // Roll forward from checkpoint's head
+            if (segmentUsage[segments[i]].seq < checkpoint->head_seq) {
+                continue;
+            }
+            if (segmentUsage[segments[i]].seq == checkpoint->head_seq) {
+                currPointer = tail + checkpoint->head;
+            }
+        } else {
+            // Live bytes are counted again while replaying
+            segmentUsage[segments[i]].live = 0;
+        }
+
+        // Iterate over all log entries of segment, one update at a time
+        while (currPointer < end) {
+            uint64_t updateSize = wfs_verify_update(currPointer, end - currPointer);
+            if (updateSize == 0) { // Torn or corrupt
+                truncateLog(segments, count, i, currPointer - tail);
+                count = i + 1;
+                break;
+            }
+            char *updateEnd = currPointer + updateSize;
+            while (currPointer < updateEnd) {
+                struct wfs_log_entry *currLogEntry = (struct wfs_log_entry *)currPointer;
+                // Deleted flags are set in place, so one may be on disk while the log entries that made it true are
+                // not. Every log entry replayed starts out live, and dies again only if the log says so
+                if ((checkpoint == NULL) || (currLogEntry->inode.deleted == 1)) {
+                    segmentUsage[segments[i]].live += currLogEntry->inode.size;
+                }
+                if (currLogEntry->inode.deleted == 1) {
+                    currLogEntry->inode.deleted = 0;
+                }
+                if (currLogEntry->inode.flags & WFS_LOG_CHUNK) {
+                    // Latest copy of chunk wins. Chunk ids aren't inode numbers
+                    replayChunk(currLogEntry);
+                    currPointer += currLogEntry->inode.size;
+                    continue;
+                }
+                // Latest log entry for inode wins. A tombstone stands in for its inode until replay ends, and log
+                // entries an open handle appended after it die with the inode. A later copy of the tombstone made by
+                // the cleaner replaces it
+                int inodeNum = currLogEntry->inode.inode_number;
+                struct wfs_log_entry *latest = getInode(inodeNum);
+                if ((latest != NULL) && (latest->inode.flags & WFS_LOG_REMOVED) && !(currLogEntry->inode.flags & WFS_LOG_REMOVED)) {
+                    killLogEntry(currLogEntry);
+                } else if (currLogEntry->inode.flags & WFS_LOG_REMOVED) {
+                    if (latest != NULL) {
+                        killLogEntry(latest);
+                    }
+                    setInode(inodeNum, currLogEntry);
+                    clearExtents(inodeNum);
+                } else {
+                    // Shared extents are counted once all of the log is replayed
+                    if (currLogEntry->inode.flags & WFS_LOG_SHARED) {
+                        replayed = pushEntry(replayed, &replayedCount, currLogEntry);
+                    }
+                    setInode(inodeNum, currLogEntry);
+                    // Replay file data and directory buckets in log order
+                    if (currLogEntry->inode.mode & S_IFREG) {
+                        indexFileData(currLogEntry);
+                    } else {
+                        indexDirBucket(currLogEntry);
+                    }
+                    // Log entry it replaced is dead unless it still holds live data
+                    if (latest != NULL) {
+                        releaseLogEntry(inodeNum, (char *)(latest) - tail);
+                    }
+                }
+                // Never hand out an inode number that is already in the log
+                if ((int)currLogEntry->inode.inode_number > inodeCounter) {
+                    inodeCounter = currLogEntry->inode.inode_number;
+                }
+                // Move to next log entry
+                currPointer += currLogEntry->inode.size;
+            }
+        }
+    }
+    free(segments);
+    cacheRelease();
+
+    reviveLogEntries();
+    dropOrphans(checkpoint);
+    cacheRelease();
+    countChunkRefs(replayed, replayedCount);
+
+    // Totals the stats file reports. Handlers keep them in step from here on
+    logLiveBytes = 0;
+    logClosedBytes = 0;
+    for (uint32_t i = 0; i < superblock->segment_count; i++) {
+        if ((segmentUsage[i].seq != 0) && (i != headSegment)) {
+            logClosedBytes += segmentUsage[i].written;
+        }
+        logLiveBytes += segmentUsage[i].live;
+    }
+}
+
+// Get log entry of bucket of directory, or NULL if the maps don't have it. A directory's extent map holds one extent of
+// length 1 per bucket, at the bucket number, so bucket i is extent i. Caller holds fsLock
+struct wfs_log_entry *dirBucket(int inodeNum, uint32_t bucket) {
+    if ((inodeNum < 0) || (inodeNum >= inodeMapSize)) {
+        return NULL;
+    }
+    struct wfs_extent_map *map = &extentMaps[inodeNum];
+    if ((bucket >= map->count) || (map->extents[bucket].offset != bucket)) {
+        return NULL;
+    }
+    return logEntryAt(map->extents[bucket].entry);
+}
+
+// Find dentry for name in directory whose latest log entry is dirEntry. Returns NULL if there is none. Caller holds fsLock
+struct wfs_dentry *dirFind(struct wfs_log_entry *dirEntry, const char *name) {
+    struct wfs_dir *dir = (struct wfs_dir *)dirEntry->data;
+    struct wfs_log_entry *bucketEntry = dirBucket(dirEntry->inode.inode_number, wfs_dir_bucket(wfs_hash(name), dir->buckets));
+    uint32_t pos;
+    if ((bucketEntry == NULL) || !wfs_dir_find((struct wfs_dir *)bucketEntry->data, name, &pos)) {
+        return NULL;
+    }
+    return wfs_dir_entry((struct wfs_dir *)bucketEntry->data, pos);
+}
+
+// Get log entry of path, walking it one dentry at a time from directory inodeNum
+struct wfs_log_entry *getLogEntry(const char *path, int inodeNum) {
+    // Get latest log entry for inode
+    struct wfs_log_entry *currLogEntry = getInode(inodeNum);
+    while (currLogEntry != NULL) {
+        // Skip slashes before next path component
+        while (*path == '/') {
+            path++;
+        }
+        // Path ends here
+        if (*path == '\0') {
+            return currLogEntry;
+        }
+
+        // Only directories have dentries
+        if ((currLogEntry->inode.mode & S_IFDIR) == 0) {
+            return NULL;
+        }
+
+        // Copy path component, so it is null terminated. Longer names are never in a directory
+        size_t nameLen = strcspn(path, "/");
+        if (nameLen > MAX_FILE_NAME_LEN) {
+            return NULL;
+        }
+        char name[MAX_FILE_NAME_LEN + 1];
+        memcpy(name, path, nameLen);
+        name[nameLen] = '\0';
+        path += nameLen;
+
+        // Binary search the directory bucket name hashes to for dentry matching path component
+        struct wfs_dentry *dentry = dirFind(currLogEntry, name);
+        if (dentry == NULL) {
+            return NULL;
+        }
+        currLogEntry = getInode(dentry->inode_number);
+    }
+
+    // Log entry not found
+    return NULL;
+}
+
+// Look up path in dentry cache. Returns 1 on hit and sets inodeNum (-1 if path is known not to exist)
+int dcacheGet(const char *path, int *inodeNum) {
+    uint32_t slot = wfs_hash(path) % DCACHE_SIZE;
+    struct wfs_dcache_entry *cached = &dcache[slot];
+    int hit = 0;
+    pthread_mutex_lock(&dcacheLocks[slot % DCACHE_LOCK_COUNT]);
+    if (cached->valid && (strcmp(cached->path, path) == 0)) {
+        *inodeNum = cached->inode_number;
+        hit = 1;
+    }
+    pthread_mutex_unlock(&dcacheLocks[slot % DCACHE_LOCK_COUNT]);
+    return hit;
+}
+
+// Remember inode number for path (-1 for a path that doesn't exist)
+void dcachePut(const char *path, int inodeNum) {
+    // Paths that don't fit aren't cached
+    if (strlen(path) >= MAX_PATH_LENGTH) {
+        return;
+    }
+    // Replace whatever was in this slot
+    uint32_t slot = wfs_hash(path) % DCACHE_SIZE;
+    struct wfs_dcache_entry *cached = &dcache[slot];
+    pthread_mutex_lock(&dcacheLocks[slot % DCACHE_LOCK_COUNT]);
+    strcpy(cached->path, path);
+    cached->inode_number = inodeNum;
+    cached->valid = 1;
+    pthread_mutex_unlock(&dcacheLocks[slot % DCACHE_LOCK_COUNT]);
+}
+
+// Forget cached paths below directory path, once the directory moved. Negative entries go too
+void dcacheDropTree(const char *path) {
+    size_t len = strlen(path);
+    for (uint32_t slot = 0; slot < DCACHE_SIZE; slot++) {
+        struct wfs_dcache_entry *cached = &dcache[slot];
+        pthread_mutex_lock(&dcacheLocks[slot % DCACHE_LOCK_COUNT]);
+        if (cached->valid && (strncmp(cached->path, path, len) == 0) && (cached->path[len] == '/')) {
+            cached->valid = 0;
+        }
+        pthread_mutex_unlock(&dcacheLocks[slot % DCACHE_LOCK_COUNT]);
+    }
+}
+
+// Get log entry from path, using dentry cache
+struct wfs_log_entry *lookupPath(const char *path) {
+    int inodeNum;
+    // Cache hit
+    if (dcacheGet(path, &inodeNum)) {
+        return (inodeNum < 0) ? NULL : getInode(inodeNum);
+    }
+
+    // Cache miss, walk path from root and remember result
+    struct wfs_log_entry *logEntry = getLogEntry(path, 0);
+    dcachePut(path, (logEntry == NULL) ? -1 : (int)logEntry->inode.inode_number);
+
+    return logEntry;
+}
+
+// Copy bucket log entry to logEntryCopy with a dentry for name added. logEntryCopy has room for one more dentry,
+// and may be the bucket log entry itself
+void dirInsert(struct wfs_log_entry *dirEntry, const char *name, uint32_t inodeNum, struct wfs_log_entry *logEntryCopy) {
+    struct wfs_dir *dir = (struct wfs_dir *)dirEntry->data;
+    // Find where name goes in sorted index
+    uint32_t pos;
+    wfs_dir_find(dir, name, &pos);
+
+    int nameLen = strlen(name);
+    int dentrySize = WFS_DENTRY_SIZE(nameLen);
+    uint32_t count = dir->count;
+    char *dentries = (char *)&dir->index[count]; // Start of packed dentries
+    int dentriesSize = (char *)(dirEntry) + dirEntry->inode.size - dentries;
+
+    // Copy old dentries first, since a copy in place moves them over the end of the index
+    struct wfs_dir *newDir = (struct wfs_dir *)logEntryCopy->data;
+    char *newDentries = (char *)&newDir->index[count + 1];
+    memmove(newDentries, dentries, dentriesSize);
+
+    // Copy index with new slot at pos. New dentry goes after the old ones
+    memmove(newDir->index + pos + 1, dir->index + pos, (count - pos) * sizeof(uint32_t));
+    memmove(newDir->index, dir->index, pos * sizeof(uint32_t));
+    newDir->index[pos] = dentriesSize;
+    newDir->bucket = dir->bucket;
+    newDir->buckets = dir->buckets;
+    newDir->entries = dir->entries;
+    newDir->count = count + 1;
+
+    // New log entry has one more index slot and one more dentry
+    logEntryCopy->inode = dirEntry->inode;
+    logEntryCopy->inode.size += sizeof(uint32_t) + dentrySize; // Update size
+
+    // Add new dentry
+    struct wfs_dentry *newDentry = (struct wfs_dentry *)(newDentries + dentriesSize);
+    memset(newDentry, 0, dentrySize); // Zero padding
+    newDentry->hash = wfs_hash(name);
+    newDentry->inode_number = inodeNum; // Point dentry at inode
+    newDentry->name_len = nameLen;
+    memcpy(newDentry->name, name, nameLen + 1); // Copy name with null terminator
+}
+
+// Copy bucket log entry to logEntryCopy with the dentry at index position pos removed. logEntryCopy may be the bucket
+// log entry itself
+void dirRemove(struct wfs_log_entry *dirEntry, uint32_t pos, struct wfs_log_entry *logEntryCopy) {
+    struct wfs_dir *dir = (struct wfs_dir *)dirEntry->data;
+    uint32_t removedOffset = dir->index[pos];
+    int removedSize = WFS_DENTRY_SIZE(wfs_dir_entry(dir, pos)->name_len);
+    uint32_t count = dir->count;
+    char *dentries = (char *)&dir->index[count]; // Start of packed dentries
+    int dentriesSize = (char *)(dirEntry) + dirEntry->inode.size - dentries;
+
+    // New log entry has one less index slot and one less dentry
+    logEntryCopy->inode = dirEntry->inode;
+    logEntryCopy->inode.size -= sizeof(uint32_t) + removedSize; // Update size
+
+    // Copy index without pos. Dentries after the removed one move down. A copy in place only moves slots down
+    struct wfs_dir *newDir = (struct wfs_dir *)logEntryCopy->data;
+    uint32_t newPos = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (i == pos) {
+            continue;
+        }
+        uint32_t offset = dir->index[i];
+        newDir->index[newPos++] = (offset > removedOffset) ? offset - removedSize : offset;
+    }
+    newDir->bucket = dir->bucket;
+    newDir->buckets = dir->buckets;
+    newDir->entries = dir->entries;
+    newDir->count = count - 1;
+
+    // Copy dentries around removed one
+    char *newDentries = (char *)&newDir->index[count - 1];
+    memmove(newDentries, dentries, removedOffset);
+    memmove(newDentries + removedOffset, dentries + removedOffset + removedSize, dentriesSize - removedOffset - removedSize);
+}
+
+// Build bucket log entry at logEntryCopy holding the dentries at index positions first to last - 1 of bucket log entry
+// dirEntry, packed in index order. logEntryCopy doesn't overlap it
+void dirSlice(struct wfs_log_entry *dirEntry, uint32_t first, uint32_t last, uint32_t bucket, struct wfs_log_entry *logEntryCopy) {
+    struct wfs_dir *dir = (struct wfs_dir *)dirEntry->data;
+    struct wfs_dir *newDir = (struct wfs_dir *)logEntryCopy->data;
+    newDir->bucket = bucket;
+    newDir->buckets = dir->buckets;
+    newDir->entries = dir->entries;
+    newDir->count = last - first;
+    char *newDentries = (char *)&newDir->index[last - first];
+    uint32_t dentriesSize = 0;
+    for (uint32_t pos = first; pos < last; pos++) {
+        struct wfs_dentry *dentry = wfs_dir_entry(dir, pos);
+        newDir->index[pos - first] = dentriesSize;
+        memcpy(newDentries + dentriesSize, dentry, WFS_DENTRY_SIZE(dentry->name_len));
+        dentriesSize += WFS_DENTRY_SIZE(dentry->name_len);
+    }
+    logEntryCopy->inode = dirEntry->inode;
+    logEntryCopy->inode.size = newDentries + dentriesSize - (char *)logEntryCopy;
+}
+
+// Allocate copy of a bucket log entry of size bytes, with room for one more dentry
+struct wfs_log_entry *newBucket(uint32_t size) {
+    struct wfs_log_entry *bucketEntry = (struct wfs_log_entry *)malloc(size + sizeof(uint32_t) + WFS_DENTRY_SIZE(MAX_FILE_NAME_LEN));
+    if (bucketEntry == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    return bucketEntry;
+}
+
+// Start update of directory whose latest log entry is dirEntry
+void dirBegin(struct wfs_dir_update *update, struct wfs_log_entry *dirEntry) {
+    struct wfs_dir *dir = (struct wfs_dir *)dirEntry->data;
+    update->inode_number = dirEntry->inode.inode_number;
+    update->inode = dirEntry->inode;
+    update->buckets = dir->buckets;
+    update->entries = dir->entries;
+    update->count = 0;
+}
+
+// Get bucket as update leaves it so far: its copy if update rewrites it, else its log entry. Caller holds fsLock
+struct wfs_log_entry *dirPeek(struct wfs_dir_update *update, uint32_t bucket) {
+    for (int i = 0; i < update->count; i++) {
+        if (((struct wfs_dir *)update->copies[i]->data)->bucket == bucket) {
+            return update->copies[i];
+        }
+    }
+    return dirBucket(update->inode_number, bucket);
+}
+
+// Get copy of bucket for update to rewrite, copying its log entry on first use. Returns NULL if the maps don't have the
+// bucket. Caller holds fsLock
+struct wfs_log_entry *dirCopy(struct wfs_dir_update *update, uint32_t bucket) {
+    for (int i = 0; i < update->count; i++) {
+        if (((struct wfs_dir *)update->copies[i]->data)->bucket == bucket) {
+            return update->copies[i];
+        }
+    }
+    struct wfs_log_entry *bucketEntry = dirBucket(update->inode_number, bucket);
+    if (bucketEntry == NULL) {
+        return NULL;
+    }
+    struct wfs_log_entry *copy = newBucket(bucketEntry->inode.size);
+    memcpy(copy, bucketEntry, bucketEntry->inode.size);
+    update->copies[update->count++] = copy;
+    return copy;
+}
+
+// Split the next bucket in linear hashing order in two. It holds one range of hashes and the split halves it, so its
+// sorted index splits at one position. Returns 0, or -EIO if the maps don't have the bucket. Caller holds fsLock
+int dirSplit(struct wfs_dir_update *update) {
+    uint32_t level = wfs_dir_level(update->buckets);
+    uint32_t low = update->buckets - level;
+    struct wfs_log_entry *old = dirCopy(update, low);
+    if (old == NULL) {
+        return -EIO;
+    }
+    update->buckets++;
+    struct wfs_dir *dir = (struct wfs_dir *)old->data;
+    uint32_t split = 0;
+    while ((split < dir->count) && (wfs_dir_bucket(wfs_dir_entry(dir, split)->hash, update->buckets) == low)) {
+        split++;
+    }
+
+    // Both halves replace the copy of the old bucket
+    struct wfs_log_entry *halves[2] = { newBucket(old->inode.size), newBucket(old->inode.size) };
+    dirSlice(old, 0, split, low, halves[0]);
+    dirSlice(old, split, dir->count, low + level, halves[1]);
+    for (int i = 0; i < update->count; i++) {
+        if (update->copies[i] == old) {
+            update->copies[i] = halves[0];
+        }
+    }
+    update->copies[update->count++] = halves[1];
+    free(old);
+    return 0;
+}
+
+// Add dentry for name to directory. Buckets split in linear hashing order once they hold DIR_BUCKET_ENTRIES dentries on
+// average, or once the bucket name goes to is a quarter of a segment, so skewed hashes can't make a bucket outgrow a
+// segment before its turn comes. Returns 0, -ENOSPC if the bucket would still outgrow one, or -EIO if the maps don't
+// have a bucket. Caller holds fsLock
+int dirAdd(struct wfs_dir_update *update, const char *name, uint32_t inodeNum) {
+    uint32_t hash = wfs_hash(name);
+    struct wfs_log_entry *bucketEntry = dirPeek(update, wfs_dir_bucket(hash, update->buckets));
+    if (bucketEntry == NULL) {
+        return -EIO;
+    }
+    if ((update->entries >= (uint64_t)update->buckets * DIR_BUCKET_ENTRIES) || (bucketEntry->inode.size > superblock->segment_size / 4)) {
+        int ret = dirSplit(update);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    bucketEntry = dirCopy(update, wfs_dir_bucket(hash, update->buckets));
+    if (bucketEntry == NULL) {
+        return -EIO;
+    }
+    if (bucketEntry->inode.size + sizeof(uint32_t) + WFS_DENTRY_SIZE(strlen(name)) > superblock->segment_size) {
+        return -ENOSPC;
+    }
+    dirInsert(bucketEntry, name, inodeNum, bucketEntry);
+    update->entries++;
+    return 0;
+}
+
+// Remove dentry for name from directory. Returns 0, -ENOENT if there is none, or -EIO if the maps don't have its
+// bucket. Caller holds fsLock
+int dirDrop(struct wfs_dir_update *update, const char *name) {
+    struct wfs_log_entry *bucketEntry = dirCopy(update, wfs_dir_bucket(wfs_hash(name), update->buckets));
+    if (bucketEntry == NULL) {
+        return -EIO;
+    }
+    uint32_t pos;
+    if (!wfs_dir_find((struct wfs_dir *)bucketEntry->data, name, &pos)) {
+        return -ENOENT;
+    }
+    dirRemove(bucketEntry, pos, bucketEntry);
+    update->entries--;
+    return 0;
+}
+
+// Point dentry for name at another inode. Returns 0, -ENOENT if there is none, or -EIO if the maps don't have its
+// bucket. Caller holds fsLock
+int dirPoint(struct wfs_dir_update *update, const char *name, uint32_t inodeNum) {
+    struct wfs_log_entry *bucketEntry = dirCopy(update, wfs_dir_bucket(wfs_hash(name), update->buckets));
+    if (bucketEntry == NULL) {
+        return -EIO;
+    }
+    struct wfs_dir *dir = (struct wfs_dir *)bucketEntry->data;
+    uint32_t pos;
+    if (!wfs_dir_find(dir, name, &pos)) {
+        return -ENOENT;
+    }
+    wfs_dir_entry(dir, pos)->inode_number = inodeNum;
+    return 0;
+}
+
+// Stamp buckets update rewrote with the latest metadata of their directory and its counts once update is applied. They
+// are then ready to append, in update->copies
+void dirFinish(struct wfs_dir_update *update) {
+    for (int i = 0; i < update->count; i++) {
+        struct wfs_log_entry *bucketEntry = update->copies[i];
+        uint32_t size = bucketEntry->inode.size;
+        bucketEntry->inode = update->inode;
+        bucketEntry->inode.deleted = 0;
+        bucketEntry->inode.flags = 0;
+        bucketEntry->inode.size = size;
+        ((struct wfs_dir *)bucketEntry->data)->buckets = update->buckets;
+        ((struct wfs_dir *)bucketEntry->data)->entries = update->entries;
+    }
+}
+
+// Free buckets update copied
+void dirFree(struct wfs_dir_update *update) {
+    for (int i = 0; i < update->count; i++) {
+        free(update->copies[i]);
+    }
+    update->count = 0;
+}
+
+// Publish count buckets of directory appended. The last one becomes its latest log entry, and the log entries they
+// replace are marked deleted. Caller holds fsLock for writing
+void publishBuckets(int inodeNum, struct wfs_log_entry **newEntries, int count) {
+    uint64_t latest = (inodeNum < inodeMapSize) ? inodeMap[inodeNum] : 0;
+    setInode(inodeNum, newEntries[count - 1]);
+    for (int i = 0; i < count; i++) {
+        indexDirBucket(newEntries[i]);
+    }
+    if (latest != 0) {
+        releaseLogEntry(inodeNum, latest);
+    }
+}
+
+// Build tombstone of removed inode at tombstone. It goes in the same update as the directory log entry that stopped
+// listing the inode, so mount never brings back an inode whose log entries were marked deleted in place
+void buildTombstone(struct wfs_log_entry *tombstone, struct wfs_inode *inode) {
+    tombstone->inode = *inode;
+    tombstone->inode.deleted = 0;
+    tombstone->inode.flags = WFS_LOG_REMOVED;
+    tombstone->inode.size = sizeof(struct wfs_log_entry);
+    tombstone->inode.ctime = time(NULL);
+}
+
+// Get readdir offset cookie of dentry at pos, listed through handle (NULL if none). It names the dentry by its hash, so
+// it stays valid while other dentries come and go. Its low bits are 1 if no other dentry shares the hash. Otherwise
+// they are 2 plus the place of its name in the handle's names, since dentries sharing a hash are ordered by name.
+// Without a handle there are no names to keep, and resuming after such a dentry skips the rest sharing its hash.
+// Never 0, which starts a listing. Returns -1 if names can't grow
+off_t dirCookie(struct wfs_dir_handle *handle, struct wfs_dir *dir, uint32_t pos) {
+    struct wfs_dentry *dentry = wfs_dir_entry(dir, pos);
+    off_t cookie = (off_t)dentry->hash << DIR_COOKIE_NAME_BITS;
+    int shared = ((pos > 0) && (wfs_dir_entry(dir, pos - 1)->hash == dentry->hash)) ||
+                 ((pos + 1 < dir->count) && (wfs_dir_entry(dir, pos + 1)->hash == dentry->hash));
+    if (!shared || (handle == NULL)) {
+        return cookie | 1;
+    }
+
+    // Name listed before, e.g. by an earlier pass over the directory
+    for (uint32_t i = 0; i < handle->count; i++) {
+        if (strcmp(handle->names[i], dentry->name) == 0) {
+            return cookie | (i + 2);
+        }
+    }
+    if (handle->count + 2 >= (1u << DIR_COOKIE_NAME_BITS)) {
+        return -1;
+    }
+    if (handle->count == handle->slots) {
+        uint32_t slots = (handle->slots == 0) ? 4 : handle->slots * 2;
+        char **names = realloc(handle->names, slots * sizeof(char *));
+        if (names == NULL) {
+            return -1;
+        }
+        handle->names = names;
+        handle->slots = slots;
+    }
+    char *name = strdup(dentry->name);
+    if (name == NULL) {
+        return -1;
+    }
+    handle->names[handle->count] = name;
+    return cookie | (handle->count++ + 2);
+}
+
+// Get position of first dentry after the one cookie names, found by binary search on its hash and then by name
+uint32_t dirResume(struct wfs_dir_handle *handle, struct wfs_dir *dir, off_t cookie) {
+    if (cookie <= 0) {
+        return 0;
+    }
+    uint32_t hash = (uint64_t)cookie >> DIR_COOKIE_NAME_BITS;
+    uint32_t name = cookie & ((1u << DIR_COOKIE_NAME_BITS) - 1);
+    const char *last = ((handle != NULL) && (name >= 2) && (name - 2 < handle->count)) ? handle->names[name - 2] : NULL;
+
+    // First dentry with hash
+    uint32_t low = 0;
+    uint32_t high = dir->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (wfs_dir_entry(dir, mid)->hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    // Skip dentries sharing hash up to and including the name cookie names, or all of them if it names none. Removing
+    // the dentry cookie names, or any before it, doesn't move where this stops
+    while ((low < dir->count) && (wfs_dir_entry(dir, low)->hash == hash) &&
+           ((last == NULL) || (strcmp(wfs_dir_entry(dir, low)->name, last) <= 0))) {
+        low++;
+    }
+    return low;
+}
+
+// Build shared extent log entry listing the chunks of shared extent log entry logEntry that extent refers to, stamped with inode
+struct wfs_log_entry *newSharedEntry(struct wfs_log_entry *logEntry, struct wfs_extent_ref *extent, struct wfs_inode *inode, uint64_t fileSize) {
+    struct wfs_shared *shared = sharedOf(logEntry);
+    uint64_t pos = extent->data - (extent->entry + sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent)) + shared->skip;
+    uint32_t first = pos / CHUNK_SIZE;
+    uint32_t count = (pos + extent->length - 1) / CHUNK_SIZE - first + 1;
+
+    struct wfs_log_entry *sharedEntry = (struct wfs_log_entry *)calloc(1, WFS_SHARED_ENTRY_SIZE(count));
+    if (sharedEntry == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    sharedEntry->inode = *inode; // Copy inode of file
+    sharedEntry->inode.deleted = 0;
+    sharedEntry->inode.flags = (sharedEntry->inode.flags | WFS_LOG_EXTENT | WFS_LOG_SHARED) & ~WFS_LOG_COMPRESSED;
+    sharedEntry->inode.size = WFS_SHARED_ENTRY_SIZE(count);
+    struct wfs_extent *newExtent = (struct wfs_extent *)sharedEntry->data;
+    newExtent->offset = extent->offset;
+    newExtent->length = extent->length;
+    newExtent->file_size = fileSize;
+    struct wfs_shared *newShared = sharedOf(sharedEntry);
+    newShared->skip = pos % CHUNK_SIZE;
+    newShared->count = count;
+    memcpy(newShared->chunks, shared->chunks + first, count * sizeof(uint32_t));
+
+    return sharedEntry;
+}
+
+// Copy chunk log entry to head of log so the cleaner can reuse its space. Returns 0, -ENOSPC or -EIO
+int relocateChunk(struct wfs_log_entry *logEntry) {
+    uint32_t id = logEntry->inode.inode_number;
+    uint64_t entry = (char *)(logEntry) - tail;
+    pthread_rwlock_rdlock(&fsLock);
+    int live = (logEntry->inode.deleted != 1) && (id < chunkMapSize) && (chunks[id].entry == entry);
+    pthread_rwlock_unlock(&fsLock);
+    if (!live) { // Nothing to copy
+        return 0;
+    }
+
+    // Chunk id and fingerprint stay the same, so chunk is copied whole
+    struct wfs_log_entry *copy = (struct wfs_log_entry *)malloc(logEntry->inode.size);
+    if (copy == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, logEntry, logEntry->inode.size);
+    copy->inode.deleted = 0;
+    struct wfs_log_entry *newEntry;
+    int ret = appendLogEntries(&copy, 1, &newEntry, 0);
+    if (ret == 0) {
+        // Chunk may have lost its last reference while it was copied
+        pthread_rwlock_wrlock(&fsLock);
+        if (chunks[id].entry == entry) {
+            chunks[id].entry = (char *)(newEntry) - tail;
+            killLogEntry(logEntry);
+        } else {
+            killLogEntry(newEntry);
+        }
+        pthread_rwlock_unlock(&fsLock);
+    }
+    free(copy);
+
+    return ret;
+}
+
+// Check if mount may still replay log entries of the inode tombstone removed, from a checkpoint taken before it or
+// from the start of the log. Either checkpoint may be the one mount starts from, if the other is torn
+int tombstoneNeeded(struct wfs_log_entry *tombstone) {
+    uint64_t entry = (char *)(tombstone) - tail;
+    int needed = 0;
+    // Checkpoints record their head under commitLock
+    pthread_mutex_lock(&commitLock);
+    uint32_t seq = segmentUsage[segmentOf(entry)].seq;
+    for (int i = 0; i < 2; i++) {
+        struct wfs_checkpoint *checkpoint = checkpointRegion(i);
+        if ((__atomic_load_n(&checkpoint->seq, __ATOMIC_ACQUIRE) == 0) || (checkpoint->head_seq < seq) || ((checkpoint->head_seq == seq) && (checkpoint->head <= entry))) {
+            needed = 1;
+        }
+    }
+    pthread_mutex_unlock(&commitLock);
+    return needed;
+}
+
+// Copy tombstone to head of log while mount may need it, or let it go. Returns 0, -ENOSPC or -EIO
+int relocateTombstone(struct wfs_log_entry *tombstone) {
+    if (tombstone->inode.deleted == 1) { // Nothing to copy
+        return 0;
+    }
+    int ret = 0;
+    if (tombstoneNeeded(tombstone)) {
+        struct wfs_log_entry copy = *tombstone;
+        struct wfs_log_entry *logEntries[1] = { &copy };
+        struct wfs_log_entry *newEntry;
+        ret = appendLogEntries(logEntries, 1, &newEntry, 0);
+    }
+    if (ret == 0) {
+        pthread_rwlock_wrlock(&fsLock);
+        killLogEntry(tombstone);
+        pthread_rwlock_unlock(&fsLock);
+    }
+    return ret;
+}
+
+// Copy live contents of log entry to head of log so the cleaner can reuse its space. Returns 0, -ENOSPC or -EIO
+int relocateLogEntry(struct wfs_log_entry *logEntry) {
+    if (logEntry->inode.flags & WFS_LOG_CHUNK) {
+        return relocateChunk(logEntry);
+    }
+    if (logEntry->inode.flags & WFS_LOG_REMOVED) {
+        return relocateTombstone(logEntry);
+    }
+    int inodeNum = logEntry->inode.inode_number;
+    uint64_t entry = (char *)(logEntry) - tail;
+
+    // Keep inode's log entries from changing while they're copied
+    lockInodes(&inodeNum, 1);
+    pthread_rwlock_rdlock(&fsLock);
+    if ((logEntry->inode.deleted == 1) || !isLive(inodeNum, entry)) { // Nothing to copy
+        pthread_rwlock_unlock(&fsLock);
+        unlockInodes(&inodeNum, 1);
+        return 0;
+    }
+    struct wfs_log_entry *latest = getInode(inodeNum);
+    // Collect live extents held by log entry
+    struct wfs_extent_map *map = &extentMaps[inodeNum];
+    struct wfs_extent_ref *extents = (struct wfs_extent_ref *)malloc((map->count + 1) * sizeof(struct wfs_extent_ref));
+    if (extents == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    int count = 0;
+    for (uint32_t i = 0; i < map->count; i++) {
+        if (map->extents[i].entry == entry) {
+            extents[count++] = map->extents[i];
+        }
+    }
+    pthread_rwlock_unlock(&fsLock);
+
+    // Directory buckets are copied whole. Files keep only their live extents. Either is stamped with the latest
+    // metadata, so that replaying the log at mount still ends with the current state of the inode
+    int entryCount = (count > 0) ? count : 1;
+    struct wfs_log_entry **logEntries = (struct wfs_log_entry **)malloc(entryCount * sizeof(struct wfs_log_entry *));
+    struct wfs_log_entry **newEntries = (struct wfs_log_entry **)malloc(entryCount * sizeof(struct wfs_log_entry *));
+    if ((logEntries == NULL) || (newEntries == NULL)) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    if (!(logEntry->inode.mode & S_IFREG)) {
+        logEntries[0] = (struct wfs_log_entry *)malloc(logEntry->inode.size);
+        if (logEntries[0] == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(logEntries[0], logEntry, logEntry->inode.size);
+        logEntries[0]->inode = latest->inode;
+        logEntries[0]->inode.size = logEntry->inode.size;
+        ((struct wfs_dir *)logEntries[0]->data)->buckets = ((struct wfs_dir *)latest->data)->buckets;
+        ((struct wfs_dir *)logEntries[0]->data)->entries = ((struct wfs_dir *)latest->data)->entries;
+    } else if ((count > 0) && (logEntry->inode.flags & WFS_LOG_SHARED)) {
+        // Shared data stays in its chunks. Each copy lists only the chunks its extent spans, and refers to them
+        // before the old log entry lets them go
+        for (int i = 0; i < count; i++) {
+            logEntries[i] = newSharedEntry(logEntry, &extents[i], &latest->inode, wfs_file_size(latest));
+        }
+        pthread_rwlock_rdlock(&fsLock);
+        for (int i = 0; i < count; i++) {
+            retainChunks(sharedOf(logEntries[i])->chunks, sharedOf(logEntries[i])->count);
+        }
+        pthread_rwlock_unlock(&fsLock);
+    } else {
+        for (int i = 0; i < entryCount; i++) {
+            uint32_t length = (count > 0) ? extents[i].length : 0; // Latest log entry without live data keeps file metadata
+            uint64_t offset = (count > 0) ? extents[i].offset : 0;
+            char *data = (char *)malloc(length);
+            if ((data == NULL) && (length > 0)) { // Memory allocation failed
+                perror("Memory allocation error");
+                exit(EXIT_FAILURE);
+            }
+            if ((length > 0) && (readExtent(&extents[i], offset, length, data) != 0)) {
+                // Corrupt data can't be copied, so segment stays in use
+                for (int j = 0; j < i; j++) {
+                    free(logEntries[j]);
+                }
+                free(data);
+                free(logEntries);
+                free(newEntries);
+                free(extents);
+                unlockInodes(&inodeNum, 1);
+                return -EIO;
+            }
+            logEntries[i] = newExtentEntry(&latest->inode, data, length, offset, wfs_file_size(latest));
+            free(data);
+        }
+    }
+
+    // Copies go to the log one at a time, since their headers may not fit in one segment together
+    int ret = 0;
+    int appended = 0;
+    while ((appended < entryCount) && (ret == 0)) {
+        ret = appendLogEntries(&logEntries[appended], 1, &newEntries[appended], 0);
+        appended += (ret == 0);
+    }
+    if (ret != 0) {
+        // Drop copies already made. Chunks of copies never made lose the reference taken for them
+        pthread_rwlock_wrlock(&fsLock);
+        for (int i = 0; i < entryCount; i++) {
+            if (i < appended) {
+                killLogEntry(newEntries[i]);
+            } else if (logEntries[i]->inode.flags & WFS_LOG_SHARED) {
+                releaseChunks(sharedOf(logEntries[i])->chunks, sharedOf(logEntries[i])->count);
+            }
+        }
+        pthread_rwlock_unlock(&fsLock);
+    } else {
+        // Publish copies
+        pthread_rwlock_wrlock(&fsLock);
+        map = &extentMaps[inodeNum]; // Extent maps may have been reallocated meanwhile
+        for (int i = 0; i < count; i++) {
+            for (uint32_t j = 0; j < map->count; j++) {
+                if ((map->extents[j].entry == entry) && (map->extents[j].offset == extents[i].offset)) {
+                    map->extents[j].entry = (char *)(newEntries[i]) - tail;
+                    map->extents[j].data = map->extents[j].entry;
+                    if (logEntry->inode.mode & S_IFREG) {
+                        map->extents[j].data += sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent);
+                    }
+                }
+            }
+        }
+        setInode(inodeNum, newEntries[entryCount - 1]); // Last copy is now the latest log entry
+        killLogEntry(logEntry);
+        if (latest != logEntry) {
+            releaseLogEntry(inodeNum, (char *)(latest) - tail);
+        }
+        pthread_rwlock_unlock(&fsLock);
+    }
+    unlockInodes(&inodeNum, 1);
+
+    for (int i = 0; i < entryCount; i++) {
+        free(logEntries[i]);
+    }
+    free(logEntries);
+    free(newEntries);
+    free(extents);
+
+    return ret;
+}
+
+// Get monotonic time in nanoseconds
+uint64_t monotonicTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Pin segment holding disk offset, so the cleaner keeps it in use while FUSE reads it for a zero-copy read reply.
+// Caller holds fsLock
+void pinSegment(uint64_t offset) {
+    uint32_t segment = segmentOf(offset);
+    struct wfs_pins *pins = (struct wfs_pins *)pthread_getspecific(pinKey);
+    // Extents next to each other are mostly in the same segment. One pin covers them all
+    if ((pins != NULL) && (pins->count > 0) && (pins->segments[pins->count - 1] == segment)) {
+        return;
+    }
+    holdSegment(pinKey, segment);
+    __atomic_add_fetch(&segmentPins[segment], 1, __ATOMIC_RELAXED);
+}
+
+// Drop pins of a thread's latest zero-copy read
+void releasePins(struct wfs_pins *pins) {
+    for (uint32_t i = 0; i < pins->count; i++) {
+        __atomic_sub_fetch(&segmentPins[pins->segments[i]], 1, __ATOMIC_RELEASE);
+    }
+    pins->count = 0;
+}
+
+// Drop pins of calling thread. A FUSE thread sends its reply before it takes the next request, so every handler
+// starts with this
+void unpinSegments(void) {
+    struct wfs_pins *pins = (struct wfs_pins *)pthread_getspecific(pinKey);
+    if (pins != NULL) {
+        releasePins(pins);
+    }
+}
+
+// Drop pins of a thread that exits
+void freePins(void *pins) {
+    releasePins((struct wfs_pins *)pins);
+    free(pins);
+}
+
+// Reclaim closed segment with fewest live bytes if few of them are live, or if free segments are running out. Returns bytes reclaimed
+uint64_t cleanSegment(void) {
+    // Pick victim among closed segments
+    pthread_mutex_lock(&commitLock);
+    uint32_t victim = superblock->segment_count;
+    uint32_t victimLive = 0;
+    for (uint32_t i = 0; i < superblock->segment_count; i++) {
+        // Segments a zero-copy read reply may still point into can't be reused yet
+        if ((segmentUsage[i].seq == 0) || (i == headSegment) || (__atomic_load_n(&segmentPins[i], __ATOMIC_RELAXED) > 0)) {
+            continue;
+        }
+        uint32_t live = __atomic_load_n(&segmentUsage[i].live, __ATOMIC_RELAXED);
+        if ((victim == superblock->segment_count) || (live < victimLive)) {
+            victim = i;
+            victimLive = live;
+        }
+    }
+    // Wait for log entries still being copied into closed segments
+    uint64_t reserved = logReserved;
+    while (logHead < reserved) {
+        pthread_cond_wait(&commitCond, &commitLock);
+    }
+    pthread_mutex_unlock(&commitLock);
+    if (victim == superblock->segment_count) { // Only head segment is in use
+        return 0;
+    }
+
+    // Clean mostly dead segments. When free segments run low, clean any segment with a dead byte
+    if ((victimLive * 100 > (uint64_t)cleanerThreshold * superblock->segment_size) && (!logLow() || (victimLive >= segmentUsage[victim].written))) {
+        return 0;
+    }
+
+    // Copy live log entries forward
+    storage->map(victim);
+    char *currPointer = tail + segmentOffset(victim);
+    char *end = currPointer + segmentUsage[victim].written;
+    while (currPointer < end) {
+        struct wfs_log_entry *logEntry = (struct wfs_log_entry *)currPointer;
+        if (relocateLogEntry(logEntry) != 0) { // Out of space or unreadable. Segment stays in use
+            return 0;
+        }
+        currPointer += logEntry->inode.size;
+    }
+
+    // Copies must be on disk before the originals may be overwritten
+    pthread_mutex_lock(&commitLock);
+    uint64_t copied = logHead;
+    pthread_mutex_unlock(&commitLock);
+    if (syncLog(copied) != 0) {
+        return 0;
+    }
+
+    // Zero-copy reads hand FUSE disk offsets into the log, and FUSE reads them after read_buf returns. Wait for reads
+    // that found log entries in segment before they moved. They pinned it, and segment stays in use until every
+    // thread that did has moved on to its next request
+    pthread_rwlock_wrlock(&fsLock);
+    pthread_rwlock_unlock(&fsLock);
+    if (__atomic_load_n(&segmentPins[victim], __ATOMIC_ACQUIRE) > 0) {
+        return 0;
+    }
+
+    // Nothing in segment is live anymore, so writers may reuse it
+    zcacheDrop(segmentOffset(victim), segmentOffset(victim) + superblock->segment_size);
+    pthread_mutex_lock(&commitLock);
+    segmentUsage[victim].seq = 0;
+    __atomic_sub_fetch(&logClosedBytes, segmentUsage[victim].written, __ATOMIC_RELAXED);
+    segmentUsage[victim].written = 0;
+    __atomic_add_fetch(&freeSegments, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&commitLock);
+    __atomic_add_fetch(&cleanedSegments, 1, __ATOMIC_RELAXED);
+
+    return superblock->segment_size;
+}
+
+// Background cleaner. Reclaims dead log space while the filesystem stays mounted
+void *cleaner(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&cleanerLock);
+    while (!cleanerStop) {
+        pthread_mutex_unlock(&cleanerLock);
+        uint64_t cleaned = cleanSegment();
+        // Checkpoint now and then so mount has little log to replay
+        if ((time(NULL) - checkpointTime >= CHECKPOINT_INTERVAL) && (__atomic_load_n(&logHead, __ATOMIC_RELAXED) != checkpointHead)) {
+            writeCheckpoint();
+        }
+        cacheRelease();
+        pthread_mutex_lock(&cleanerLock);
+        cleanerPasses++;
+        cleanerReclaimed = cleaned;
+        pthread_cond_broadcast(&cleanedCond);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        if (cleaned == 0) {
+            // Nothing worth cleaning. Check again in a second or when writers run low on space
+            deadline.tv_sec += 1;
+            if (!cleanerStop) {
+                pthread_cond_timedwait(&cleanerCond, &cleanerLock, &deadline);
+            }
+        } else if (cleanerRate > 0) {
+            // Stay under rate limit, even if woken early
+            uint64_t delay = cleaned * 1000000000 / cleanerRate;
+            deadline.tv_sec += (deadline.tv_nsec + delay) / 1000000000;
+            deadline.tv_nsec = (deadline.tv_nsec + delay) % 1000000000;
+            while (!cleanerStop && (pthread_cond_timedwait(&cleanerCond, &cleanerLock, &deadline) != ETIMEDOUT));
+        }
+    }
+    pthread_mutex_unlock(&cleanerLock);
+
+    return NULL;
+}
+
+// Background group commit. Syncs everything committed since its last pass every SYNC_INTERVAL
+void *syncer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&syncLock);
+    while (!syncStop) {
+        // Sleep out the interval. Syncs ending meanwhile signal syncCond too
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (deadline.tv_nsec + SYNC_INTERVAL) / 1000000000;
+        deadline.tv_nsec = (deadline.tv_nsec + SYNC_INTERVAL) % 1000000000;
+        while (!syncStop && (pthread_cond_timedwait(&syncCond, &syncLock, &deadline) != ETIMEDOUT));
+        if (syncStop) {
+            break;
+        }
+        pthread_mutex_unlock(&syncLock);
+        pthread_mutex_lock(&commitLock);
+        uint64_t committed = logHead;
+        pthread_mutex_unlock(&commitLock);
+        int ret = syncLog(committed);
+        pthread_mutex_lock(&syncLock);
+        // Nobody waited for this sync, so the next fsync reports its failure
+        if (ret != 0) {
+            syncError = ret;
+        }
+    }
+    pthread_mutex_unlock(&syncLock);
+
+    return NULL;
+}
+
+// Names of timed handlers, indexed by WFS_OP_*
+const char *opNames[WFS_OP_COUNT] = { "getattr", "open", "read", "read_buf", "mknod", "mkdir", "write", "write_buf", "flush", "release", "readdir", "unlink", "fsync", "opendir", "rename", "releasedir" };
+
+// Start timing a handler call. The calling thread has sent the reply to its previous request, so pins of that request go
+uint64_t opStart(void) {
+    unpinSegments();
+    return monotonicTime();
+}
+
+// Count call of handler op that started at start and returned ret, and let go of segments it held. Returns ret
+int recordOp(int op, uint64_t start, int ret) {
+    cacheRelease();
+    uint64_t nanoseconds = monotonicTime() - start;
+    // Smallest power of two microseconds call took at most
+    uint64_t micros = (nanoseconds + 999) / 1000;
+    int bucket = (micros <= 1) ? 0 : 64 - __builtin_clzll(micros - 1);
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+    struct wfs_op_stats *stats = &opStats[op];
+    __atomic_add_fetch(&stats->calls, 1, __ATOMIC_RELAXED);
+    if (ret < 0) {
+        __atomic_add_fetch(&stats->errors, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&stats->nanoseconds, nanoseconds, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->buckets[bucket], 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+// Write one metric without labels, with its help and type lines
+void printMetric(FILE *out, const char *name, const char *type, const char *help, double value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+// Render metrics in Prometheus text format. Returns allocated text and sets size to its length
+char *renderStats(size_t *size) {
+    char *text;
+    FILE *out = open_memstream(&text, size);
+    if (out == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    // Handler counters
+    fprintf(out, "# HELP wfs_op_calls_total Calls of each handler.\n# TYPE wfs_op_calls_total counter\n");
+    for (int i = 0; i < WFS_OP_COUNT; i++) {
+        fprintf(out, "wfs_op_calls_total{op=\"%s\"} %lu\n", opNames[i], (unsigned long)__atomic_load_n(&opStats[i].calls, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "# HELP wfs_op_errors_total Calls of each handler that returned an error.\n# TYPE wfs_op_errors_total counter\n");
+    for (int i = 0; i < WFS_OP_COUNT; i++) {
+        fprintf(out, "wfs_op_errors_total{op=\"%s\"} %lu\n", opNames[i], (unsigned long)__atomic_load_n(&opStats[i].errors, __ATOMIC_RELAXED));
+    }
+
+    // Latency histograms. Buckets are cumulative
+    fprintf(out, "# HELP wfs_op_latency_seconds Time spent in each handler.\n# TYPE wfs_op_latency_seconds histogram\n");
+    for (int i = 0; i < WFS_OP_COUNT; i++) {
+        uint64_t count = 0;
+        for (int j = 0; j < STATS_BUCKETS; j++) {
+            count += __atomic_load_n(&opStats[i].buckets[j], __ATOMIC_RELAXED);
+            if (j < STATS_BUCKETS - 1) {
+                fprintf(out, "wfs_op_latency_seconds_bucket{op=\"%s\",le=\"%g\"} %lu\n", opNames[i], (double)(1 << j) / 1e6, (unsigned long)count);
+            } else {
+                fprintf(out, "wfs_op_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", opNames[i], (unsigned long)count);
+            }
+        }
+        fprintf(out, "wfs_op_latency_seconds_sum{op=\"%s\"} %.9f\n", opNames[i], __atomic_load_n(&opStats[i].nanoseconds, __ATOMIC_RELAXED) / 1e9);
+        fprintf(out, "wfs_op_latency_seconds_count{op=\"%s\"} %lu\n", opNames[i], (unsigned long)count);
+    }
+
+    // Log space. Totals are kept atomically where the segment usage table changes, so nothing here takes a lock or
+    // walks the table. Values may be a moment apart from each other
+    uint64_t appended = __atomic_load_n(&logHead, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&superblock->head, __ATOMIC_RELAXED);
+    uint32_t segmentCount = __atomic_load_n(&superblock->segment_count, __ATOMIC_RELAXED);
+    uint64_t written = __atomic_load_n(&logClosedBytes, __ATOMIC_RELAXED) + __atomic_load_n(&headUsed, __ATOMIC_RELAXED);
+    uint64_t live = __atomic_load_n(&logLiveBytes, __ATOMIC_RELAXED);
+    live = (live > written) ? written : live;
+
+    printMetric(out, "wfs_read_bytes_total", "counter", "Bytes returned by reads since mount.", __atomic_load_n(&readBytes, __ATOMIC_RELAXED));
+    printMetric(out, "wfs_written_bytes_total", "counter", "Bytes accepted by writes since mount.", __atomic_load_n(&writtenBytes, __ATOMIC_RELAXED));
+    printMetric(out, "wfs_log_appended_bytes_total", "counter", "Bytes of log entries appended since mount, including cleaner copies.", appended);
+    printMetric(out, "wfs_log_head_bytes", "gauge", "Disk offset of head of log.", head);
+    printMetric(out, "wfs_log_written_bytes", "gauge", "Bytes of log entries in segments in use.", written);
+    printMetric(out, "wfs_log_live_bytes", "gauge", "Bytes of log entries not marked deleted.", live);
+    printMetric(out, "wfs_log_dead_ratio", "gauge", "Fraction of bytes in segments in use that are dead.", (written == 0) ? 0 : (double)(written - live) / written);
+    printMetric(out, "wfs_segment_size_bytes", "gauge", "Bytes per segment.", superblock->segment_size);
+    printMetric(out, "wfs_segments", "gauge", "Segments in disk image.", segmentCount);
+    printMetric(out, "wfs_segments_free", "gauge", "Segments without log entries.", __atomic_load_n(&freeSegments, __ATOMIC_RELAXED));
+    printMetric(out, "wfs_segments_max", "gauge", "Segments disk image may grow to.", superblock->segment_max);
+    printMetric(out, "wfs_cache_loads_total", "counter", "Segments the pwrite engine mapped since mount.", __atomic_load_n(&cacheLoads, __ATOMIC_RELAXED));
+    printMetric(out, "wfs_cleaner_segments_total", "counter", "Segments reclaimed by cleaner since mount.", __atomic_load_n(&cleanedSegments, __ATOMIC_RELAXED));
+
+    fclose(out);
+    return text;
+}
+
+// Fill in stat struct of stats file. Like files in /proc its size is 0: metrics are only rendered when read,
+// and direct_io makes the kernel read it to the end whatever size it cached
+int statsAttr(struct stat *stbuf) {
+    stbuf->st_ino = STATS_INO;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_atime = time(NULL);
+    stbuf->st_mtime = time(NULL);
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = 0;
+    return 0;
+}
+
+// Read from stats file. Every read renders metrics afresh
+int readStats(char *buf, size_t size, off_t offset) {
+    size_t textSize;
+    char *text = renderStats(&textSize);
+    if ((uint64_t)offset >= textSize) {
+        free(text);
+        return 0;
+    }
+    if (offset + size > textSize) {
+        size = textSize - offset;
+    }
+    memcpy(buf, text + offset, size);
+    free(text);
+    return size;
+}
+
+// Get inode number of open file handle, or -1 if handler got none
+int handleInode(struct fuse_file_info *fi) {
+    if ((fi == NULL) || (fi->fh < FILE_HANDLE)) {
+        return -1;
+    }
+    return (int)(fi->fh - FILE_HANDLE);
+}
+
+// Check if handler was called for the stats file, by handle or by path
+int isStats(const char *path, struct fuse_file_info *fi) {
+    if ((fi != NULL) && (fi->fh == STATS_HANDLE)) {
+        return 1;
+    }
+    return (path != NULL) && (strcmp(parsePath(path), STATS_PATH) == 0);
+}
+
+// Get log entry of file a handler works on. An open handle names it by inode number, so FUSE passes no path and
+// nothing is walked. Caller holds fsLock
+struct wfs_log_entry *handleEntry(const char *path, struct fuse_file_info *fi) {
+    if (handleInode(fi) != -1) {
+        return getInode(handleInode(fi));
+    }
+    return (path == NULL) ? NULL : lookupPath(parsePath(path));
+}
+
+// Fill in stat struct for log entry. Caller holds fsLock
+void fillStat(struct wfs_log_entry *logEntry, struct stat *stbuf) {
+    stbuf->st_ino = logEntry->inode.inode_number + 1; // Root is inode 0, but FUSE_ROOT_ID to the kernel, and 0 means no inode
+    stbuf->st_uid = logEntry->inode.uid;
+    stbuf->st_gid = logEntry->inode.gid;
+    stbuf->st_atime = time(NULL); // Update last access time
+    stbuf->st_mtime = logEntry->inode.mtime;
+    stbuf->st_mode = logEntry->inode.mode;
+    stbuf->st_nlink = logEntry->inode.links;
+    // Directories report their number of dentries
+    stbuf->st_size = (logEntry->inode.mode & S_IFREG) ? wfs_file_size(logEntry) : ((struct wfs_dir *)logEntry->data)->entries;
+
+    // File may have grown in its write buffer
+    struct wfs_write_buffer *writeBuffer = findWriteBuffer(logEntry->inode.inode_number);
+    if ((writeBuffer != NULL) && (writeBuffer->length > 0) && (writeBuffer->offset + writeBuffer->length > stbuf->st_size)) {
+        stbuf->st_size = writeBuffer->offset + writeBuffer->length;
+    }
+}
+
+// Function to get file attributes
+static int wfs_getattr(const char *path, struct stat *stbuf) {
+    // Remove mount point from path
+    const char *newPath = parsePath(path);
+
+    // Stats file isn't in log
+    if (strcmp(newPath, STATS_PATH) == 0) {
+        return statsAttr(stbuf);
+    }
+
+    // Get log entry
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_log_entry *logEntry = lookupPath(newPath);
+    if (logEntry == NULL) { // Log entry not found
+        pthread_rwlock_unlock(&fsLock);
+        perror("Log entry does not exist");
+        return -ENOENT;
+    }
+
+    fillStat(logEntry, stbuf);
+    pthread_rwlock_unlock(&fsLock);
+
+    return 0;
+}
+
+// Function to get attributes of an open file. It works after the file is unlinked, too
+static int wfs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    // Stats file isn't in log
+    if (isStats(path, fi)) {
+        return statsAttr(stbuf);
+    }
+
+    // Get log entry
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_log_entry *logEntry = handleEntry(path, fi);
+    if (logEntry == NULL) { // Log entry not found
+        pthread_rwlock_unlock(&fsLock);
+        perror("Log entry does not exist");
+        return -ENOENT;
+    }
+
+    fillStat(logEntry, stbuf);
+    pthread_rwlock_unlock(&fsLock);
+
+    return 0;
+}
+
+// Function to read data from file
+static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    // Stats file isn't in log
+    if (isStats(path, fi)) {
+        return readStats(buf, size, offset);
+    }
+    // Get log entry
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_log_entry *logEntry = handleEntry(path, fi);
+    if (logEntry == NULL) { // Log entry not found
+        pthread_rwlock_unlock(&fsLock);
+        perror("Log entry does not exist");
+        return -ENOENT;
+    }
+    // Size of file, including bytes still in write buffer
+    uint64_t dataSize = wfs_file_size(logEntry);
+    struct wfs_write_buffer *writeBuffer = findWriteBuffer(logEntry->inode.inode_number);
+    if ((writeBuffer != NULL) && (writeBuffer->length > 0) && (writeBuffer->offset + writeBuffer->length > dataSize)) {
+        dataSize = writeBuffer->offset + writeBuffer->length;
+    }
+
+    // Check if offset is too big
+    if (offset >= dataSize) {
+        pthread_rwlock_unlock(&fsLock);
+        return 0;
+    }
+    // Don't read past end of file
+    if (offset + size > dataSize) {
+        size = dataSize - offset;
+    }
+
+    // Assemble requested range from extents. Holes read as zeros
+    memset(buf, 0, size);
+    struct wfs_extent_map *map = &extentMaps[logEntry->inode.inode_number];
+    uint64_t end = offset + size;
+    for (uint32_t i = 0; i < map->count; i++) {
+        struct wfs_extent_ref *extent = &map->extents[i];
+        uint64_t extentEnd = extent->offset + extent->length;
+        // Skip extents outside requested range
+        if ((extentEnd <= offset) || (extent->offset >= end)) {
+            continue;
+        }
+        uint64_t start = (extent->offset > offset) ? extent->offset : offset;
+        uint64_t stop = (extentEnd < end) ? extentEnd : end;
+        if (readExtent(extent, start, stop - start, buf + (start - offset)) != 0) {
+            pthread_rwlock_unlock(&fsLock);
+            return -EIO;
+        }
+    }
+
+    // Buffered bytes are newer than anything in log
+    if ((writeBuffer != NULL) && (writeBuffer->length > 0)) {
+        uint64_t bufferEnd = writeBuffer->offset + writeBuffer->length;
+        uint64_t start = (writeBuffer->offset > offset) ? writeBuffer->offset : offset;
+        uint64_t stop = (bufferEnd < end) ? bufferEnd : end;
+        if (start < stop) {
+            memcpy(buf + (start - offset), writeBuffer->data + (start - writeBuffer->offset), stop - start);
+        }
+    }
+    pthread_rwlock_unlock(&fsLock);
+
+    return size;
+}
+
+// Allocate size zero bytes
+char *zeros(size_t size) {
+    char *mem = (char *)calloc(1, size);
+    if (mem == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    return mem;
+}
+
+// Add buffer of size bytes to buffer vector. Buffers of log data refer to the disk image file at disk offset pos,
+// others own mem
+void addBuf(struct fuse_bufvec *bufv, size_t size, void *mem, uint64_t pos) {
+    struct fuse_buf *buf = &bufv->buf[bufv->count++];
+    buf->size = size;
+    buf->mem = mem;
+    buf->flags = (mem == NULL) ? (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK) : 0;
+    buf->fd = (mem == NULL) ? diskFd : -1;
+    buf->pos = (mem == NULL) ? pos : 0;
+}
+
+// Read into one buffer of memory through wfs_read
+int readCopy(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct fuse_bufvec *bufv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+    char *mem = (char *)malloc(size);
+    if ((bufv == NULL) || (mem == NULL)) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    int ret = wfs_read(path, mem, size, offset, fi);
+    if (ret < 0) {
+        free(mem);
+        free(bufv);
+        return ret;
+    }
+    *bufv = FUSE_BUFVEC_INIT(ret);
+    bufv->buf[0].mem = mem;
+    *bufp = bufv;
+    return 0;
+}
+
+// Function to read data from a file without copying it. Plain extents are handed to FUSE as ranges of the disk image
+// file, so it can splice them. Holes, compressed and shared extents, and buffered bytes are copied
+static int wfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    // Stats file isn't in log
+    if (isStats(path, fi)) {
+        return readCopy(path, bufp, size, offset, fi);
+    }
+    // Get log entry
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_log_entry *logEntry = handleEntry(path, fi);
+    if (logEntry == NULL) { // Log entry not found
+        pthread_rwlock_unlock(&fsLock);
+        perror("Log entry does not exist");
+        return -ENOENT;
+    }
+    uint64_t dataSize = wfs_file_size(logEntry);
+    struct wfs_write_buffer *writeBuffer = findWriteBuffer(logEntry->inode.inode_number);
+    uint64_t end = offset + size;
+
+    // Buffered bytes overlay the log, so such reads take the copying path
+    if ((writeBuffer != NULL) && (writeBuffer->length > 0) && (writeBuffer->offset < end) && (writeBuffer->offset + writeBuffer->length > (uint64_t)offset)) {
+        pthread_rwlock_unlock(&fsLock);
+        return readCopy(path, bufp, size, offset, fi);
+    }
+
+    // Don't read past end of file
+    if ((uint64_t)offset >= dataSize) {
+        end = offset;
+    } else if (end > dataSize) {
+        end = dataSize;
+    }
+
+    // Each extent in range is one buffer, and so is each hole before, between or after them
+    struct wfs_extent_map *map = &extentMaps[logEntry->inode.inode_number];
+    struct fuse_bufvec *bufv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec) + 2 * map->count * sizeof(struct fuse_buf));
+    if (bufv == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = 0;
+    uint64_t curr = offset;
+    for (uint32_t i = 0; (i < map->count) && (curr < end); i++) {
+        struct wfs_extent_ref *extent = &map->extents[i];
+        uint64_t extentEnd = extent->offset + extent->length;
+        // Skip extents outside requested range
+        if ((extentEnd <= curr) || (extent->offset >= end)) {
+            continue;
+        }
+        // Hole before extent reads as zeros
+        if (extent->offset > curr) {
+            addBuf(bufv, extent->offset - curr, zeros(extent->offset - curr), 0);
+            curr = extent->offset;
+        }
+        uint64_t stop = (extentEnd < end) ? extentEnd : end;
+        struct wfs_log_entry *extentEntry = logEntryAt(extent->entry);
+        if (extentEntry->inode.flags & (WFS_LOG_COMPRESSED | WFS_LOG_SHARED)) {
+            // Data isn't in the image as is
+            char *mem = (char *)malloc(stop - curr);
+            if (mem == NULL) { // Memory allocation failed
+                perror("Memory allocation error");
+                exit(EXIT_FAILURE);
+            }
+            addBuf(bufv, stop - curr, mem, 0);
+            if (readExtent(extent, curr, stop - curr, mem) != 0) {
+                pthread_rwlock_unlock(&fsLock);
+                for (size_t j = 0; j < bufv->count; j++) {
+                    free(bufv->buf[j].mem);
+                }
+                free(bufv);
+                return -EIO;
+            }
+        } else {
+            // Cleaner keeps segment in use until FUSE is done reading it
+            addBuf(bufv, stop - curr, NULL, extent->data + (curr - extent->offset));
+            pinSegment(extent->data);
+        }
+        curr = stop;
+    }
+    // Hole up to end of range
+    if (curr < end) {
+        addBuf(bufv, end - curr, zeros(end - curr), 0);
+    }
+    pthread_rwlock_unlock(&fsLock);
+
+    *bufp = bufv;
+    return 0;
+}
+
+// Copy path without its last '/' and what follows into parentPath, which has room for PATH_MAX bytes. Returns
+// parentPath, or NULL if path has no '/'
+char *parsePathEnd(const char *path, char *parentPath) {
+    // Error Checking
+    const char *last = (path == NULL) ? NULL : strrchr(path, '/'); // Find last / in path
+    if (last == NULL) {
+        return NULL;
+    }
+
+    int remainderPathLen = last - path; // Length of path without filename
+    memcpy(parentPath, path, remainderPathLen); // Paths from FUSE are shorter than PATH_MAX
+    parentPath[remainderPathLen] = '\0'; // Null-terminate
+
+    return parentPath;
+}
+
+// Get filename from path. Returns the part of path after its last '/', without copying it
+const char *getFilename(const char *path) {
+    // Error Checking
+    if ((path == NULL) || (*path == '\0')) {
+        return NULL;
+    }
+
+    const char *last = strrchr(path, '/'); // Find last / in path
+    return (last == NULL) ? path : last + 1; // Move pointer past last slash
+}
+
+// Check if filename is valid
+int valid(const char *filename) {
+    const char *last = NULL; // Pointer to last dot in filename
+    while (*filename != '\0') { // Iterate over all characters in filename
+        if (*filename == '.') { // If character is a dot
+            last = filename; // Update last dot pointer
+        }
+        filename++;
+    }
+
+    // If dot is found, exclude characters after dot
+    while (*filename != '\0' && filename != last) {
+        // If character is not alphanumeric or underscore, invalid
+        if (!(isalnum(*last) || *last == '_')) {
+            return 0;
+        }
+        last++;
+    }
+
+    // All characters in filename are valid
+    return 1;
+    // I don't think this checks for if there isn't a dot in the filename?? It runs tho so idc
+}
+
+// Link new log entry into its parent directory and write both to log
+int addEntry(const char *newPath, struct wfs_log_entry *newLogEntry) {
+    const char *filename = getFilename(newPath);
+    char parentPath[PATH_MAX];
+
+    // Get parent directory log entry
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_log_entry *parent = lookupPath(parsePathEnd(newPath, parentPath));
+    int parentNum = (parent == NULL) ? -1 : (int)parent->inode.inode_number;
+    pthread_rwlock_unlock(&fsLock);
+    if (parent == NULL) { // Log entry not found
+        perror("Log entry does not exist");
+        return -ENOENT;
+    }
+
+    // Serialize updates to parent directory. Its log entries can't change while locked
+    lockInodes(&parentNum, 1);
+    pthread_rwlock_rdlock(&fsLock);
+    parent = getInode(parentNum);
+    if (parent == NULL) { // Parent was removed meanwhile
+        pthread_rwlock_unlock(&fsLock);
+        unlockInodes(&parentNum, 1);
+        perror("Log entry does not exist");
+        return -ENOENT;
+    }
+    if (!S_ISDIR(parent->inode.mode)) { // Only directories have buckets
+        pthread_rwlock_unlock(&fsLock);
+        unlockInodes(&parentNum, 1);
+        return -ENOTDIR;
+    }
+
+    // Check file doesn't exist already
+    if (dirFind(parent, filename) != NULL) {
+        pthread_rwlock_unlock(&fsLock);
+        unlockInodes(&parentNum, 1);
+        perror("Filename already exists");
+        return -EEXIST;
+    }
+
+    // Copy only the bucket the dentry goes in, and the halves of a bucket split to make room
+    newLogEntry->inode.inode_number = __atomic_add_fetch(&inodeCounter, 1, __ATOMIC_RELAXED);
+    struct wfs_dir_update update;
+    dirBegin(&update, parent);
+    int ret = dirAdd(&update, filename, newLogEntry->inode.inode_number);
+    pthread_rwlock_unlock(&fsLock);
+
+    // Append buckets and new log entry as one update
+    struct wfs_log_entry *logEntries[DIR_UPDATE_BUCKETS + 1];
+    struct wfs_log_entry *newEntries[DIR_UPDATE_BUCKETS + 1];
+    if (ret == 0) {
+        dirFinish(&update);
+        memcpy(logEntries, update.copies, update.count * sizeof(struct wfs_log_entry *));
+        logEntries[update.count] = newLogEntry;
+        ret = appendLogEntries(logEntries, update.count + 1, newEntries, UPDATE_SEGMENTS);
+    }
+    if (ret == 0) {
+        struct wfs_log_entry *newEntry = newEntries[update.count];
+
+        // Publish buckets and new log entry. A new directory's log entry is its only bucket
+        pthread_rwlock_wrlock(&fsLock);
+        publishBuckets(parentNum, newEntries, update.count);
+        if (S_ISDIR(newEntry->inode.mode)) {
+            publishBuckets(newEntry->inode.inode_number, &newEntry, 1);
+        } else {
+            setInode(newEntry->inode.inode_number, newEntry);
+        }
+        // Replace any negative dentry cache entry for path
+        dcachePut(newPath, newEntry->inode.inode_number);
+        pthread_rwlock_unlock(&fsLock);
+    }
+    dirFree(&update);
+    unlockInodes(&parentNum, 1);
+
+    return ret;
+}
+
+// Function to create a file
+static int wfs_mknod(const char *path, mode_t mode, dev_t rdev) {
+    // Remove mount point from path
+    const char *newPath = parsePath(path);
+
+    // Stats file isn't in log
+    if (strcmp(newPath, STATS_PATH) == 0) {
+        return -EEXIST;
     }
 
-    // Find mount point in path
-    const char *pointer = strstr(path, mnt);
-    if (pointer == NULL) { // Mount point not found
-        perror("Mount point not found");
-        return strdup(path);
-    }
-
-    // Move pointer past mount point
-    pointer += mntLen;
-    // Length of remaining path
-    int remainderPathLen = path + pathLen - pointer;
-    // Allocate memory for remaining path
-    char *remainderPath = (char *)malloc((remainderPathLen + 1) * sizeof(char));
-    if (remainderPath == NULL) { // Memory allocation failed
-        free(remainderPath);
-        perror("Memory allocation error");
-        exit(EXIT_FAILURE);
+    // Check valid filename
+    if (!valid(getFilename(newPath))) {
+        perror("Invalid File Name");
+        return -1;
+    }
+    if (strlen(getFilename(newPath)) > MAX_FILE_NAME_LEN) {
+        perror("File name too long");
+        return -ENAMETOOLONG;
     }
 
-    // Copy remaining path into new string
-    strncpy(remainderPath, pointer, remainderPathLen);
-    remainderPath[remainderPathLen] = '\0'; // Null terminate
+    // Create new inode for file. Inode number is assigned once parent is locked
+    struct wfs_inode newInode;
+    newInode.inode_number = 0;
+    newInode.deleted = 0;
+    newInode.mode = S_IFREG;
+    newInode.uid = getuid();
+    newInode.gid = getgid();
+    newInode.flags = 0;
+    newInode.size = sizeof(struct wfs_inode);
+    newInode.atime = time(NULL);
+    newInode.mtime = time(NULL);
+    newInode.ctime = time(NULL);
+    newInode.links = 1;
+
+    // Create new log entry for file. addEntry copies it to log
+    struct wfs_log_entry newLogEntry;
+    newLogEntry.inode = newInode; // Point log entry at created inode
 
-    return remainderPath;
+    return addEntry(newPath, &newLogEntry);
 }
 
-// Get log entry from path
-struct wfs_log_entry *getLogEntry(const char *path, int inodeNum) {
-    char *currPointer = tail; // Pointer to current log entry
-    currPointer += sizeof(struct wfs_sb); // Skip superblock
-
-    // Iterate over all log entries
-    while (currPointer != head) {
-        // Current log entry
-        struct wfs_log_entry *currLogEntry = (struct wfs_log_entry *)currPointer;
-        // If inode is not deleted
-        if (currLogEntry->inode.deleted != 1) {
-            // If inode number matches
-            if (currLogEntry->inode.inode_number == inodeNum) {
-                int pathLen = strlen(path);
-                // If path is root
-                if ((path == NULL) || (pathLen == 1) || (pathLen == 0)) {
-                    // Return current log entry
-                    return currLogEntry;
-                } else { // Path is not root
-                    // Copy path into new string
-                    char pathcpy[MAX_PATH_LENGTH];
-                    strcpy(pathcpy, path);
-                    // Get first token
-                    char *parent = strtok(pathcpy, "/");
-                    char *addr = currLogEntry->data;
-
-                    // Iterate over all dentries
-                    while (addr != (char *)(currLogEntry) + currLogEntry->inode.size) { // While not at end of data field
-                        // If dentry matches parent
-                        if (strcmp(((struct wfs_dentry *)addr)->name, parent) == 0) {
-                            const char *newPath = path;
-                            // Remove parent from path
-                            const char *first = strchr(newPath, '/'); // First '/'
-                            if (first == NULL) {
-                                // No / found, return empty string
-                                return getLogEntry("", ((struct wfs_dentry *)addr)->inode_number);
-                            }
-
-                            // Second '/' starting after first slash
-                            const char *second = strchr(first + 1, '/');
-                            if (second == NULL) {
-                                // No second / found, return empty string
-                                return getLogEntry("", ((struct wfs_dentry *)addr)->inode_number);
-                            }
-
-                            // Length of remaining path
-                            int length = strlen(second);
-                            char *remainderPath = (char *)malloc((length + 1) * sizeof(char));
-                            if (remainderPath == NULL) { // Memory allocation failed
-                                perror("Memory allocation error");
-                                free(remainderPath);
-                                exit(EXIT_FAILURE);
-                            }
-                            strcpy(remainderPath, second); // Copy remaining path into new string
-                            // Get log entry of remaining path and return it
-                            return getLogEntry(remainderPath, ((struct wfs_dentry *)addr)->inode_number);
-                        }
-                        // Move to next dentry
-                        addr += sizeof(struct wfs_dentry);
-                    }
+// Function to create a directory
+static int wfs_mkdir(const char *path, mode_t mode) {
+    // Remove mount point from path
+    const char *newPath = parsePath(path);
+
+    // Stats file isn't in log
+    if (strcmp(newPath, STATS_PATH) == 0) {
+        return -EEXIST;
+    }
+
+    // Verify dir name
+    if (!valid(getFilename(newPath))) {
+        perror("Invalid directory name");
+        return -1;
+    }
+    if (strlen(getFilename(newPath)) > MAX_FILE_NAME_LEN) {
+        perror("Directory name too long");
+        return -ENAMETOOLONG;
+    }
+
+    // Create new inode. Inode number is assigned once parent is locked
+    struct wfs_inode newInode;
+    newInode.inode_number = 0;
+    newInode.deleted = 0;
+    newInode.mode = S_IFDIR;
+    newInode.uid = getuid();
+    newInode.gid = getgid();
+    newInode.flags = 0;
+    newInode.size = sizeof(struct wfs_inode) + sizeof(struct wfs_dir); // Empty directory of one bucket
+    newInode.atime = time(NULL);
+    newInode.mtime = time(NULL);
+    newInode.ctime = time(NULL);
+    newInode.links = 1;
+
+    // Create a log entry for directory. addEntry copies it to log
+    uint32_t newLogEntryData[(sizeof(struct wfs_log_entry) + sizeof(struct wfs_dir)) / sizeof(uint32_t)];
+    struct wfs_log_entry *newLogEntry = (struct wfs_log_entry *)newLogEntryData;
+    newLogEntry->inode = newInode; // Point log entry at created inode
+    struct wfs_dir *dir = (struct wfs_dir *)newLogEntry->data;
+    dir->bucket = 0;
+    dir->buckets = 1;
+    dir->entries = 0; // No dentries yet
+    dir->count = 0;
+
+    return addEntry(newPath, newLogEntry);
+}
+
+// Append size bytes written at chunk aligned offset of file as a shared extent. Only chunks not already in the log are stored.
+// Caller holds inode lock of file
+int writeShared(struct wfs_log_entry *logEntry, const char *buf, size_t size, off_t offset, struct wfs_write_buffer *writeBuffer) {
+    // New chunks go to the log together with the shared extent log entry, so all of them must fit in a segment
+    size_t maxLength = (superblock->segment_size - WFS_SHARED_ENTRY_SIZE(0)) / (WFS_EXTENT_ENTRY_SIZE(CHUNK_SIZE) + sizeof(uint32_t)) * CHUNK_SIZE;
+    if (size > maxLength) {
+        int ret = writeShared(logEntry, buf, maxLength, offset, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+        pthread_rwlock_rdlock(&fsLock);
+        logEntry = getInode(logEntry->inode.inode_number); // Latest log entry is now the first part
+        pthread_rwlock_unlock(&fsLock);
+        ret = writeShared(logEntry, buf + maxLength, size - maxLength, offset + maxLength, writeBuffer);
+        return (ret < 0) ? ret : (int)size;
+    }
+    uint32_t count = size / CHUNK_SIZE;
+
+    // Everything is built in scratch space of this thread: index arrays, then the shared extent log entry, then room for
+    // a log entry per chunk, should every chunk be new
+    size_t arraysSize = 2 * (count + 1) * sizeof(struct wfs_log_entry *) + count * sizeof(uint32_t) + ((count + 7) & ~7);
+    char *scratch = stageBuffer(arraysSize + WFS_SHARED_ENTRY_SIZE(count) + (size_t)count * WFS_EXTENT_ENTRY_SIZE(CHUNK_SIZE));
+    struct wfs_log_entry **logEntries = (struct wfs_log_entry **)scratch;
+    struct wfs_log_entry **newEntries = logEntries + count + 1;
+    uint32_t *newChunks = (uint32_t *)(newEntries + count + 1); // Index into buf of each new chunk
+    char *isNew = (char *)(newChunks + count);
+    memset(isNew, 0, count);
+    struct wfs_log_entry *sharedEntry = (struct wfs_log_entry *)(scratch + arraysSize);
+    memset(sharedEntry, 0, WFS_SHARED_ENTRY_SIZE(count));
+    char *chunkEntries = (char *)sharedEntry + WFS_SHARED_ENTRY_SIZE(count);
+
+    // Build shared extent log entry carrying inode of file and its chunk list
+    sharedEntry->inode = logEntry->inode; // Copy inode of file
+    sharedEntry->inode.deleted = 0;
+    sharedEntry->inode.flags = (sharedEntry->inode.flags | WFS_LOG_EXTENT | WFS_LOG_SHARED) & ~WFS_LOG_COMPRESSED;
+    sharedEntry->inode.mtime = time(NULL); // Update modify time
+    sharedEntry->inode.ctime = time(NULL); // Update change time
+    sharedEntry->inode.size = WFS_SHARED_ENTRY_SIZE(count);
+    struct wfs_extent *extent = (struct wfs_extent *)sharedEntry->data;
+    extent->offset = offset;
+    extent->length = size;
+    extent->file_size = wfs_file_size(logEntry);
+    if (offset + size > extent->file_size) { // Write extends file
+        extent->file_size = offset + size;
+    }
+    struct wfs_shared *shared = sharedOf(sharedEntry);
+    shared->count = count;
+
+    // Look up each chunk. Chunks found are pinned so they can't be removed before the extent is published
+    uint32_t newCount = 0;
+    pthread_rwlock_rdlock(&fsLock);
+    pthread_mutex_lock(&chunkLock);
+    for (uint32_t i = 0; i < count; i++) {
+        const char *data = buf + (uint64_t)i * CHUNK_SIZE;
+        uint32_t print = wfs_crc32c(0, data, CHUNK_SIZE);
+        uint32_t id = findChunk(data, print);
+        if (id != 0) {
+            chunks[id].refs++;
+        } else {
+            // Chunk may repeat one that's new in this write
+            for (uint32_t j = 0; (j < newCount) && (id == 0); j++) {
+                if (memcmp(buf + (uint64_t)newChunks[j] * CHUNK_SIZE, data, CHUNK_SIZE) == 0) {
+                    id = shared->chunks[newChunks[j]];
                 }
             }
+            if (id == 0) {
+                id = ++chunkCounter;
+                newChunks[newCount++] = i;
+            }
+            isNew[i] = 1;
         }
-        // Move to next log entry
-        currPointer += currLogEntry->inode.size;
+        shared->chunks[i] = id;
     }
+    pthread_mutex_unlock(&chunkLock);
+    pthread_rwlock_unlock(&fsLock);
 
-    // Log entry not found
-    return NULL;
+    // Build log entries for new chunks. Their fingerprint goes where a file extent keeps the file size
+    for (uint32_t j = 0; j < newCount; j++) {
+        const char *data = buf + (uint64_t)newChunks[j] * CHUNK_SIZE;
+        struct wfs_inode chunkInode;
+        memset(&chunkInode, 0, sizeof(struct wfs_inode));
+        chunkInode.inode_number = shared->chunks[newChunks[j]];
+        chunkInode.mtime = chunkInode.ctime = time(NULL);
+        logEntries[j] = (struct wfs_log_entry *)chunkEntries;
+        buildExtentEntry(logEntries[j], &chunkInode, data, CHUNK_SIZE, 0, wfs_crc32c(0, data, CHUNK_SIZE));
+        logEntries[j]->inode.flags |= WFS_LOG_CHUNK;
+        chunkEntries += logEntries[j]->inode.size;
+    }
+    logEntries[newCount] = sharedEntry;
+
+    // Write new chunks and shared extent log entry to head as one update
+    uint64_t oldEntry = (char *)(logEntry) - tail;
+    int ret = appendLogEntries(logEntries, newCount + 1, newEntries, UPDATE_SEGMENTS);
+    if (ret != 0) {
+        // Unpin chunks found. New chunks aren't published, so they're skipped
+        pthread_rwlock_wrlock(&fsLock);
+        releaseChunks(shared->chunks, count);
+        pthread_rwlock_unlock(&fsLock);
+    } else {
+        // Publish new chunks, then log entry, and index its bytes
+        pthread_rwlock_wrlock(&fsLock);
+        for (uint32_t j = 0; j < newCount; j++) {
+            addChunk(newEntries[j]->inode.inode_number, (char *)(newEntries[j]) - tail);
+        }
+        pthread_mutex_lock(&chunkLock);
+        for (uint32_t i = 0; i < count; i++) {
+            if (isNew[i]) {
+                chunks[shared->chunks[i]].refs++;
+            }
+        }
+        pthread_mutex_unlock(&chunkLock);
+        struct wfs_log_entry *newEntry = newEntries[newCount];
+        setInode(newEntry->inode.inode_number, newEntry);
+        indexFileData(newEntry);
+        // Old latest log entry is dead unless it still holds live data
+        releaseLogEntry(newEntry->inode.inode_number, oldEntry);
+        // Bytes written from a write buffer are now in log
+        if (writeBuffer != NULL) {
+            writeBuffer->length = 0;
+        }
+        pthread_rwlock_unlock(&fsLock);
+    }
+
+    return (ret != 0) ? ret : (int)size;
 }
 
-// Function to get file attributes
-static int wfs_getattr(const char *path, struct stat *stbuf) {
+// Append extent log entry holding size bytes written at offset of file. Caller holds inode lock of file
+int writeExtent(struct wfs_log_entry *logEntry, const char *buf, size_t size, off_t offset, struct wfs_write_buffer *writeBuffer) {
+    // Whole chunks are deduplicated. Bytes before the first and after the last go to ordinary extents
+    uint64_t first = (offset + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+    uint64_t last = (offset + size) / CHUNK_SIZE * CHUNK_SIZE;
+    if (dedupData && (first < last)) {
+        uint64_t bounds[4] = { offset, first, last, offset + size };
+        for (int i = 0; i < 3; i++) {
+            if (bounds[i] == bounds[i + 1]) {
+                continue;
+            }
+            // Last part empties write buffer
+            struct wfs_write_buffer *partBuffer = (bounds[i + 1] == offset + size) ? writeBuffer : NULL;
+            const char *partBuf = buf + (bounds[i] - offset);
+            int ret = (i == 1) ? writeShared(logEntry, partBuf, bounds[i + 1] - bounds[i], bounds[i], partBuffer)
+                               : writeExtent(logEntry, partBuf, bounds[i + 1] - bounds[i], bounds[i], partBuffer);
+            if (ret < 0) {
+                return ret;
+            }
+            pthread_rwlock_rdlock(&fsLock);
+            logEntry = getInode(logEntry->inode.inode_number); // Latest log entry is now this part
+            pthread_rwlock_unlock(&fsLock);
+        }
+        return size;
+    }
+
+    // Extent log entry must fit in a segment, so larger writes are split
+    size_t maxLength = superblock->segment_size - WFS_EXTENT_ENTRY_SIZE(0);
+    if (size > maxLength) {
+        int ret = writeExtent(logEntry, buf, maxLength, offset, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+        pthread_rwlock_rdlock(&fsLock);
+        logEntry = getInode(logEntry->inode.inode_number); // Latest log entry is now the first part
+        pthread_rwlock_unlock(&fsLock);
+        ret = writeExtent(logEntry, buf + maxLength, size - maxLength, offset + maxLength, writeBuffer);
+        return (ret < 0) ? ret : (int)size;
+    }
+
+    // Build extent log entry carrying inode of file and only the written bytes
+    uint64_t fileSize = wfs_file_size(logEntry);
+    if (offset + size > fileSize) { // Write extends file
+        fileSize = offset + size;
+    }
+    struct wfs_log_entry *extentEntry = (struct wfs_log_entry *)stageBuffer(WFS_EXTENT_ENTRY_SIZE(size));
+    buildExtentEntry(extentEntry, &logEntry->inode, buf, size, offset, fileSize);
+    extentEntry->inode.mtime = time(NULL); // Update modify time
+    extentEntry->inode.ctime = time(NULL); // Update change time
+
+    // Write log entry to head
+    uint64_t oldEntry = (char *)(logEntry) - tail;
+    struct wfs_log_entry *newEntry;
+    int ret = appendLogEntries(&extentEntry, 1, &newEntry, UPDATE_SEGMENTS);
+    if (ret != 0) { // Log is full or failed
+        return ret;
+    }
+
+    // Publish log entry and index its bytes
+    pthread_rwlock_wrlock(&fsLock);
+    setInode(newEntry->inode.inode_number, newEntry);
+    indexFileData(newEntry);
+    // Old latest log entry is dead unless it still holds live data
+    releaseLogEntry(newEntry->inode.inode_number, oldEntry);
+    // Bytes written from a write buffer are now in log
+    if (writeBuffer != NULL) {
+        writeBuffer->length = 0;
+    }
+    pthread_rwlock_unlock(&fsLock);
+
+    return size;
+}
+
+// Move size bytes written at offset of file from src straight into extent log entries at head, without copying them
+// in memory first. Returns bytes written, or -ENOSPC or -EIO if none were.
+// Caller holds inode lock of file
+int spliceExtent(struct wfs_log_entry *logEntry, struct fuse_bufvec *src, size_t size, off_t offset) {
+    // Extent log entry must fit in a segment, so larger writes are split
+    size_t maxLength = superblock->segment_size - WFS_EXTENT_ENTRY_SIZE(0);
+    size_t done = 0;
+    while (done < size) {
+        uint32_t length = (size - done < maxLength) ? size - done : maxLength;
+        uint32_t entrySize = WFS_EXTENT_ENTRY_SIZE(length);
+        uint64_t reservation;
+        uint64_t entry = reserveLogEntries(entrySize, UPDATE_SEGMENTS, &reservation);
+        if (entry == 0) {
+            return (done > 0) ? (int)done : reserveError();
+        }
+
+        // Build header of extent log entry. Data goes straight into the disk image file, so only the header is built
+        uint64_t header[(sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent) + sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+        struct wfs_log_entry *headerEntry = (struct wfs_log_entry *)header;
+        headerEntry->inode = logEntry->inode; // Copy inode of file
+        headerEntry->inode.deleted = 0;
+        headerEntry->inode.flags = (headerEntry->inode.flags | WFS_LOG_EXTENT) & ~(WFS_LOG_COMPRESSED | WFS_LOG_SHARED | WFS_LOG_CONTINUED);
+        headerEntry->inode.size = entrySize;
+        headerEntry->inode.mtime = time(NULL); // Update modify time
+        headerEntry->inode.ctime = time(NULL); // Update change time
+        struct wfs_extent *extent = (struct wfs_extent *)headerEntry->data;
+        extent->offset = offset + done;
+        extent->length = length;
+        extent->file_size = wfs_file_size(logEntry);
+        if (offset + done + length > extent->file_size) { // Write extends file
+            extent->file_size = offset + done + length;
+        }
+
+        // Copy data through disk image file, so FUSE can splice it from its pipe into the page cache
+        uint64_t data = entry + sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent);
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(length);
+        dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        dst.buf[0].fd = diskFd;
+        dst.buf[0].pos = data;
+        ssize_t copied = fuse_buf_copy(&dst, src, FUSE_BUF_SPLICE_MOVE);
+
+        // Seal log entry. Its checksum covers data as the page cache now holds it, read back through the mapping, and
+        // the zero padding
+        static const char padding[4];
+        uint32_t paddingSize = entrySize - (data - entry) - length;
+        uint32_t crc = wfs_crc32c(wfs_inode_checksum(&headerEntry->inode), extent, sizeof(struct wfs_extent));
+        storage->map(segmentOf(entry));
+        crc = wfs_crc32c(crc, tail + data, length);
+        headerEntry->inode.checksum = wfs_crc32c(crc, padding, paddingSize);
+        struct iovec iov = { header, sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent) };
+        int ret = storage->write(entry, &iov, 1);
+        iov.iov_base = (void *)padding;
+        iov.iov_len = paddingSize;
+        if (ret == 0) {
+            ret = storage->write(data + length, &iov, 1);
+        }
+        if (copied != length) {
+            perror("Error copying write data");
+            ret = -EIO;
+        }
+        // Reserved space is committed either way. A log entry that wasn't written fails it and every later update
+        ret = publishLogEntries(entry, entrySize, reservation, 0, ret != 0);
+        if (ret != 0) {
+            return (done > 0) ? (int)done : ret;
+        }
+        struct wfs_log_entry *newEntry = logEntryAt(entry);
+
+        // Publish log entry and index its bytes
+        uint64_t oldEntry = (char *)(logEntry) - tail;
+        pthread_rwlock_wrlock(&fsLock);
+        setInode(newEntry->inode.inode_number, newEntry);
+        indexFileData(newEntry);
+        // Old latest log entry is dead unless it still holds live data
+        releaseLogEntry(newEntry->inode.inode_number, oldEntry);
+        pthread_rwlock_unlock(&fsLock);
+        logEntry = newEntry;
+        done += length;
+    }
+
+    return size;
+}
+
+// Write buffered bytes to log as one extent. Caller holds inode lock of file
+int flushWriteBuffer(struct wfs_write_buffer *writeBuffer) {
+    // Nothing buffered
+    if (writeBuffer->length == 0) {
+        return 0;
+    }
+
+    // File has no log entry to add to
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_log_entry *logEntry = getInode(writeBuffer->inode_number);
+    pthread_rwlock_unlock(&fsLock);
+    if (logEntry == NULL) {
+        return 0;
+    }
+
+    // Buffer is clean once extent is published
+    int ret = writeExtent(logEntry, writeBuffer->data, writeBuffer->length, writeBuffer->offset, writeBuffer);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return 0;
+}
+
+// Merge write into buffered range, flushing when it can't be merged or buffer is full. Caller holds inode lock of file
+int bufferWrite(struct wfs_write_buffer *writeBuffer, const char *buf, size_t size, off_t offset) {
+    uint64_t end = offset + size;
+
+    // Flush if write neither overlaps nor touches buffered range
+    if ((writeBuffer->length > 0) && ((offset > writeBuffer->offset + writeBuffer->length) || (end < writeBuffer->offset))) {
+        int ret = flushWriteBuffer(writeBuffer);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    // Range covered by buffer once write is merged
+    uint64_t newOffset = offset;
+    uint64_t newEnd = end;
+    if (writeBuffer->length > 0) {
+        newOffset = (writeBuffer->offset < newOffset) ? writeBuffer->offset : newOffset;
+        newEnd = (writeBuffer->offset + writeBuffer->length > newEnd) ? writeBuffer->offset + writeBuffer->length : newEnd;
+    }
+
+    // Make sure merged range still fits on disk when flushed
+    if (logFree() < (int64_t)WFS_EXTENT_ENTRY_SIZE(newEnd - newOffset)) {
+        if (writeBuffer->length > 0) {
+            int ret = flushWriteBuffer(writeBuffer);
+            if (ret < 0) {
+                return ret;
+            }
+            newOffset = offset;
+            newEnd = end;
+        }
+        if (logFree() < (int64_t)WFS_EXTENT_ENTRY_SIZE(size)) {
+            perror("Insufficient disk space");
+            return -ENOSPC;
+        }
+    }
+
+    // Readers overlay buffer, so change it under write lock
+    pthread_rwlock_wrlock(&fsLock);
+
+    // Grow buffer to hold merged range
+    if (newEnd - newOffset > writeBuffer->capacity) {
+        char *newData = (char *)realloc(writeBuffer->data, newEnd - newOffset);
+        if (newData == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        writeBuffer->data = newData;
+        writeBuffer->capacity = newEnd - newOffset;
+    }
+
+    // Shift buffered bytes if write starts before them, then copy write in
+    if ((writeBuffer->length > 0) && (newOffset < writeBuffer->offset)) {
+        memmove(writeBuffer->data + (writeBuffer->offset - newOffset), writeBuffer->data, writeBuffer->length);
+    }
+    memcpy(writeBuffer->data + (offset - newOffset), buf, size);
+    writeBuffer->offset = newOffset;
+    writeBuffer->length = newEnd - newOffset;
+    pthread_rwlock_unlock(&fsLock);
+
+    // Emit extent once buffer is full
+    if (writeBuffer->length >= WRITE_BUFFER_SIZE) {
+        int ret = flushWriteBuffer(writeBuffer);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return size;
+}
+
+// Function to open a file
+static int wfs_open(const char *path, struct fuse_file_info *fi) {
     // Remove mount point from path
     const char *newPath = parsePath(path);
 
+    // Stats file is read-only and changes all the time, so kernel doesn't cache it
+    if (strcmp(newPath, STATS_PATH) == 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
+        }
+        fi->direct_io = 1;
+        fi->fh = STATS_HANDLE;
+        return 0;
+    }
+
     // Get log entry
-    struct wfs_log_entry *logEntry = getLogEntry(newPath, 0);
+    pthread_rwlock_wrlock(&fsLock);
+    struct wfs_log_entry *logEntry = lookupPath(newPath);
     if (logEntry == NULL) { // Log entry not found
+        pthread_rwlock_unlock(&fsLock);
         perror("Log entry does not exist");
         return -ENOENT;
     }
 
-    // Fill in stat struct for log entry
-    stbuf->st_uid = logEntry->inode.uid;
-    stbuf->st_gid = logEntry->inode.gid;
-    stbuf->st_atime = time(NULL); // Update last access time
-    stbuf->st_mtime = logEntry->inode.mtime;
-    stbuf->st_mode = logEntry->inode.mode;
-    stbuf->st_nlink = logEntry->inode.links;
-    stbuf->st_size = logEntry->inode.size;
+    // Handle names file by inode number. Its write buffer comes with the first write
+    openFiles[logEntry->inode.inode_number].refs += 1;
+    fi->fh = (uint64_t)logEntry->inode.inode_number + FILE_HANDLE;
+    pthread_rwlock_unlock(&fsLock);
 
     return 0;
 }
 
-// Function to read data from file
-static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    // Remove mount point from path
-    const char *newPath = parsePath(path);
+// Function to write data to file
+static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     // Get log entry
-    struct wfs_log_entry *logEntry = getLogEntry(newPath, 0);
-    if (logEntry == NULL) { // Log entry not found
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_log_entry *logEntry = handleEntry(path, fi);
+    int inodeNum = (logEntry == NULL) ? -1 : (int)logEntry->inode.inode_number;
+    pthread_rwlock_unlock(&fsLock);
+    if(logEntry == NULL) { // Log entry not founds
         perror("Log entry does not exist");
         return -ENOENT;
     }
-    // end of log entry - start of data field
-    int dataSize = logEntry->inode.size - sizeof(struct wfs_log_entry);
 
-    // Check if offset is too big
-    if (offset >= dataSize) {
+    // Serialize writes to file. Its latest log entry can't change while locked
+    lockInodes(&inodeNum, 1);
+    pthread_rwlock_rdlock(&fsLock);
+    logEntry = getInode(inodeNum);
+    pthread_rwlock_unlock(&fsLock);
+    if (logEntry == NULL) { // File was removed meanwhile
+        unlockInodes(&inodeNum, 1);
+        return -ENOENT;
+    }
+
+    // Update last access time
+    logEntry->inode.atime = time(NULL);
+
+    int ret;
+    if ((handleInode(fi) != -1) && (syncMode != WFS_SYNC_STRICT)) {
+        // Buffer write if file is open, unless it has to be on disk when write returns
+        ret = bufferWrite(getWriteBuffer(inodeNum), buf, size, offset);
+    } else {
+        ret = writeExtent(logEntry, buf, size, offset, NULL);
+    }
+    unlockInodes(&inodeNum, 1);
+
+    return ret;
+}
+
+// Function to flush buffered writes when a file descriptor is closed
+static int wfs_flush(const char *path, struct fuse_file_info *fi) {
+    int inodeNum = handleInode(fi);
+    if (inodeNum == -1) {
+        return 0;
+    }
+
+    // Write buffer can't come or go while inode is locked
+    lockInodes(&inodeNum, 1);
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_write_buffer *writeBuffer = findWriteBuffer(inodeNum);
+    pthread_rwlock_unlock(&fsLock);
+    int ret = (writeBuffer == NULL) ? 0 : flushWriteBuffer(writeBuffer);
+    unlockInodes(&inodeNum, 1);
+
+    return ret;
+}
+
+// Function to make a file durable. Its latest log entry comes after everything else written to it, so the log
+// only has to be synced up to there
+static int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void)datasync;
+    if (isStats(path, fi)) {
+        return 0;
+    }
+
+    // Get inode number from open handle, or look file up
+    int inodeNum = handleInode(fi);
+    if (inodeNum == -1) {
+        pthread_rwlock_rdlock(&fsLock);
+        struct wfs_log_entry *logEntry = handleEntry(path, fi);
+        inodeNum = (logEntry == NULL) ? -1 : (int)logEntry->inode.inode_number;
+        pthread_rwlock_unlock(&fsLock);
+        if (logEntry == NULL) { // Log entry not found
+            perror("Log entry does not exist");
+            return -ENOENT;
+        }
+    }
+
+    // Flush buffered writes, then find commit covering them
+    lockInodes(&inodeNum, 1);
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_write_buffer *writeBuffer = findWriteBuffer(inodeNum);
+    pthread_rwlock_unlock(&fsLock);
+    int ret = (writeBuffer == NULL) ? 0 : flushWriteBuffer(writeBuffer);
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_log_entry *logEntry = getInode(inodeNum);
+    uint64_t ticket = (logEntry == NULL) ? 0 : entryTicket(logEntry);
+    pthread_rwlock_unlock(&fsLock);
+    unlockInodes(&inodeNum, 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // A failed background sync may have covered this file, so it is reported even if this sync succeeds
+    ret = syncLog(ticket);
+    pthread_mutex_lock(&syncLock);
+    if (ret == 0) {
+        ret = syncError;
+    }
+    syncError = 0;
+    pthread_mutex_unlock(&syncLock);
+
+    return ret;
+}
+
+// Function to release an open file
+static int wfs_release(const char *path, struct fuse_file_info *fi) {
+    int inodeNum = handleInode(fi);
+    if (inodeNum == -1) {
         return 0;
     }
-    // Read file data into buffer
-    memcpy(buf, logEntry->data + offset, size);
+    lockInodes(&inodeNum, 1);
+
+    // Bytes of a file unlinked while open go with its last handle, so they needn't reach the log
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_open_file *openFile = &openFiles[inodeNum];
+    int last = openFile->unlinked && (openFile->refs == 1);
+    struct wfs_write_buffer *writeBuffer = openFile->buffer;
+    pthread_rwlock_unlock(&fsLock);
+    int ret = (last || (writeBuffer == NULL)) ? 0 : flushWriteBuffer(writeBuffer);
+
+    // Free buffer once last handle is released. A file unlinked while open is removed with it
+    pthread_rwlock_wrlock(&fsLock);
+    openFile = &openFiles[inodeNum];
+    openFile->refs -= 1;
+    if (openFile->refs == 0) {
+        openFile->buffer = NULL;
+        if (openFile->unlinked) {
+            openFile->unlinked = 0;
+            removeInode(inodeNum, getInode(inodeNum));
+        }
+        if (writeBuffer != NULL) {
+            free(writeBuffer->data);
+            free(writeBuffer);
+        }
+    }
+    pthread_rwlock_unlock(&fsLock);
+    unlockInodes(&inodeNum, 1);
+    fi->fh = 0;
+
+    return ret;
+}
+
+// Function to write data to file from a buffer vector. Large writes go straight to the log, so FUSE can splice them
+// in without them being copied in memory. Others, and all writes while compression or deduplication is on, are
+// gathered into memory and take the wfs_write path
+static int wfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    size_t size = fuse_buf_size(buf);
+    if ((size < WRITE_BUFFER_SIZE) || compressData || dedupData) {
+        // Data already in one piece of memory needs no copy
+        if ((buf->count == 1) && (buf->idx == 0) && (buf->off == 0) && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+            return wfs_write(path, buf->buf[0].mem, size, offset, fi);
+        }
+        struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+        mem.buf[0].mem = writeStage(size);
+        ssize_t copied = fuse_buf_copy(&mem, buf, 0);
+        return (copied < 0) ? (int)copied : wfs_write(path, mem.buf[0].mem, copied, offset, fi);
+    }
+
+    // Get log entry
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_log_entry *logEntry = handleEntry(path, fi);
+    int inodeNum = (logEntry == NULL) ? -1 : (int)logEntry->inode.inode_number;
+    pthread_rwlock_unlock(&fsLock);
+    if (logEntry == NULL) { // Log entry not found
+        perror("Log entry does not exist");
+        return -ENOENT;
+    }
+
+    // Serialize writes to file
+    lockInodes(&inodeNum, 1);
+
+    // Buffered bytes are older than this write, so they go to log first
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_write_buffer *writeBuffer = findWriteBuffer(inodeNum);
+    pthread_rwlock_unlock(&fsLock);
+    if (writeBuffer != NULL) {
+        int ret = flushWriteBuffer(writeBuffer);
+        if (ret < 0) {
+            unlockInodes(&inodeNum, 1);
+            return ret;
+        }
+    }
+    pthread_rwlock_rdlock(&fsLock);
+    logEntry = getInode(inodeNum);
+    pthread_rwlock_unlock(&fsLock);
+    if (logEntry == NULL) { // File was removed meanwhile
+        unlockInodes(&inodeNum, 1);
+        return -ENOENT;
+    }
+
     // Update last access time
     logEntry->inode.atime = time(NULL);
 
-    return size;
+    int ret = spliceExtent(logEntry, buf, size, offset);
+    unlockInodes(&inodeNum, 1);
+
+    return ret;
 }
 
-// Remove last '/' from path
-char *parsePathEnd(const char *path) {
-    // Error Checking
-    int pathLen = strlen(path);
-    int mntLen = strlen(mnt);
-    if ((path == NULL) || (mnt == NULL) || (pathLen == 0) || (mntLen == 0)) {
-        return NULL;
+// Function to open a directory. Its handle is a wfs_dir_handle, so 0 still means no handle
+static int wfs_opendir(const char *path, struct fuse_file_info *fi) {
+    // Remove mount point from path
+    const char *newPath = parsePath(path);
+
+    // Get log entry
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_log_entry *logEntry = lookupPath(newPath);
+    int inodeNum = (logEntry == NULL) ? -1 : (int)logEntry->inode.inode_number;
+    int isDir = (logEntry != NULL) && S_ISDIR(logEntry->inode.mode);
+    pthread_rwlock_unlock(&fsLock);
+    if (logEntry == NULL) { // Log entry not found
+        perror("Log entry does not exist");
+        return -ENOENT;
+    }
+    if (!isDir) {
+        return -ENOTDIR;
     }
+    struct wfs_dir_handle *handle = calloc(1, sizeof(struct wfs_dir_handle));
+    if (handle == NULL) {
+        return -ENOMEM;
+    }
+    handle->inode_number = inodeNum;
+    pthread_mutex_init(&handle->lock, NULL);
+    fi->fh = (uint64_t)(uintptr_t)handle;
+
+    return 0;
+}
 
-    const char* last = strrchr(path, '/'); // Find last / in path
-    int remainderPathLen = last - path; // Length of path without extension
-    char* remainderPath = malloc(remainderPathLen + 1);
-    strncpy(remainderPath, path, remainderPathLen); // Copy path without extension into new string
-    remainderPath[remainderPathLen] = '\0'; // Null-terminate
+// Function to close a directory, dropping the names its cookies refer to
+static int wfs_releasedir(const char *path, struct fuse_file_info *fi) {
+    (void)path;
+    struct wfs_dir_handle *handle = (struct wfs_dir_handle *)(uintptr_t)fi->fh;
+    if (handle == NULL) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < handle->count; i++) {
+        free(handle->names[i]);
+    }
+    free(handle->names);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+    fi->fh = 0;
 
-    return remainderPath;
+    return 0;
 }
 
-// Get filename from path
-char *getFilename(const char *path) {
-    // Error Checking
-    int pathLen = strlen(path);
-    if ((path == NULL) || (pathLen == 0)) {
-        return NULL;
+// Function to read directory entries
+static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    // Get log entry from handle opendir made, or by walking path
+    struct wfs_dir_handle *handle = ((fi != NULL) && (fi->fh != 0)) ? (struct wfs_dir_handle *)(uintptr_t)fi->fh : NULL;
+    if (handle != NULL) {
+        pthread_mutex_lock(&handle->lock);
+    }
+    pthread_rwlock_rdlock(&fsLock);
+    struct wfs_log_entry *logEntry = (handle != NULL) ? getInode(handle->inode_number) : lookupPath(parsePath(path));
+    int ret = 0;
+    if (logEntry == NULL) { // Log entry not found
+        perror("Log entry does not exist");
+        ret = -ENOENT;
     }
 
-    const char *last = strrchr(path, '/'); // Find last / in path
-    last += 1; // Move pointer past last slash
-    int remainderLength = strlen(last); // Length of filename
-    char *filename = (char *)malloc((remainderLength + 1) * sizeof(char));
-    if (filename == NULL) { // Memory allocation failed
-        perror("Memory allocation error");
-        free(filename);
-        exit(EXIT_FAILURE);
+    // Walk buckets in hash order, each over its sorted index, resuming after dentry offset names. Each bucket holds one
+    // range of hashes, so the bucket holding the hash offset names is the first to look at
+    int inodeNum = (logEntry == NULL) ? -1 : (int)logEntry->inode.inode_number;
+    uint32_t buckets = (logEntry == NULL) ? 0 : ((struct wfs_dir *)logEntry->data)->buckets;
+    int full = 0;
+    for (uint64_t hash = (offset <= 0) ? 0 : (uint64_t)offset >> DIR_COOKIE_NAME_BITS; (ret == 0) && (hash <= UINT32_MAX) && !full;) {
+        uint32_t bucket = wfs_dir_bucket(hash, buckets);
+        struct wfs_log_entry *bucketEntry = dirBucket(inodeNum, bucket);
+        if (bucketEntry == NULL) { // Bucket not in maps
+            ret = -EIO;
+            break;
+        }
+        struct wfs_dir *dir = (struct wfs_dir *)bucketEntry->data;
+        for (uint32_t pos = dirResume(handle, dir, offset); pos < dir->count; pos++) {
+            struct wfs_dentry *currPointer = wfs_dir_entry(dir, pos); // Current dentry
+            // Dentry names the inode, so there's no path to walk
+            struct wfs_log_entry *currLogEntry = getInode(currPointer->inode_number);
+            if (currLogEntry == NULL) { // Log entry not found
+                perror("Log entry does not exist");
+                ret = -ENOENT;
+                break;
+            }
+            off_t cookie = dirCookie(handle, dir, pos);
+            if (cookie == -1) {
+                ret = -ENOMEM;
+                break;
+            }
+
+            // create a struct stat for log entry
+            struct stat stbuf = {0};
+            fillStat(currLogEntry, &stbuf);
+            // Add dentry to buffer. Next call resumes after it
+            if (filler(buf, currPointer->name, &stbuf, cookie) != 0) {
+                // Buffer full
+                full = 1;
+                break;
+            }
+        }
+        hash = wfs_dir_end(bucket, buckets);
+    }
+    pthread_rwlock_unlock(&fsLock);
+    if (handle != NULL) {
+        pthread_mutex_unlock(&handle->lock);
     }
 
-    strcpy(filename, last); // Copy filename into new string
-    return filename;
+    return ret;
 }
 
-// Check if file or dir exists already
-int exists(const char *path) {
-    // Get filename
-    char *filename = getFilename(path);
-    // Check if filename is unique
-    struct wfs_log_entry *parent = getLogEntry(parsePathEnd(path), 0);
-    if (parent == NULL) { // Log entry not found
+// Remove file at path, without mount point
+int unlinkPath(const char *newPath) {
+    // Get parent and file log entries
+    pthread_rwlock_rdlock(&fsLock);
+    char parentPath[PATH_MAX];
+    struct wfs_log_entry *parentLogEntry = lookupPath(parsePathEnd(newPath, parentPath));
+    struct wfs_log_entry *logEntry = lookupPath(newPath);
+    int inodes[2] = { (parentLogEntry == NULL) ? -1 : (int)parentLogEntry->inode.inode_number, (logEntry == NULL) ? -1 : (int)logEntry->inode.inode_number };
+    pthread_rwlock_unlock(&fsLock);
+    if ((parentLogEntry == NULL) || (logEntry == NULL)) { // Log entry not found
         perror("Log entry does not exist");
         return -ENOENT;
     }
 
-    // Start of data field
-    char *addr = parent->data;
-    // Iterate over all dentry's
-    while (addr != (char *)(parent) + parent->inode.size) {
-        // If filename matches
-        if (strcmp(((struct wfs_dentry *)addr)->name, filename) == 0) {
-            // Filename exists already
-            return 0;
-        }
-        int sizeDentry = sizeof(struct wfs_dentry);
-        addr += sizeDentry;
+    // Serialize with other updates to parent directory and file
+    lockInodes(inodes, 2);
+    pthread_rwlock_rdlock(&fsLock);
+    parentLogEntry = getInode(inodes[0]);
+    logEntry = getInode(inodes[1]);
+
+    // Find target file's dentry. Parent or file may have been removed meanwhile
+    if ((parentLogEntry == NULL) || (logEntry == NULL) || (dirFind(parentLogEntry, getFilename(newPath)) == NULL)) {
+        pthread_rwlock_unlock(&fsLock);
+        unlockInodes(inodes, 2);
+        perror("Dentry does not exist");
+        return -ENOENT;
     }
 
-    // Filename valid. DNE
-    return 1;
-}
+    // Update parent log entry access time
+    parentLogEntry->inode.atime = time(NULL);
 
-// Check if filename is valid
-int valid(const char *filename) {
-    const char *last = NULL; // Pointer to last dot in filename
-    while (*filename != '\0') { // Iterate over all characters in filename
-        if (*filename == '.') { // If character is a dot
-            last = filename; // Update last dot pointer
-        }
-        filename++;
-    }
+    // Copy only the bucket holding target file's dentry, without it
+    struct wfs_dir_update update;
+    dirBegin(&update, parentLogEntry);
+    int ret = dirDrop(&update, getFilename(newPath));
+    pthread_rwlock_unlock(&fsLock);
 
-    // If dot is found, exclude characters after dot
-    while (*filename != '\0' && filename != last) {
-        // If character is not alphanumeric or underscore, invalid
-        if (!(isalnum(*last) || *last == '_')) {
-            return 0;
-        }
-        last++;
+    // Append bucket and tombstone of file as one update. Unlink may use REMOVAL_SEGMENTS, since it frees more than it writes
+    struct wfs_log_entry tombstone;
+    struct wfs_log_entry *logEntries[DIR_UPDATE_BUCKETS + 1];
+    struct wfs_log_entry *newEntries[DIR_UPDATE_BUCKETS + 1];
+    if (ret == 0) {
+        dirFinish(&update);
+        buildTombstone(&tombstone, &logEntry->inode);
+        memcpy(logEntries, update.copies, update.count * sizeof(struct wfs_log_entry *));
+        logEntries[update.count] = &tombstone;
+        ret = appendLogEntries(logEntries, update.count + 1, newEntries, CLEANER_SEGMENTS);
     }
+    if (ret == 0) {
+        // Publish removal
+        pthread_rwlock_wrlock(&fsLock);
+        removeInode(inodes[1], logEntry);
+        publishBuckets(inodes[0], newEntries, update.count);
+        // Path no longer exists
+        dcachePut(newPath, -1);
+        pthread_rwlock_unlock(&fsLock);
+    }
+    dirFree(&update);
+    unlockInodes(inodes, 2);
 
-    // All characters in filename are valid
-    return 1;
-    // I don't think this checks for if there isn't a dot in the filename?? It runs tho so idc
+    return ret;
 }
 
-// Function to create a file
-static int wfs_mknod(const char *path, mode_t mode, dev_t rdev) {
+// Function to remove a file
+static int wfs_unlink(const char *path) {
     // Remove mount point from path
     const char *newPath = parsePath(path);
 
-    // Check valid filename
-    if (!valid(getFilename(newPath))) {
-        perror("Invalid File Name");
-        return -1;
+    // Stats file isn't in log
+    if (strcmp(newPath, STATS_PATH) == 0) {
+        return -EPERM;
     }
-    // Check file doesn't exist already
-    if (!exists(newPath)) {
-        perror("Filename already exists");
-        return -EEXIST;
+
+    // Cleaner may hold the free segment kept for unlink while it moves a segment, and gives it back once that segment
+    // is free. Try again after each cleaner pass that reclaims space
+    int ret = unlinkPath(newPath);
+    while ((ret == -ENOSPC) && waitCleaner()) {
+        ret = unlinkPath(newPath);
     }
 
-    // Create new inode for file
-    struct wfs_inode newInode;
-    inodeCounter += 1;
-    newInode.inode_number = inodeCounter;
-    newInode.deleted = 0;
-    newInode.mode = S_IFREG;
-    newInode.uid = getuid();
-    newInode.gid = getgid();
-    newInode.flags = 0;
-    newInode.size = sizeof(struct wfs_inode);
-    newInode.atime = time(NULL);
-    newInode.mtime = time(NULL);
-    newInode.ctime = time(NULL);
-    newInode.links = 1;
+    return ret;
+}
 
-    // Create new dentry for file
-    struct wfs_dentry *newDentry = (struct wfs_dentry *)malloc(sizeof(struct wfs_dentry));
-    if (newDentry != NULL) {
-        // Copy filename
-        strncpy(newDentry->name, getFilename(newPath), MAX_FILE_NAME_LEN - 1);
-        newDentry->name[MAX_FILE_NAME_LEN - 1] = '\0'; // Null terminate
-        newDentry->inode_number = newInode.inode_number; // Point dentry at created inode
-    } else { // Memory allocation failed
-        perror("Memory allocation error");
-        free(newDentry);
-        exit(EXIT_FAILURE);
+// Function to rename a file or directory. Only directory log entries are appended. The renamed inode's log entries stay
+// where they are, so cost doesn't depend on file size. An existing target is replaced in the same update
+static int wfs_rename(const char *from, const char *to) {
+    // Remove mount point from paths
+    const char *newFrom = parsePath(from);
+    const char *newTo = parsePath(to);
+    const char *fromName = getFilename(newFrom);
+    const char *toName = getFilename(newTo);
+
+    // Stats file isn't in log
+    if ((strcmp(newFrom, STATS_PATH) == 0) || (strcmp(newTo, STATS_PATH) == 0)) {
+        return -EPERM;
     }
 
-    // Get parent directory log entry
-    struct wfs_log_entry *parent = getLogEntry(parsePathEnd(newPath), 0);
-    if (parent == NULL) { // Log entry not found
-        perror("Log entry does not exist");
-        return -ENOENT;
+    // Check valid filename
+    if (!valid(toName)) {
+        perror("Invalid File Name");
+        return -EINVAL;
     }
-    // Check if there is enough space to create file
-    if ((totalSize + parent->inode.size + sizeof(struct wfs_dentry) + sizeof(struct wfs_log_entry)) > MAX_SIZE) {
-        perror("Insufficient disk space");
-        return -ENOSPC;
+    if (strlen(toName) > MAX_FILE_NAME_LEN) {
+        perror("File name too long");
+        return -ENAMETOOLONG;
     }
 
-    // Make copy of old log entry and add created dentry to data field
-    struct wfs_log_entry *logEntryCopy = (struct wfs_log_entry *)malloc(parent->inode.size + sizeof(struct wfs_dentry));
-    if (logEntryCopy != NULL) {
-        // Copy old log entry to new log entry
-        memcpy(logEntryCopy, parent, parent->inode.size);
-        // Add dentry to logEntryCopy's and update new log entry size
-        memcpy((char *)(logEntryCopy) + logEntryCopy->inode.size, newDentry, sizeof(struct wfs_dentry));
-        logEntryCopy->inode.size += sizeof(struct wfs_dentry); // Update inode size
-        memcpy(head, logEntryCopy, logEntryCopy->inode.size); // Write log entry to log
-        head += logEntryCopy->inode.size; // Update head
-        totalSize += logEntryCopy->inode.size; // Update total size
-    } else { // Memory allocation failed
-        perror("Memory allocation error");
-        free(logEntryCopy);
-        exit(EXIT_FAILURE);
+    // Directory can't move below itself
+    size_t fromLen = strlen(newFrom);
+    if ((strncmp(newTo, newFrom, fromLen) == 0) && (newTo[fromLen] == '/')) {
+        return -EINVAL;
     }
 
-    // Mark old log entry as deleted
-    parent->inode.deleted = 1;
+    struct wfs_log_entry *srcParent;
+    struct wfs_log_entry *logEntry;
+    struct wfs_log_entry *dstParent;
+    struct wfs_log_entry *target;
+    int inodes[4]; // Source parent, destination parent, source and target, if there is one
+    int count;
+    for (;;) {
+        // Get parents, source and target log entries
+        char fromParent[PATH_MAX];
+        char toParent[PATH_MAX];
+        pthread_rwlock_rdlock(&fsLock);
+        srcParent = lookupPath(parsePathEnd(newFrom, fromParent));
+        logEntry = lookupPath(newFrom);
+        dstParent = lookupPath(parsePathEnd(newTo, toParent));
+        target = lookupPath(newTo);
+        inodes[0] = (srcParent == NULL) ? -1 : (int)srcParent->inode.inode_number;
+        inodes[1] = (dstParent == NULL) ? -1 : (int)dstParent->inode.inode_number;
+        inodes[2] = (logEntry == NULL) ? -1 : (int)logEntry->inode.inode_number;
+        inodes[3] = (target == NULL) ? -1 : (int)target->inode.inode_number;
+        pthread_rwlock_unlock(&fsLock);
+        if ((srcParent == NULL) || (logEntry == NULL) || (dstParent == NULL)) { // Log entry not found
+            perror("Log entry does not exist");
+            return -ENOENT;
+        }
+        if (!S_ISDIR(dstParent->inode.mode)) { // Only directories have buckets
+            return -ENOTDIR;
+        }
+        if (inodes[2] == inodes[3]) { // Renamed onto itself
+            return 0;
+        }
 
-    // Create new log entry for file
-    struct wfs_log_entry *newLogEntry = (struct wfs_log_entry *)malloc(sizeof(struct wfs_log_entry));
-    if (newLogEntry != NULL) {
-        newLogEntry->inode = newInode; // Point log entry at created inode
-        memcpy(head, newLogEntry, newLogEntry->inode.size); // Add log entry to log
-        head += newLogEntry->inode.size; // Update head
-        totalSize += newLogEntry->inode.size; // Update total size 
-    } else { // Memory allocation failed
-        free(newLogEntry);
-        perror("Memory allocation error");
-        exit(EXIT_FAILURE);
+        // Serialize with other updates to both directories, source and target
+        count = (target == NULL) ? 3 : 4;
+        lockInodes(inodes, count);
+        pthread_rwlock_rdlock(&fsLock);
+        srcParent = getInode(inodes[0]);
+        dstParent = getInode(inodes[1]);
+        logEntry = getInode(inodes[2]);
+        target = (count == 4) ? getInode(inodes[3]) : NULL;
+        struct wfs_dentry *srcDentry = (srcParent == NULL) ? NULL : dirFind(srcParent, fromName);
+        struct wfs_dentry *dstDentry = (dstParent == NULL) ? NULL : dirFind(dstParent, toName);
+        pthread_rwlock_unlock(&fsLock);
+
+        // Source may have been removed, and target created or removed, meanwhile
+        if ((dstParent == NULL) || (logEntry == NULL) || (srcDentry == NULL) || (srcDentry->inode_number != (uint32_t)inodes[2])) {
+            unlockInodes(inodes, count);
+            perror("Dentry does not exist");
+            return -ENOENT;
+        }
+        if (((dstDentry != NULL) == (target != NULL)) && ((dstDentry == NULL) || (dstDentry->inode_number == (uint32_t)inodes[3]))) {
+            break;
+        }
+        unlockInodes(inodes, count); // Look again
     }
 
-    return 0;
-}
+    // Target must be of the same kind, and an empty directory if it is one
+    int ret = 0;
+    if (target != NULL) {
+        if (S_ISDIR(target->inode.mode) && !S_ISDIR(logEntry->inode.mode)) {
+            ret = -EISDIR;
+        } else if (!S_ISDIR(target->inode.mode) && S_ISDIR(logEntry->inode.mode)) {
+            ret = -ENOTDIR;
+        } else if (S_ISDIR(target->inode.mode) && (((struct wfs_dir *)target->data)->entries > 0)) {
+            ret = -ENOTEMPTY;
+        }
+    }
+    if (ret != 0) {
+        unlockInodes(inodes, count);
+        return ret;
+    }
 
-// Function to create a directory
-static int wfs_mkdir(const char *path, mode_t mode) {
-    // Remove mount point from path
-    const char *newPath = parsePath(path);
+    // Copy only the buckets holding the two names. A replaced target's dentry just names the source inode instead
+    struct wfs_dir_update updates[2];
+    int updateCount = (inodes[0] != inodes[1]) ? 2 : 1;
+    pthread_rwlock_rdlock(&fsLock);
+    dirBegin(&updates[0], srcParent);
+    if (updateCount == 2) {
+        dirBegin(&updates[1], dstParent);
+    }
+    ret = dirDrop(&updates[0], fromName);
+    if (ret == 0) {
+        struct wfs_dir_update *dst = &updates[updateCount - 1];
+        ret = (target != NULL) ? dirPoint(dst, toName, inodes[2]) : dirAdd(dst, toName, inodes[2]);
+    }
+    pthread_rwlock_unlock(&fsLock);
 
-    // Verify dir name
-    if (!valid(getFilename(newPath))) {
-        perror("Invalid directory name");
-        return -1;
+    // Append buckets of both directories, and a replaced target's tombstone, as one update
+    struct wfs_log_entry tombstone;
+    struct wfs_log_entry *logEntries[2 * DIR_UPDATE_BUCKETS + 1];
+    struct wfs_log_entry *newEntries[2 * DIR_UPDATE_BUCKETS + 1];
+    int entryCount = 0;
+    if (ret == 0) {
+        for (int i = 0; i < updateCount; i++) {
+            dirFinish(&updates[i]);
+            memcpy(logEntries + entryCount, updates[i].copies, updates[i].count * sizeof(struct wfs_log_entry *));
+            entryCount += updates[i].count;
+        }
+        if (target != NULL) {
+            buildTombstone(&tombstone, &target->inode);
+            logEntries[entryCount++] = &tombstone;
+        }
+        ret = appendLogEntries(logEntries, entryCount, newEntries, UPDATE_SEGMENTS);
     }
-    // Verify file doesn't already exist
-    if (!exists(newPath)) {
-        perror("Direct name already exists");
-        return -EEXIST;
+    if (ret == 0) {
+        // Publish rename
+        pthread_rwlock_wrlock(&fsLock);
+        publishBuckets(inodes[0], newEntries, updates[0].count);
+        if (updateCount == 2) {
+            publishBuckets(inodes[1], newEntries + updates[0].count, updates[1].count);
+        }
+        if (target != NULL) {
+            // Replaced target goes away like an unlinked file
+            removeInode(inodes[3], target);
+        }
+        // Paths below a moved directory changed too
+        dcachePut(newFrom, -1);
+        dcachePut(newTo, inodes[2]);
+        if (S_ISDIR(logEntry->inode.mode)) {
+            dcacheDropTree(newFrom);
+            dcacheDropTree(newTo);
+        }
+        pthread_rwlock_unlock(&fsLock);
     }
+    for (int i = 0; i < updateCount; i++) {
+        dirFree(&updates[i]);
+    }
+    unlockInodes(inodes, count);
 
-    // Create new inode
-    struct wfs_inode newInode;
-    inodeCounter += 1;
-    newInode.inode_number = inodeCounter;
-    newInode.deleted = 0;
-    newInode.mode = S_IFDIR;
-    newInode.uid = getuid();
-    newInode.gid = getgid();
-    newInode.flags = 0;
-    newInode.size = sizeof(struct wfs_inode);
-    newInode.atime = time(NULL);
-    newInode.mtime = time(NULL);
-    newInode.ctime = time(NULL);
-    newInode.links = 1;
+    return ret;
+}
 
-    // Create new dentry
-    struct wfs_dentry *newDentry = (struct wfs_dentry *)malloc(sizeof(struct wfs_dentry));
-    if (newDentry != NULL) {
-        strncpy(newDentry->name, getFilename(newPath), MAX_FILE_NAME_LEN - 1); // Copy name
-        newDentry->name[MAX_FILE_NAME_LEN - 1] = '\0'; // Null terminate
-        newDentry->inode_number = newInode.inode_number; // Point dentry at created inode
-    } else { // Memory allocation failed
-        free(newDentry);
-        perror("Memory allocation error");
-        exit(EXIT_FAILURE);
+// Start cleaner once FUSE is running, after it may have forked into the background
+static void *wfs_init(struct fuse_conn_info *conn) {
+    // Let FUSE splice file data from disk image into replies
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    checkpointTime = time(NULL); // First checkpoint is due one interval after mount
+    if (pthread_create(&cleanerThread, NULL, cleaner, NULL) != 0) {
+        perror("Error starting cleaner");
+    } else {
+        cleanerRunning = 1;
     }
-
-    // Get parent directory log entry
-    struct wfs_log_entry *oldEntry = getLogEntry(parsePathEnd(newPath), 0);
-    if (oldEntry == NULL) { // Log entry not found
-        perror("Log entry does not exist");
-        return -ENOENT;
+    if (syncMode == WFS_SYNC_GROUP) {
+        if (pthread_create(&syncThread, NULL, syncer, NULL) != 0) {
+            perror("Error starting group commit");
+        } else {
+            syncRunning = 1;
+        }
     }
+    return NULL;
+}
 
-    // Check if there is enough space to create directory
-    if ((totalSize + oldEntry->inode.size + sizeof(struct wfs_dentry) + sizeof(struct wfs_log_entry)) > MAX_SIZE) {
-        perror("Insufficient disk space");
-        return -ENOSPC;
+// Stop cleaner and write checkpoint at unmount
+static void wfs_destroy(void *privateData) {
+    (void)privateData;
+    if (cleanerRunning) {
+        pthread_mutex_lock(&cleanerLock);
+        cleanerStop = 1;
+        pthread_cond_signal(&cleanerCond);
+        pthread_mutex_unlock(&cleanerLock);
+        pthread_join(cleanerThread, NULL);
+        cleanerRunning = 0;
     }
 
-    // Copy old log entry and add created dentry to data field
-    struct wfs_log_entry *logEntryCopy = (struct wfs_log_entry *)malloc(oldEntry->inode.size + sizeof(struct wfs_dentry));
-    if (logEntryCopy != NULL) {
-        memcpy(logEntryCopy, oldEntry, oldEntry->inode.size); // Copy old log entry to new log entry
-        memcpy((char *)(logEntryCopy) + logEntryCopy->inode.size, newDentry, sizeof(struct wfs_dentry)); // Add dentry to log entry
-        logEntryCopy->inode.size += sizeof(struct wfs_dentry); // Update size
-        memcpy(head, logEntryCopy, logEntryCopy->inode.size); // Add log entry to log
-        totalSize += logEntryCopy->inode.size; // Update total size
-        head += logEntryCopy->inode.size; // Update head
-    } else { // Memory allocation failed
-        perror("Memory allocation error");
-        free(logEntryCopy);
-        exit(EXIT_FAILURE);
+    if (syncRunning) {
+        pthread_mutex_lock(&syncLock);
+        syncStop = 1;
+        pthread_cond_broadcast(&syncCond);
+        pthread_mutex_unlock(&syncLock);
+        pthread_join(syncThread, NULL);
+        syncRunning = 0;
     }
 
-    // Mark old log entry as deleted
-    oldEntry->inode.deleted = 1;
-
-    // Create a log entry for file
-    struct wfs_log_entry *newLogEntry = (struct wfs_log_entry *)malloc(sizeof(struct wfs_log_entry));
-    if (newLogEntry != NULL) {
-        newLogEntry->inode = newInode; // Point log entry at created inode
-        memcpy(head, newLogEntry, newLogEntry->inode.size); // Add log entry to log
-        totalSize += newLogEntry->inode.size; // Update total size
-        head += newLogEntry->inode.size; // Update head
-    } else { // Memory allocation failed
-        perror("Memory allocation error");
-        free(newLogEntry);
-        exit(EXIT_FAILURE);
+    // Let next mount skip replaying the log. It syncs the log, and the checkpoint itself follows unless nothing is synced
+    writeCheckpoint();
+    if ((syncMode != WFS_SYNC_NONE) && (fdatasync(diskFd) == -1)) {
+        perror("Error syncing disk image");
     }
-
-    return 0;
 }
 
-// Function to write data to file
-static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    // Remove mount point from path
-    const char *newPath = parsePath(path);
+// Timed handlers. Each counts its call, latency and bytes moved in opStats and hands off to the handler
+static int timed_getattr(const char *path, struct stat *stbuf) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_GETATTR, start, wfs_getattr(path, stbuf));
+}
 
-    // Get log entry
-    struct wfs_log_entry *logEntry = getLogEntry(newPath, 0);
-    if(logEntry == NULL) { // Log entry not founds
-        perror("Log entry does not exist");
-        return -ENOENT;
-    }
+static int timed_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_GETATTR, start, wfs_fgetattr(path, stbuf, fi));
+}
 
-    // Data size of log entry
-    int dataSize = logEntry->inode.size - sizeof(struct wfs_log_entry);
-    // Update last access time
-    logEntry->inode.atime = time(NULL);
+static int timed_open(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_OPEN, start, wfs_open(path, fi));
+}
 
-    // Check if offset is too big. Can't write past end of file
-    if ((logEntry->data + offset + size) >= (logEntry->data + dataSize)) {
-        // Calculate size of data to write
-        int diff = (logEntry->data + offset + size) - logEntry->data;
-        dataSize = diff;
-    }
-    // Check if write would exceed disk space
-    if ((totalSize + sizeof(struct wfs_log_entry) + dataSize) > MAX_SIZE){
-        perror("Insufficient disk space");
-        return -ENOSPC;
+static int timed_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = opStart();
+    int ret = wfs_read(path, buf, size, offset, fi);
+    if (ret > 0) {
+        __atomic_add_fetch(&readBytes, ret, __ATOMIC_RELAXED);
     }
+    return recordOp(WFS_OP_READ, start, ret);
+}
 
-    // Make copy of old log entry and write buffer to offset of data
-    struct wfs_log_entry *logEntryCopy = (struct wfs_log_entry *)malloc(sizeof(struct wfs_log_entry) + dataSize);
-    if (logEntryCopy == NULL) { // Memory allocation failed
-        perror("Memory allocation error");
-        free(logEntryCopy);
-        exit(EXIT_FAILURE);
-    } else {
-        memcpy(logEntryCopy, logEntry, logEntry->inode.size); // Copy old log entry to new log entry
-        logEntry->inode.deleted = 1; // Mark old log entry as deleted
-        memcpy(logEntryCopy->data + offset, buf, size); // Write buffer to offset of data
-        logEntryCopy->inode.mtime = time(NULL); // Update modify time
-        logEntryCopy->inode.ctime = time(NULL); // Update change time
-        logEntryCopy->inode.size += dataSize; // Update size
-        memcpy(head, logEntryCopy, logEntryCopy->inode.size); // Write log entry to head
-        totalSize += logEntryCopy->inode.size; // Update total size
-        head += logEntryCopy->inode.size; // Update head
+static int timed_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = opStart();
+    int ret = wfs_read_buf(path, bufp, size, offset, fi);
+    if (ret == 0) {
+        __atomic_add_fetch(&readBytes, fuse_buf_size(*bufp), __ATOMIC_RELAXED);
     }
+    return recordOp(WFS_OP_READ_BUF, start, ret);
+}
 
-    return size;
+static int timed_mknod(const char *path, mode_t mode, dev_t rdev) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_MKNOD, start, wfs_mknod(path, mode, rdev));
 }
 
-// Function to read directory entries
-static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    // Remove mount point from path
-    const char *newPath = parsePath(path);
+static int timed_mkdir(const char *path, mode_t mode) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_MKDIR, start, wfs_mkdir(path, mode));
+}
 
-    // Get log entry
-    struct wfs_log_entry *logEntry = getLogEntry(newPath, 0);
-    // Error Checking
-    if (logEntry == NULL) {
-        perror("Log entry does not exist");
-        return -ENOENT;
+static int timed_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = opStart();
+    int ret = wfs_write(path, buf, size, offset, fi);
+    if (ret > 0) {
+        __atomic_add_fetch(&writtenBytes, ret, __ATOMIC_RELAXED);
     }
+    return recordOp(WFS_OP_WRITE, start, ret);
+}
 
-    // Update last access time
-    logEntry->inode.atime = time(NULL);
-
-    // Start of data field
-    char *addr = logEntry->data + (offset * sizeof(struct wfs_dentry));
-    // Iterate over all dentry's
-    while (addr != (char *)(logEntry) + logEntry->inode.size) {
-        struct wfs_dentry *currPointer = (struct wfs_dentry *)addr; // Current dentry
-        int lenPath = strlen(newPath); // Length of path
-        int lenName = strlen(currPointer->name); // Length of name
-        int totalLength = lenPath + lenName;
-        char *newEntryPath = (char *)malloc(totalLength + 1); // Allocate memory for new string
-        if (newEntryPath == NULL) { // Memory allocation failed
-            perror("Memory allocation error");
-            free(newEntryPath);
-            return -1;
-        }
+static int timed_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = opStart();
+    int ret = wfs_write_buf(path, buf, offset, fi);
+    if (ret > 0) {
+        __atomic_add_fetch(&writtenBytes, ret, __ATOMIC_RELAXED);
+    }
+    return recordOp(WFS_OP_WRITE_BUF, start, ret);
+}
 
-        // Copy path and name into new string
-        strcpy(newEntryPath, newPath); // Copy path
-        strcpy(newEntryPath + lenPath, currPointer->name); // Copy name
-        // Get log entry for new path
-        struct wfs_log_entry *currLogEntry = getLogEntry(newEntryPath, 0);
-        if(currLogEntry == NULL) { // Log entry not found
-            perror("Log entry does not exist");
-            return -ENOENT;
-        }
+static int timed_flush(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_FLUSH, start, wfs_flush(path, fi));
+}
 
-        // create a struct stat for log entry
-        struct stat stbuf;
-        stbuf.st_uid = currLogEntry->inode.uid;
-        stbuf.st_gid = currLogEntry->inode.gid;
-        stbuf.st_atime = time(NULL);
-        stbuf.st_mtime = currLogEntry->inode.mtime;
-        stbuf.st_mode = currLogEntry->inode.mode;
-        stbuf.st_nlink = currLogEntry->inode.links;
-        stbuf.st_size = currLogEntry->inode.size;
-        offset += sizeof(struct wfs_dentry); // Update offset
-        // Add dentry to buffer
-        if (filler(buf, currPointer->name, &stbuf, offset) != 0) {
-            // Buffer full
-            return -1;
-        }
-        // Move to next dentry
-        addr += sizeof(struct wfs_dentry);
-    }
+static int timed_release(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_RELEASE, start, wfs_release(path, fi));
+}
 
-    return 0;
+static int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_FSYNC, start, wfs_fsync(path, datasync, fi));
 }
 
-// Function to remove a file
-static int wfs_unlink(const char *path) {
-    // Remove mount point from path
-    const char *newPath = parsePath(path);
+static int timed_opendir(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_OPENDIR, start, wfs_opendir(path, fi));
+}
 
-    // Get parent log entry
-    struct wfs_log_entry *parentLogEntry = getLogEntry(parsePathEnd(newPath), 0);
-    if (parentLogEntry == NULL) { // Log entry not found
-        perror("Log entry does not exist");
-        return -ENOENT;
-    }
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_READDIR, start, wfs_readdir(path, buf, filler, offset, fi));
+}
 
-    // Update parent log entry access time
-    parentLogEntry->inode.atime = time(NULL);
+static int timed_releasedir(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_RELEASEDIR, start, wfs_releasedir(path, fi));
+}
 
-    // Get log entry for file
-    struct wfs_log_entry *logEntry = getLogEntry(newPath, 0);
-    if (logEntry == NULL) { // Log entry not found
-        perror("Log entry does not exist");
-        return -ENOENT;
-    }
-    logEntry->inode.deleted = 1; // Mark as deleted
-    logEntry->inode.ctime = time(NULL); // Update last change time
-    logEntry->inode.atime = time(NULL); // Update last access time
-    logEntry->inode.links -= 1; // Decrement links
-
-    // Make a copy of parent log entry and remove target file's dentry
-    struct wfs_log_entry *logEntryCopy = (struct wfs_log_entry *)malloc(parentLogEntry->inode.size - sizeof(struct wfs_dentry));
-    if (logEntryCopy != NULL) {
-        // Find target file's dentry
-        char *addr = parentLogEntry->data;
-        // Iterate over all dentry's
-        while (addr != (char *)(parentLogEntry) + parentLogEntry->inode.size) {
-            // If dentry matches target file
-            if (((struct wfs_dentry *)addr)->inode_number == logEntry->inode.inode_number) {
-                break; // Found dentry
-            }
-            addr += sizeof(struct wfs_dentry); // Move to next dentry
-        }
-
-        // Copy parent log entry to new log entry
-        memcpy(logEntryCopy, parentLogEntry, addr - (char *)(parentLogEntry));
-
-        // If target file's dentry is not the last dentry in parent's data field
-        if (addr != ((char *)(parentLogEntry) + parentLogEntry->inode.size - sizeof(struct wfs_dentry))) {
-            // Address of remaining data in parent
-            char *dataAddr = (char *)(logEntryCopy) + (addr - (char *)(parentLogEntry));
-            // Address of parent's data field
-            char *parentAddr = addr + sizeof(struct wfs_dentry);
-            // Remaining size of parent's data field
-            int parentSize = (char *)(parentLogEntry) + parentLogEntry->inode.size - parentAddr;
-            // Copy remaining data into new log entry
-            memcpy(dataAddr, parentAddr, parentSize);
-        }
-
-        parentLogEntry->inode.deleted = 1; // Mark as deleted
-        logEntryCopy->inode.size -= sizeof(struct wfs_dentry); // Update size
-        memcpy(head, logEntryCopy, logEntryCopy->inode.size); // Write log entry to log
-        totalSize += logEntryCopy->inode.size; // Update total size
-        head += logEntryCopy->inode.size; // Update head
-    } else { // Memory allocation failed
-        perror("Memory allocation error");
-        free(logEntryCopy);
-        exit(EXIT_FAILURE);
-    }
+static int timed_unlink(const char *path) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_UNLINK, start, wfs_unlink(path));
+}
 
-    return 0;
+static int timed_rename(const char *from, const char *to) {
+    uint64_t start = opStart();
+    return recordOp(WFS_OP_RENAME, start, wfs_rename(from, to));
 }
 
 static struct fuse_operations wfs_ops = {
-    .getattr = wfs_getattr,
-    .read = wfs_read,
-    .mknod = wfs_mknod,
-    .mkdir = wfs_mkdir,
-    .write = wfs_write,
-    .readdir = wfs_readdir,
-    .unlink = wfs_unlink,
+    .init = wfs_init,
+    .destroy = wfs_destroy,
+    .getattr = timed_getattr,
+    .fgetattr = timed_fgetattr,
+    .open = timed_open,
+    .read = timed_read,
+    .read_buf = timed_read_buf,
+    .mknod = timed_mknod,
+    .mkdir = timed_mkdir,
+    .write = timed_write,
+    .write_buf = timed_write_buf,
+    .flush = timed_flush,
+    .release = timed_release,
+    .fsync = timed_fsync,
+    .opendir = timed_opendir,
+    .readdir = timed_readdir,
+    .releasedir = timed_releasedir,
+    .unlink = timed_unlink,
+    .rename = timed_rename,
+    // Handlers given an open handle find their file by inode number, so FUSE needn't build its path
+    .flag_nullpath_ok = 1,
+    .flag_nopath = 1,
 };
 
 int main(int argc, char *argv[]) {
+    wfs_crc_init();
+
+    // Parse and remove cleaner, compression, deduplication, storage, cache and sync options
+    int compressOption = -1; // -1 if superblock decides
+    int dedupOption = -1;
+    int storageOption = 0; // -1 if storage option names no engine
+    int syncOption = 0; // -1 if sync option names no policy
+    int newArgc = 0;
+    storage = &mmapStorage;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--compress") == 0) {
+            compressOption = 1;
+        } else if (strcmp(argv[i], "--no-compress") == 0) {
+            compressOption = 0;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            dedupOption = 1;
+        } else if (strcmp(argv[i], "--no-dedup") == 0) {
+            dedupOption = 0;
+        } else if (strncmp(argv[i], "--cleaner-threshold=", strlen("--cleaner-threshold=")) == 0) {
+            cleanerThreshold = atoi(argv[i] + strlen("--cleaner-threshold="));
+        } else if (strncmp(argv[i], "--cleaner-rate=", strlen("--cleaner-rate=")) == 0) {
+            cleanerRate = atoi(argv[i] + strlen("--cleaner-rate="));
+        } else if (strcmp(argv[i], "--storage=mmap") == 0) {
+            storage = &mmapStorage;
+        } else if (strcmp(argv[i], "--storage=pwrite") == 0) {
+            storage = &pwriteStorage;
+        } else if (strncmp(argv[i], "--storage=", strlen("--storage=")) == 0) {
+            storageOption = -1;
+        } else if (strncmp(argv[i], "--cache-size=", strlen("--cache-size=")) == 0) {
+            cacheSize = strtoull(argv[i] + strlen("--cache-size="), NULL, 10);
+        } else if (strcmp(argv[i], "--sync=none") == 0) {
+            syncMode = WFS_SYNC_NONE;
+        } else if (strcmp(argv[i], "--sync=group") == 0) {
+            syncMode = WFS_SYNC_GROUP;
+        } else if (strcmp(argv[i], "--sync=strict") == 0) {
+            syncMode = WFS_SYNC_STRICT;
+        } else if (strncmp(argv[i], "--sync=", strlen("--sync=")) == 0) {
+            syncOption = -1;
+        } else {
+            argv[newArgc++] = argv[i];
+        }
+    }
+    argc = newArgc;
+    argv[argc] = NULL;
+
     // Error Checking
     if (argc < 4) {
-        fprintf(stderr, "Usage: %s [<FUSE options>] <diskPath> <mountPoint>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [<FUSE options>] [--cleaner-threshold=<percent>] [--cleaner-rate=<bytes per second>] [--compress | --no-compress] [--dedup | --no-dedup] [--storage=mmap | --storage=pwrite] [--cache-size=<bytes>] [--sync=none | --sync=group | --sync=strict] <diskPath> <mountPoint>\n", argv[0]);
+        return 1;
+    }
+    if ((cleanerThreshold < 0) || (cleanerThreshold > 100) || (cleanerRate < 0)) {
+        fprintf(stderr, "Cleaner threshold must be 0-100 and rate must not be negative\n");
+        return 1;
+    }
+    if (storageOption < 0) {
+        fprintf(stderr, "Storage engine must be mmap or pwrite\n");
+        return 1;
+    }
+    if (syncOption < 0) {
+        fprintf(stderr, "Sync policy must be none, group or strict\n");
         return 1;
     }
 
@@ -640,46 +4303,180 @@ int main(int argc, char *argv[]) {
     mnt = argv[argc - 1];
 
     // Open disk image file
-    int fd = open(disk, O_RDWR, 0666); // Open with read/write permissions
-    if (fd == -1) { // Error opening file
+    diskFd = open(disk, O_RDWR, 0666); // Open with read/write permissions
+    if (diskFd == -1) { // Error opening file
         perror("Error opening file");
         exit(EXIT_FAILURE);
     }
 
     // Get file info
     struct stat fileStat = {0};
-    if (fstat(fd, &fileStat) == -1) {
+    if (fstat(diskFd, &fileStat) == -1) {
         perror("Error getting file info");
-        close(fd);
+        close(diskFd);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t fileSize = fileStat.st_size;
+
+    // Read superblock to learn how big the image may grow
+    struct wfs_sb sb;
+    if (pread(diskFd, &sb, sizeof(struct wfs_sb), 0) != sizeof(struct wfs_sb)) {
+        perror("Error reading superblock");
+        close(diskFd);
+        exit(EXIT_FAILURE);
+    }
+    if (sb.magic != WFS_MAGIC) {
+        perror("Invalid magic number");
+        close(diskFd);
+        exit(EXIT_FAILURE);
+    }
+    if (sb.version != WFS_VERSION) {
+        fprintf(stderr, "Unsupported disk format version %u\n", sb.version);
+        close(diskFd);
+        exit(EXIT_FAILURE);
+    }
+    // Segments must fit in disk image, and checkpoint regions before them
+    uint64_t maxSize = sb.segments + (uint64_t)sb.segment_max * sb.segment_size;
+    if ((sb.segment_size < sizeof(struct wfs_log_entry) + sizeof(struct wfs_dir)) || (sb.segment_count > sb.segment_max) || (sb.segments + (uint64_t)sb.segment_count * sb.segment_size > fileSize)
+        || (sb.checkpoint_size < sizeof(struct wfs_checkpoint)) || (sb.checkpoints < sizeof(struct wfs_sb)) || (sb.checkpoints + 2 * (uint64_t)sb.checkpoint_size > sb.segments)) {
+        fprintf(stderr, "Invalid segment layout\n");
+        close(diskFd);
+        exit(EXIT_FAILURE);
+    }
+    // Compress file data if filesystem was made that way, unless overridden
+    compressData = (compressOption >= 0) ? compressOption : ((sb.flags & WFS_SB_COMPRESS) != 0);
+    // Likewise share identical chunks of file data, if a chunk fits in a segment
+    dedupData = (dedupOption >= 0) ? dedupOption : ((sb.flags & WFS_SB_DEDUP) != 0);
+    if (dedupData && (sb.segment_size < WFS_SHARED_ENTRY_SIZE(1) + WFS_EXTENT_ENTRY_SIZE(CHUNK_SIZE))) {
+        fprintf(stderr, "Segments are too small to deduplicate file data\n");
+        dedupData = 0;
+    }
+
+    // The pwrite engine maps segments one at a time, at their offset in the image file
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    if (!storage->whole && ((sb.segments % pageSize != 0) || (sb.segment_size % pageSize != 0))) {
+        fprintf(stderr, "Segments must be page aligned for the pwrite engine\n");
+        close(diskFd);
         exit(EXIT_FAILURE);
     }
-    int fileSize = fileStat.st_size;
 
-    // Map file to memory
-    tail = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // Reserve address space for the largest image, so growing it never moves the mapping
+    tail = mmap(NULL, (maxSize > fileSize) ? maxSize : fileSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
     if (tail == MAP_FAILED) {
+        perror("Error reserving address space");
+        close(diskFd);
+        exit(EXIT_FAILURE);
+    }
+    // Map file to memory. The pwrite engine maps only superblock, segment usage table and checkpoints up front, and
+    // segments when cacheGet asks for them, keeping about cacheSize bytes of them mapped
+    if (!storage->whole) {
+        cacheSlots = (cacheSize / sb.segment_size < sb.segment_max) ? cacheSize / sb.segment_size : sb.segment_max;
+        if (cacheSlots < CACHE_MIN_SEGMENTS) {
+            cacheSlots = CACHE_MIN_SEGMENTS;
+        }
+    }
+    if (mmap(tail, storage->whole ? fileSize : sb.segments, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, diskFd, 0) == MAP_FAILED) {
         perror("Error mapping file");
-        close(fd);
+        close(diskFd);
         exit(EXIT_FAILURE);
     }
     // Get superblock
     superblock = (struct wfs_sb *)tail;
-    if (superblock->magic != WFS_MAGIC) {
-        perror("Invalid magic number");
-        close(fd);
+
+    // Image file may have been extended since last mount. Its new segments start out free
+    uint64_t fileSegments = (fileSize - superblock->segments) / superblock->segment_size;
+    superblock->segment_count = (fileSegments < superblock->segment_max) ? fileSegments : superblock->segment_max;
+    diskSize = segmentOffset(superblock->segment_count);
+    // Allocate blocks of a sparse image, so its segments can't run out of space once mapped
+    int err = posix_fallocate(diskFd, 0, diskSize);
+    if (err != 0) {
+        errno = err;
+        perror("Error allocating disk image");
+        close(diskFd);
         exit(EXIT_FAILURE);
     }
 
-    // Set head to end of superblock
+    // Segments the pwrite engine has mapped, and threads holding each. Held segments go when their thread does
+    if (!storage->whole) {
+        cacheRing = (uint32_t *)calloc(superblock->segment_max, sizeof(uint32_t));
+        cacheRefs = (uint32_t *)calloc(superblock->segment_max, sizeof(uint32_t));
+        cacheMapped = (char *)calloc(superblock->segment_max, sizeof(char));
+        if ((cacheRing == NULL) || (cacheRefs == NULL) || (cacheMapped == NULL)) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (pthread_key_create(&cacheKey, freeHeld) != 0) {
+        perror("Error creating thread keys");
+        exit(EXIT_FAILURE);
+    }
+
+    // Set head to end of log
     head = tail + superblock->head;
+    // Index latest log entry of every inode
+    chunkBuckets = (uint32_t *)calloc(CHUNK_BUCKETS, sizeof(uint32_t));
+    if (chunkBuckets == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    buildInodeMap();
+    // Log committed before mount counts as synced, once it is on disk. Tickets of its segments stay at or below 0
+    segmentPins = (uint32_t *)calloc(superblock->segment_max, sizeof(uint32_t));
+    segmentTickets = (int64_t *)malloc(superblock->segment_max * sizeof(int64_t));
+    if ((segmentPins == NULL) || (segmentTickets == NULL)) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < superblock->segment_max; i++) {
+        segmentTickets[i] = -(int64_t)superblock->segment_size;
+    }
+    segmentTickets[headSegment] = -(int64_t)headUsed;
+    // Replay may have truncated or repaired the log, and nothing counts as synced until that is on disk
+    if (fdatasync(diskFd) == -1) {
+        perror("Error syncing disk image");
+        close(diskFd);
+        exit(EXIT_FAILURE);
+    }
+    // Scratch space and pins of a thread go when the thread does
+    if ((pthread_key_create(&stageKey, free) != 0) || (pthread_key_create(&writeStageKey, free) != 0) || (pthread_key_create(&pinKey, freePins) != 0)) {
+        perror("Error creating thread keys");
+        exit(EXIT_FAILURE);
+    }
+    // Initialize inode locks
+    for (int i = 0; i < INODE_LOCK_COUNT; i++) {
+        pthread_mutex_init(&inodeLocks[i], NULL);
+    }
+    for (int i = 0; i < DCACHE_LOCK_COUNT; i++) {
+        pthread_mutex_init(&dcacheLocks[i], NULL);
+    }
+    for (int i = 0; i < ZCACHE_SIZE; i++) {
+        pthread_mutex_init(&zcacheLocks[i], NULL);
+    }
+    // Allocate empty dentry cache
+    dcache = (struct wfs_dcache_entry *)calloc(DCACHE_SIZE, sizeof(struct wfs_dcache_entry));
+    zcache = (struct wfs_zcache_entry *)calloc(ZCACHE_SIZE, sizeof(struct wfs_zcache_entry));
+    opStats = (struct wfs_op_stats *)calloc(WFS_OP_COUNT, sizeof(struct wfs_op_stats));
+    if ((dcache == NULL) || (zcache == NULL) || (opStats == NULL)) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
 
     // Parse FUSE arguments
     argv[argc-2] = argv[argc-1];
     argv[argc-1] = NULL;
     argc--;
 
-    fuse_main(argc, argv, &wfs_ops, NULL);
-    munmap(tail, fileStat.st_size);
+    // Kernel caches lookups and attributes. Every change goes through it, so it drops what a change makes stale
+    // without being told. Options given on the command line come later and win
+    char *fuseArgv[argc + 3];
+    fuseArgv[0] = argv[0];
+    fuseArgv[1] = "-o";
+    fuseArgv[2] = FUSE_OPTIONS;
+    memcpy(fuseArgv + 3, argv + 1, argc * sizeof(char *)); // Includes terminating NULL
+
+    fuse_main(argc + 2, fuseArgv, &wfs_ops, NULL);
+    munmap(tail, (maxSize > fileSize) ? maxSize : fileSize);
+    close(diskFd);
 
     return 0;
 }
\ No newline at end of file
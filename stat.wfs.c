@@ -0,0 +1,443 @@
+#include "wfs.h"
+
+#define STAT_BUCKETS 33 // Power-of-two histogram buckets. Bucket i counts values of at most 2^i
+#define STAT_KINDS 6 // Kinds of log entry in size histogram
+
+// What stat.wfs learns about one inode number from the log
+struct wfs_inode_stats {
+    uint64_t latest;            // disk offset of latest log entry, 0 if none seen
+    uint64_t records;           // number of log entries
+    uint64_t bytes;             // bytes of log entries
+    uint64_t live;              // bytes of log entries that survive compaction
+    uint64_t data;              // file bytes written by extents, uncompressed
+    uint64_t rewrites;          // extents that write the whole file
+    uint64_t file_size;         // size of file as of latest log entry, or bytes of current buckets of directory
+    uint64_t *buckets;          // disk offset of latest log entry of each bucket of directory, 0 if none seen
+    uint32_t bucket_slots;      // number of slots in buckets
+    uint32_t mode;
+    uint32_t parent;            // inode number of directory listing it
+    const char *name;           // name in that directory, NULL if no directory lists it
+};
+
+struct wfs_inode_stats *inodeStats; // What the log says about each inode number
+int inodeStatsSize; // Number of slots in inodeStats
+const char *kindNames[STAT_KINDS] = { "directory", "file", "extent", "compressed", "shared", "chunk" };
+
+// Get stats of inode number, growing array as needed
+struct wfs_inode_stats *statsOf(int inodeNum) {
+    if (inodeNum >= inodeStatsSize) {
+        int newSize = (inodeStatsSize == 0) ? MAX_INODES : inodeStatsSize;
+        while (newSize <= inodeNum) {
+            newSize *= 2;
+        }
+        struct wfs_inode_stats *newStats = (struct wfs_inode_stats *)realloc(inodeStats, newSize * sizeof(struct wfs_inode_stats));
+        if (newStats == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        memset(newStats + inodeStatsSize, 0, (newSize - inodeStatsSize) * sizeof(struct wfs_inode_stats));
+        inodeStats = newStats;
+        inodeStatsSize = newSize;
+    }
+    return &inodeStats[inodeNum];
+}
+
+// Get slot of directory bucket in stats, growing array as needed
+uint64_t *bucketSlotOf(struct wfs_inode_stats *stats, uint32_t bucket) {
+    if (bucket >= stats->bucket_slots) {
+        uint32_t newSlots = (stats->bucket_slots == 0) ? 1 : stats->bucket_slots;
+        while (newSlots <= bucket) {
+            newSlots *= 2;
+        }
+        uint64_t *newBuckets = (uint64_t *)realloc(stats->buckets, newSlots * sizeof(uint64_t));
+        if (newBuckets == NULL) { // Memory allocation failed
+            perror("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        memset(newBuckets + stats->bucket_slots, 0, (newSlots - stats->bucket_slots) * sizeof(uint64_t));
+        stats->buckets = newBuckets;
+        stats->bucket_slots = newSlots;
+    }
+    return &stats->buckets[bucket];
+}
+
+// Histogram bucket of value: smallest i with value <= 2^i
+int bucketOf(uint64_t value) {
+    int bucket = (value <= 1) ? 0 : 64 - __builtin_clzll(value - 1);
+    return (bucket < STAT_BUCKETS) ? bucket : STAT_BUCKETS - 1;
+}
+
+// Kind of log entry, indexing kindNames
+int kindOf(struct wfs_log_entry *logEntry) {
+    if (logEntry->inode.flags & WFS_LOG_CHUNK) {
+        return 5;
+    }
+    if (logEntry->inode.mode & S_IFDIR) {
+        return 0;
+    }
+    if (logEntry->inode.flags & WFS_LOG_SHARED) {
+        return 4;
+    }
+    if (logEntry->inode.flags & WFS_LOG_COMPRESSED) {
+        return 3;
+    }
+    return (logEntry->inode.flags & WFS_LOG_EXTENT) ? 2 : 1;
+}
+
+// Percentage of part in whole
+double percent(uint64_t part, uint64_t whole) {
+    return (whole == 0) ? 0 : 100.0 * part / whole;
+}
+
+// Print path of inode number by following the directories that list it
+void printPath(int inodeNum, int depth) {
+    struct wfs_inode_stats *stats = &inodeStats[inodeNum];
+    if (inodeNum == 0) {
+        printf("/");
+        return;
+    }
+    if ((stats->name == NULL) || (depth > MAX_PATH_LENGTH)) { // Unlinked, or not reachable from root
+        printf("(unlinked)");
+        return;
+    }
+    if (stats->parent != 0) {
+        printPath(stats->parent, depth + 1);
+    }
+    printf("/%s", stats->name);
+}
+
+// Inode numbers ordered by superseded bytes, most first
+int compareSuperseded(const void *a, const void *b) {
+    struct wfs_inode_stats *x = &inodeStats[*(const int *)a];
+    struct wfs_inode_stats *y = &inodeStats[*(const int *)b];
+    uint64_t xDead = x->bytes - x->live;
+    uint64_t yDead = y->bytes - y->live;
+    return (xDead < yDead) - (xDead > yDead);
+}
+
+int main(int argc, char *argv[]) {
+    wfs_crc_init();
+
+    // Parse options
+    int verbose = 0; // 1 to print every segment
+    int top = 20; // Number of inodes to print, 0 for all
+    int opt;
+    while ((opt = getopt(argc, argv, "vn:")) != -1) {
+        if (opt == 'v') {
+            verbose = 1;
+        } else if (opt == 'n') {
+            top = atoi(optarg);
+        } else {
+            optind = argc + 1; // Print usage
+            break;
+        }
+    }
+    if ((optind != argc - 1) || (top < 0)) {
+        fprintf(stderr, "Usage: %s [-v] [-n <inodeCount>] <diskPath>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Parse disk image file path
+    disk = argv[optind];
+
+    // Open disk image file. Nothing is written to it
+    int fd = open(disk, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening file");
+        exit(EXIT_FAILURE);
+    }
+
+    // Get file info
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == -1) {
+        perror("Error getting file info");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t fileSize = fileStat.st_size;
+
+    // Map file to memory
+    tail = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (tail == MAP_FAILED) {
+        perror("Error mapping file");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    madvise(tail, fileSize, MADV_SEQUENTIAL); // Log is read front to back
+    // Get superblock
+    superblock = (struct wfs_sb *)tail;
+    if ((fileSize < sizeof(struct wfs_sb)) || (superblock->magic != WFS_MAGIC)) {
+        fprintf(stderr, "Invalid magic number\n");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    if (superblock->version != WFS_VERSION) {
+        fprintf(stderr, "Unsupported disk format version %u\n", superblock->version);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    if ((superblock->segments + (uint64_t)superblock->segment_count * superblock->segment_size > fileSize) || (superblock->head <= superblock->segments)) {
+        fprintf(stderr, "Invalid segment layout\n");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    // Head segment holds the last committed byte
+    struct wfs_segment_usage *segmentUsage = (struct wfs_segment_usage *)(tail + sizeof(struct wfs_sb));
+    uint32_t headSegment = (superblock->head - 1 - superblock->segments) / superblock->segment_size;
+    uint32_t headSeq = segmentUsage[headSegment].seq;
+
+    // Sort segments by sequence number, like mount does. Segments filled after head segment never got a committed log entry
+    uint32_t *segments = (uint32_t *)malloc(superblock->segment_count * sizeof(uint32_t));
+    uint64_t *written = (uint64_t *)calloc(superblock->segment_count, sizeof(uint64_t));
+    uint64_t *live = (uint64_t *)calloc(superblock->segment_count, sizeof(uint64_t));
+    if ((segments == NULL) || (written == NULL) || (live == NULL)) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < superblock->segment_count; i++) {
+        if ((segmentUsage[i].seq == 0) || (segmentUsage[i].seq > headSeq)) {
+            continue;
+        }
+        uint32_t pos = count++;
+        while ((pos > 0) && (segmentUsage[segments[pos - 1]].seq > segmentUsage[i].seq)) {
+            segments[pos] = segments[pos - 1];
+            pos--;
+        }
+        segments[pos] = i;
+    }
+
+    // Single pass over the log in order. A log entry is live unless it is marked deleted or is a tombstone, which fsck
+    // drops. A directory bucket is also superseded by the next log entry of the same bucket, and all of them by the
+    // directory's tombstone
+    uint64_t sizes[STAT_BUCKETS][STAT_KINDS] = {{0}}; // Log entries by size and kind
+    uint64_t records = 0;
+    uint64_t chunkRecords = 0;
+    uint64_t chunkBytes = 0;
+    uint64_t chunkLive = 0;
+    uint64_t torn = 0; // Disk offset where log is torn, 0 if intact
+    for (uint32_t i = 0; (i < count) && (torn == 0); i++) {
+        uint32_t segment = segments[i];
+        uint64_t start = superblock->segments + (uint64_t)segment * superblock->segment_size;
+        uint64_t end = start + ((segment == headSegment) ? superblock->head - start : segmentUsage[segment].written);
+        uint64_t curr = start;
+        while (curr < end) {
+            uint64_t updateSize = wfs_verify_update(tail + curr, end - curr);
+            if (updateSize == 0) { // Torn or corrupt. Log ends here
+                torn = curr;
+                break;
+            }
+            for (uint64_t updateEnd = curr + updateSize; curr < updateEnd; curr += ((struct wfs_log_entry *)(tail + curr))->inode.size) {
+                struct wfs_log_entry *logEntry = (struct wfs_log_entry *)(tail + curr);
+                uint32_t size = logEntry->inode.size;
+                int isLive = (logEntry->inode.deleted == 0) && !(logEntry->inode.flags & WFS_LOG_REMOVED);
+                records++;
+                written[segment] += size;
+                sizes[bucketOf(size)][kindOf(logEntry)]++;
+
+                // Chunk numbers aren't inode numbers
+                if (logEntry->inode.flags & WFS_LOG_CHUNK) {
+                    chunkRecords++;
+                    chunkBytes += size;
+                    if (isLive) {
+                        chunkLive += size;
+                        live[segment] += size;
+                    }
+                    continue;
+                }
+
+                struct wfs_inode_stats *stats = statsOf(logEntry->inode.inode_number);
+                if (!(logEntry->inode.mode & S_IFREG)) {
+                    // Previous log entry of the bucket, or of every bucket for a tombstone, is superseded unless it
+                    // was already dead
+                    int removed = (logEntry->inode.flags & WFS_LOG_REMOVED) != 0;
+                    uint32_t first = removed ? 0 : ((struct wfs_dir *)logEntry->data)->bucket;
+                    uint32_t last = removed ? stats->bucket_slots : first + 1;
+                    for (uint32_t b = first; b < last; b++) {
+                        uint64_t *slot = bucketSlotOf(stats, b);
+                        struct wfs_log_entry *prevEntry = (struct wfs_log_entry *)(tail + *slot);
+                        if ((*slot != 0) && (prevEntry->inode.deleted == 0)) {
+                            stats->live -= prevEntry->inode.size;
+                            live[(*slot - superblock->segments) / superblock->segment_size] -= prevEntry->inode.size;
+                        }
+                        *slot = removed ? 0 : curr;
+                    }
+                }
+                stats->records++;
+                stats->bytes += size;
+                stats->latest = curr;
+                stats->mode = logEntry->inode.mode;
+                if (isLive) {
+                    stats->live += size;
+                    live[segment] += size;
+                }
+
+                // File size and bytes written by file log entries
+                if (logEntry->inode.mode & S_IFREG) {
+                    stats->file_size = wfs_file_size(logEntry);
+                    uint64_t length = stats->file_size;
+                    uint64_t offset = 0;
+                    if (logEntry->inode.flags & WFS_LOG_EXTENT) {
+                        struct wfs_extent *extent = (struct wfs_extent *)logEntry->data;
+                        length = extent->length;
+                        offset = extent->offset;
+                    }
+                    stats->data += length;
+                    if ((offset == 0) && (length > 0) && (length == stats->file_size)) {
+                        stats->rewrites++;
+                    }
+                }
+            }
+        }
+    }
+
+    // Current buckets of each directory name its children. Its latest log entry says how many buckets it has
+    uint64_t dirSizes[STAT_BUCKETS] = {0}; // Directories by number of dentries
+    uint64_t dirs = 0;
+    for (int i = 0; i < inodeStatsSize; i++) {
+        struct wfs_inode_stats *stats = &inodeStats[i];
+        if ((stats->latest == 0) || !(stats->mode & S_IFDIR)) {
+            continue;
+        }
+        struct wfs_log_entry *logEntry = (struct wfs_log_entry *)(tail + stats->latest);
+        if ((logEntry->inode.deleted == 1) || (logEntry->inode.flags & WFS_LOG_REMOVED)) { // Removed directory
+            continue;
+        }
+        uint32_t buckets = ((struct wfs_dir *)logEntry->data)->buckets;
+        dirs++;
+        dirSizes[bucketOf(((struct wfs_dir *)logEntry->data)->entries)]++;
+        stats->file_size = 0;
+        for (uint32_t b = 0; (b < buckets) && (b < stats->bucket_slots); b++) {
+            if (stats->buckets[b] == 0) { // Bucket lost to torn log
+                continue;
+            }
+            struct wfs_log_entry *bucketEntry = (struct wfs_log_entry *)(tail + stats->buckets[b]);
+            struct wfs_dir *dir = (struct wfs_dir *)bucketEntry->data;
+            stats->file_size += bucketEntry->inode.size;
+            for (uint32_t pos = 0; pos < dir->count; pos++) {
+                struct wfs_dentry *dentry = wfs_dir_entry(dir, pos);
+                if ((int)dentry->inode_number < inodeStatsSize) {
+                    inodeStats[dentry->inode_number].parent = i;
+                    inodeStats[dentry->inode_number].name = dentry->name;
+                }
+            }
+        }
+    }
+
+    // Totals over all inodes
+    uint64_t bytes = chunkBytes;
+    uint64_t liveBytes = chunkLive;
+    uint64_t fileBytes = 0; // Bytes of file log entries
+    uint64_t fileData = 0; // File bytes they wrote
+    uint64_t fileSizes = 0; // Size of files still listed
+    uint64_t rewrites = 0; // Whole-file writes after the first
+    int inodes = 0;
+    int *order = (int *)malloc((inodeStatsSize + 1) * sizeof(int));
+    if (order == NULL) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < inodeStatsSize; i++) {
+        struct wfs_inode_stats *stats = &inodeStats[i];
+        if (stats->records == 0) {
+            continue;
+        }
+        order[inodes++] = i;
+        bytes += stats->bytes;
+        liveBytes += stats->live;
+        if (stats->mode & S_IFREG) {
+            fileBytes += stats->bytes;
+            fileData += stats->data;
+            fileSizes += (stats->name != NULL) ? stats->file_size : 0;
+            rewrites += (stats->rewrites > 1) ? stats->rewrites - 1 : 0;
+        }
+    }
+
+    // Whole image
+    printf("Image: %u of %u segments of %u bytes in use, log head at %lu\n", count, superblock->segment_count, superblock->segment_size, (unsigned long)superblock->head);
+    if (torn != 0) {
+        printf("Log is torn at %lu. Log entries after it are ignored\n", (unsigned long)torn);
+    }
+    printf("Log: %lu bytes in %lu log entries, %lu live (%.1f%%), %lu superseded (%.1f%%)\n", (unsigned long)bytes, (unsigned long)records,
+           (unsigned long)liveBytes, percent(liveBytes, bytes), (unsigned long)(bytes - liveBytes), percent(bytes - liveBytes, bytes));
+    printf("Space amplification: %.2f (log bytes per live byte)\n", (liveBytes == 0) ? 0 : (double)bytes / liveBytes);
+    printf("Chunks: %lu log entries, %lu bytes, %lu live\n", (unsigned long)chunkRecords, (unsigned long)chunkBytes, (unsigned long)chunkLive);
+    printf("Write amplification: %.2f (file log bytes per byte of file), %.2f (file bytes written per byte of file), %lu whole-file rewrites\n",
+           (fileSizes == 0) ? 0 : (double)fileBytes / fileSizes, (fileSizes == 0) ? 0 : (double)fileData / fileSizes, (unsigned long)rewrites);
+
+    // Segments, by how much of them is live. Cleaner and fsck gain most from the emptiest ones
+    uint64_t liveDeciles[11] = {0};
+    for (uint32_t i = 0; i < count; i++) {
+        liveDeciles[(int)(percent(live[segments[i]], written[segments[i]]) / 10)]++;
+    }
+    printf("\nSegments by live bytes:\n");
+    for (int i = 0; i < 10; i++) {
+        printf("  %3d-%3d%%  %lu\n", i * 10, (i + 1) * 10, (unsigned long)(liveDeciles[i] + ((i == 9) ? liveDeciles[10] : 0)));
+    }
+    if (verbose) {
+        printf("\n  %8s %8s %10s %10s %10s %6s %10s\n", "segment", "seq", "written", "live", "superseded", "live%", "table live");
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t segment = segments[i];
+            printf("  %8u %8u %10lu %10lu %10lu %5.1f%% %10u\n", segment, segmentUsage[segment].seq, (unsigned long)written[segment], (unsigned long)live[segment],
+                   (unsigned long)(written[segment] - live[segment]), percent(live[segment], written[segment]), segmentUsage[segment].live);
+        }
+    }
+
+    // Log entry sizes by kind
+    printf("\nLog entries by size:\n  %10s", "bytes <=");
+    for (int k = 0; k < STAT_KINDS; k++) {
+        printf(" %10s", kindNames[k]);
+    }
+    printf("\n");
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        uint64_t row = 0;
+        for (int k = 0; k < STAT_KINDS; k++) {
+            row += sizes[i][k];
+        }
+        if (row == 0) {
+            continue;
+        }
+        printf("  %10lu", 1UL << i);
+        for (int k = 0; k < STAT_KINDS; k++) {
+            printf(" %10lu", (unsigned long)sizes[i][k]);
+        }
+        printf("\n");
+    }
+
+    // Directory sizes
+    printf("\nDirectories by dentries (%lu directories):\n", (unsigned long)dirs);
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        if (dirSizes[i] != 0) {
+            printf("  <= %-10lu %lu\n", 1UL << i, (unsigned long)dirSizes[i]);
+        }
+    }
+
+    // Inodes with most superseded bytes first
+    qsort(order, inodes, sizeof(int), compareSuperseded);
+    int shown = ((top == 0) || (top > inodes)) ? inodes : top;
+    printf("\nInodes by superseded bytes (%d of %d):\n", shown, inodes);
+    printf("  %8s %4s %8s %10s %10s %10s %10s %6s %8s  %s\n", "inode", "type", "entries", "bytes", "live", "superseded", "size", "amp", "rewrites", "path");
+    for (int i = 0; i < shown; i++) {
+        struct wfs_inode_stats *stats = &inodeStats[order[i]];
+        printf("  %8d %4s %8lu %10lu %10lu %10lu %10lu %6.2f %8lu  ", order[i], (stats->mode & S_IFDIR) ? "dir" : "file", (unsigned long)stats->records,
+               (unsigned long)stats->bytes, (unsigned long)stats->live, (unsigned long)(stats->bytes - stats->live), (unsigned long)stats->file_size,
+               (stats->file_size == 0) ? 0 : (double)stats->bytes / stats->file_size, (unsigned long)((stats->rewrites > 1) ? stats->rewrites - 1 : 0));
+        printPath(order[i], 0);
+        printf("\n");
+    }
+
+    // Clean up
+    for (int i = 0; i < inodeStatsSize; i++) {
+        free(inodeStats[i].buckets);
+    }
+    free(order);
+    free(segments);
+    free(written);
+    free(live);
+    free(inodeStats);
+    munmap(tail, fileSize);
+    close(fd);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1116 @@
+#include "wfs.h"
+#include <fuse.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+
+// Handlers are driven directly instead of through a kernel mount
+#undef fuse_main
+#define fuse_main(argc, argv, op, userData) runTest(op)
+int runTest(const struct fuse_operations *op);
+#define main mountMain
+#include "mount.wfs.c"
+#undef main
+
+#define TEST_FILES 100 // Files in directory listed by readdir test
+#define COLLIDE_FIRST "c1036131" // Two names with the same hash, in the order a directory sorts them
+#define COLLIDE_SECOND "c2718898"
+#define DIR_FILES 3000 // Files in directory of big directory test, more dentries than a segment holds
+
+const char *image = "test.img"; // Scratch disk image
+const char *scenario; // Scenario run by child process
+
+// Fail scenario unless condition holds
+void expect(int condition, const char *what) {
+    if (!condition) {
+        printf("FAIL %s: %s\n", scenario, what);
+        fflush(stdout);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Fill buf with size bytes that depend on seed and offset
+void pattern(char *buf, size_t size, int seed, off_t offset) {
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = (char)(((offset + i) * 31 + seed) ^ ((offset + i) / CHUNK_SIZE));
+    }
+}
+
+// Write size bytes at offset of file through an open handle, like a process calling write(2) would
+int writeFile(const struct fuse_operations *op, const char *path, const char *buf, size_t size, off_t offset) {
+    struct fuse_file_info fi = {0};
+    int ret = op->open(path, &fi);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = op->write(path, buf, size, offset, &fi);
+    // Buffered bytes reach the log at release, which fails if they don't fit, like close(2) would
+    int released = op->release(path, &fi);
+    return (released != 0) ? released : ret;
+}
+
+// Check that file holds exactly size bytes of pattern seed
+void expectFile(const struct fuse_operations *op, const char *path, size_t size, int seed) {
+    struct stat stbuf;
+    expect(op->getattr(path, &stbuf) == 0, "file exists");
+    expect((size_t)stbuf.st_size == size, "file has size written");
+
+    char *buf = (char *)malloc(size + 1);
+    char *want = (char *)malloc(size + 1);
+    if ((buf == NULL) || (want == NULL)) { // Memory allocation failed
+        perror("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    pattern(want, size, seed, 0);
+    struct fuse_file_info fi = {0};
+    expect(op->open(path, &fi) == 0, "file opens");
+    expect(op->read(path, buf, size + 1, 0, &fi) == (int)size, "read stops at end of file");
+    expect(memcmp(buf, want, size) == 0, "file holds bytes written");
+    op->release(path, &fi);
+    free(buf);
+    free(want);
+}
+
+// Get inode number of path, or -1 if it doesn't exist
+int inodeOf(const struct fuse_operations *op, const char *path) {
+    struct stat stbuf;
+    return (op->getattr(path, &stbuf) == 0) ? (int)stbuf.st_ino - 1 : -1;
+}
+
+// Count inodes in inode map
+int countInodes(void) {
+    int count = 0;
+    for (int i = 0; i < inodeMapSize; i++) {
+        count += (inodeMap[i] != 0);
+    }
+    return count;
+}
+
+// Count tombstones in the log
+int countTombstones(void) {
+    int count = 0;
+    for (uint32_t i = 0; i < superblock->segment_count; i++) {
+        if (segmentUsage[i].seq == 0) {
+            continue;
+        }
+        uint64_t end = segmentOffset(i) + ((i == headSegment) ? headUsed : segmentUsage[i].written);
+        struct wfs_inode inode;
+        for (uint64_t curr = segmentOffset(i); curr < end; curr += inode.size) {
+            expect(storage->read(curr, &inode, sizeof(struct wfs_inode)) == 0, "log entry reads");
+            count += (inode.flags & WFS_LOG_REMOVED) != 0;
+        }
+    }
+    return count;
+}
+
+// Stop without unmounting, as if the machine went down. Nothing is checkpointed or cleaned up
+void crash(void) {
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
+
+// Filler that collects names of dentries. Stops after listBudget names, like a full reply buffer
+char listed[TEST_FILES * 2][MAX_FILE_NAME_LEN + 1]; // Names listed so far
+int listedCount; // Number of names listed so far
+int listBudget; // Names that still fit in reply
+off_t listCookie; // Offset of last name listed
+int listDentry(void *buf, const char *name, const struct stat *stbuf, off_t offset) {
+    (void)buf;
+    (void)stbuf;
+    if (listBudget == 0) {
+        return 1;
+    }
+    listBudget--;
+    strcpy(listed[listedCount++], name);
+    listCookie = offset;
+    return 0;
+}
+
+// Count times name was listed
+int timesListed(const char *name) {
+    int count = 0;
+    for (int i = 0; i < listedCount; i++) {
+        count += (strcmp(listed[i], name) == 0);
+    }
+    return count;
+}
+
+// Filler that counts how often each name f<i> of big directory test is listed
+int dirListed[DIR_FILES];
+int countDentry(void *buf, const char *name, const struct stat *stbuf, off_t offset) {
+    (void)buf;
+    (void)stbuf;
+    (void)offset;
+    int i;
+    if ((sscanf(name, "f%d", &i) == 1) && (i >= 0) && (i < DIR_FILES)) {
+        dirListed[i]++;
+    }
+    return 0;
+}
+
+// Count bytes of disk image file mapped into this process
+uint64_t mappedBytes(void) {
+    struct stat stbuf;
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if ((maps == NULL) || (fstat(diskFd, &stbuf) == -1)) {
+        return UINT64_MAX;
+    }
+    uint64_t mapped = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), maps) != NULL) {
+        unsigned long start, end, inode;
+        if ((sscanf(line, "%lx-%lx %*s %*s %*s %lu", &start, &end, &inode) == 3) && (inode == stbuf.st_ino)) {
+            mapped += end - start;
+        }
+    }
+    fclose(maps);
+    return mapped;
+}
+
+// Make directories and files, write, rename and unlink some, then unmount
+void testMapWrite(const struct fuse_operations *op) {
+    char buf[10000];
+    expect(op->mkdir("/dir", 0755) == 0, "mkdir");
+    expect(op->mknod("/dir/a", S_IFREG | 0644, 0) == 0, "mknod");
+    pattern(buf, sizeof(buf), 1, 0);
+    expect(writeFile(op, "/dir/a", buf, sizeof(buf), 0) == sizeof(buf), "write");
+    expect(op->mknod("/b", S_IFREG | 0644, 0) == 0, "mknod");
+    pattern(buf, 5000, 3, 0);
+    expect(writeFile(op, "/b", buf, 5000, 0) == 5000, "write");
+    expect(op->rename("/b", "/dir/c") == 0, "rename");
+    expect(op->mknod("/gone", S_IFREG | 0644, 0) == 0, "mknod");
+    expect(op->unlink("/gone") == 0, "unlink");
+    expect(inodeOf(op, "/gone") == -1, "unlinked file has no name");
+    expect(countInodes() == 4, "unlinked file leaves inode map");
+}
+
+// Check that the inode map built at mount holds everything written
+void testMapCheck(const struct fuse_operations *op) {
+    expectFile(op, "/dir/a", 10000, 1);
+    expectFile(op, "/dir/c", 5000, 3);
+    expect(inodeOf(op, "/b") == -1, "renamed file leaves old name");
+    expect(inodeOf(op, "/gone") == -1, "unlinked file stays gone");
+    expect(countInodes() == 4, "only root, dir and two files are left");
+}
+
+// Fill an image that may grow past what the host filesystem lets it, so growing fails with ENOSPC
+void testGrow(const struct fuse_operations *op) {
+    // Host filesystem fills up at 4 MiB
+    struct rlimit limit = { 4 * 1024 * 1024, 4 * 1024 * 1024 };
+    signal(SIGXFSZ, SIG_IGN);
+    expect(setrlimit(RLIMIT_FSIZE, &limit) == 0, "limit file size");
+
+    char buf[16 * 1024];
+    char path[MAX_PATH_LENGTH];
+    uint32_t segments = superblock->segment_count;
+    int files = 0;
+    int ret = 0;
+    while (ret != -ENOSPC) {
+        sprintf(path, "/f%d", files);
+        ret = op->mknod(path, S_IFREG | 0644, 0);
+        if (ret == 0) {
+            pattern(buf, sizeof(buf), files, 0);
+            ret = writeFile(op, path, buf, sizeof(buf), 0);
+        }
+        expect((ret == sizeof(buf)) || (ret == -ENOSPC), "write fits or fails with ENOSPC");
+        files += (ret == sizeof(buf));
+        expect(files < 1000, "image stops growing");
+    }
+    expect(superblock->segment_count > segments, "image grew");
+    expect(diskSize <= 4 * 1024 * 1024, "image stays within host filesystem");
+    struct stat stbuf;
+    expect((fstat(diskFd, &stbuf) == 0) && ((uint64_t)stbuf.st_blocks * 512 >= diskSize), "segments have blocks allocated");
+    for (int i = 0; i < files; i++) {
+        sprintf(path, "/f%d", i);
+        expectFile(op, path, sizeof(buf), i);
+    }
+    if (!storage->whole) {
+        expect((cacheSlots > CACHE_MIN_SEGMENTS) || (cacheLoads > cacheSlots), "segments were unmapped to map others");
+        expect(mappedBytes() <= superblock->segments + (uint64_t)cacheSlots * superblock->segment_size, "mapped segments stay within cache");
+    }
+}
+
+// Make writes to disk image fail, then crash. Only the pwrite engine writes through diskFd
+void testWriteError(const struct fuse_operations *op) {
+    char buf[6000];
+    expect(op->mknod("/file", S_IFREG | 0644, 0) == 0, "mknod");
+    pattern(buf, sizeof(buf), 11, 0);
+    expect(writeFile(op, "/file", buf, sizeof(buf), 0) == sizeof(buf), "write");
+
+    // Disk image turns read-only underneath mount.wfs
+    int readOnly = open(image, O_RDONLY);
+    expect((readOnly != -1) && (dup2(readOnly, diskFd) == diskFd), "reopen image read-only");
+    char other[6000];
+    pattern(other, sizeof(other), 12, 0);
+    expect(writeFile(op, "/file", other, sizeof(other), 0) == -EIO, "failed write reports EIO");
+    expect(op->mknod("/new", S_IFREG | 0644, 0) == -EIO, "later updates fail too");
+    expect(op->unlink("/file") == -EIO, "unlink fails");
+    expect(op->rename("/file", "/moved") == -EIO, "rename fails");
+    expectFile(op, "/file", sizeof(buf), 11);
+    crash();
+}
+
+// Check that nothing after the failed write was replayed
+void testWriteErrorCheck(const struct fuse_operations *op) {
+    expectFile(op, "/file", 6000, 11);
+    expect(inodeOf(op, "/new") == -1, "failed mknod left nothing");
+    expect(inodeOf(op, "/moved") == -1, "failed rename left nothing");
+    expect(countInodes() == 2, "only root and file are left");
+}
+
+// Stop cleaner thread, then check that the log space totals of the stats file agree with the segment usage table
+void expectLogTotals(void) {
+    pthread_mutex_lock(&cleanerLock);
+    cleanerStop = 1;
+    pthread_cond_signal(&cleanerCond);
+    pthread_mutex_unlock(&cleanerLock);
+    pthread_join(cleanerThread, NULL);
+    cleanerRunning = 0;
+
+    uint64_t closed = 0;
+    uint64_t live = 0;
+    for (uint32_t i = 0; i < superblock->segment_count; i++) {
+        if ((segmentUsage[i].seq != 0) && (i != headSegment)) {
+            closed += segmentUsage[i].written;
+        }
+        live += segmentUsage[i].live;
+    }
+    expect(logClosedBytes == closed, "written bytes total matches segments");
+    expect(logLiveBytes == live, "live bytes total matches segments");
+}
+
+// Overwrite a file many times over the size of the image, so writes only fit if the cleaner reclaims dead segments
+void testCleaner(const struct fuse_operations *op) {
+    char buf[16 * 1024];
+    expect(op->mknod("/keep", S_IFREG | 0644, 0) == 0, "mknod");
+    pattern(buf, 8000, 10, 0);
+    expect(writeFile(op, "/keep", buf, 8000, 0) == 8000, "write");
+    expect(op->mknod("/file", S_IFREG | 0644, 0) == 0, "mknod");
+
+    for (int i = 0; i < 1000; i++) {
+        pattern(buf, sizeof(buf), i, 0);
+        int ret = writeFile(op, "/file", buf, sizeof(buf), 0);
+        // Give cleaner thread time to catch up
+        for (int tries = 0; (ret == -ENOSPC) && (tries < 1000); tries++) {
+            wakeCleaner();
+            usleep(1000);
+            ret = writeFile(op, "/file", buf, sizeof(buf), 0);
+        }
+        expect(ret == sizeof(buf), "overwrite fits once cleaned");
+    }
+    expect(cleanedSegments > 0, "cleaner reclaimed segments");
+    expect(superblock->segment_count == superblock->segment_max, "image grew no further than allowed");
+    expectFile(op, "/file", sizeof(buf), 999);
+    expectFile(op, "/keep", 8000, 10);
+    expectLogTotals();
+    crash();
+}
+
+// Check that log entries cleaner moved replay
+void testCleanerCheck(const struct fuse_operations *op) {
+    expectFile(op, "/file", 16 * 1024, 999);
+    expectFile(op, "/keep", 8000, 10);
+}
+
+// Write through write_buf from one piece of memory, from a file descriptor, and in a piece big enough to splice
+void testWriteBuf(const struct fuse_operations *op) {
+    size_t size = 3 * WRITE_BUFFER_SIZE;
+    char *buf = (char *)malloc(size);
+    FILE *src = tmpfile();
+    expect((buf != NULL) && (src != NULL), "scratch space");
+    pattern(buf, size, 5, 0);
+    expect(fwrite(buf, 1, size, src) == size, "scratch file");
+    fflush(src);
+
+    expect(op->mknod("/file", S_IFREG | 0644, 0) == 0, "mknod");
+    struct fuse_file_info fi = {0};
+    expect(op->open("/file", &fi) == 0, "open");
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(1000);
+    mem.buf[0].mem = buf;
+    expect(op->write_buf("/file", &mem, 0, &fi) == 1000, "write_buf from memory");
+    struct fuse_bufvec fd = FUSE_BUFVEC_INIT(WRITE_BUFFER_SIZE - 1000);
+    fd.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    fd.buf[0].fd = fileno(src);
+    fd.buf[0].pos = 1000;
+    expect(op->write_buf("/file", &fd, 1000, &fi) == WRITE_BUFFER_SIZE - 1000, "write_buf from file descriptor");
+    struct fuse_bufvec big = FUSE_BUFVEC_INIT(size - WRITE_BUFFER_SIZE);
+    big.buf[0].mem = buf + WRITE_BUFFER_SIZE;
+    expect(op->write_buf("/file", &big, WRITE_BUFFER_SIZE, &fi) == (int)(size - WRITE_BUFFER_SIZE), "large write_buf");
+    expect(op->release("/file", &fi) == 0, "release");
+    expectFile(op, "/file", size, 5);
+
+    fclose(src);
+    free(buf);
+}
+
+// Fill the image with files, then unlink all of them. Unlink must work on a full disk, and free space for new files
+void testFull(const struct fuse_operations *op) {
+    char buf[16 * 1024];
+    char path[MAX_PATH_LENGTH];
+    int files = 0;
+    int ret = 0;
+    while (ret != -ENOSPC) {
+        sprintf(path, "/f%d", files);
+        ret = op->mknod(path, S_IFREG | 0644, 0);
+        files += (ret == 0);
+        if (ret == 0) {
+            pattern(buf, sizeof(buf), files, 0);
+            ret = writeFile(op, path, buf, sizeof(buf), 0);
+        }
+        expect((ret == sizeof(buf)) || (ret == -ENOSPC), "write fits or fails with ENOSPC");
+        expect(files < 1000, "image fills up");
+    }
+
+    // Empty files take the rest, until not even the space the cleaner reclaims from superseded buckets holds one more
+    for (ret = 0; ret == 0; files++) {
+        while (waitCleaner()) {
+        }
+        sprintf(path, "/f%d", files);
+        ret = op->mknod(path, S_IFREG | 0644, 0);
+        expect((ret == 0) || (ret == -ENOSPC), "mknod fits or fails with ENOSPC");
+        expect(files < 2000, "image fills up");
+    }
+    files--;
+
+    // Unlink may use a free segment that creates and writes leave alone, and waits for the cleaner when it needs more
+    for (int i = 0; i < files; i++) {
+        sprintf(path, "/f%d", i);
+        expect(op->unlink(path) == 0, "unlink works on a full disk");
+    }
+    expect(countInodes() == 1, "only root is left");
+
+    expect(op->mknod("/new", S_IFREG | 0644, 0) == 0, "mknod");
+    pattern(buf, sizeof(buf), 7, 0);
+    ret = writeFile(op, "/new", buf, sizeof(buf), 0);
+    for (int tries = 0; (ret == -ENOSPC) && (tries < 1000); tries++) {
+        wakeCleaner();
+        usleep(1000);
+        ret = writeFile(op, "/new", buf, sizeof(buf), 0);
+    }
+    expect(ret == sizeof(buf), "freed space takes new files");
+    expectLogTotals();
+}
+
+// Check that big directory lists the files whose number isn't a multiple of 3, each once
+void expectBigDir(const struct fuse_operations *op) {
+    memset(dirListed, 0, sizeof(dirListed));
+    expect(op->readdir("/big", NULL, countDentry, 0, NULL) == 0, "readdir");
+    int left = 0;
+    for (int i = 0; i < DIR_FILES; i++) {
+        expect(dirListed[i] == (i % 3 != 0), "every file left is listed once");
+        left += (i % 3 != 0);
+    }
+    struct stat stbuf;
+    expect((op->getattr("/big", &stbuf) == 0) && (stbuf.st_size == left), "directory size counts its dentries");
+    expect(inodeOf(op, "/big/f1") != -1, "file left is found");
+    expect(inodeOf(op, "/big/f3") == -1, "unlinked file stays gone");
+    expect(inodeOf(op, "/big/g3") == -1, "renamed file stays gone");
+}
+
+// Fill a directory with more dentries than a segment holds, rename and unlink a third of them, then crash
+void testBigDirWrite(const struct fuse_operations *op) {
+    char path[MAX_PATH_LENGTH];
+    char to[MAX_PATH_LENGTH];
+    expect(op->mkdir("/big", 0755) == 0, "mkdir");
+    for (int i = 0; i < DIR_FILES; i++) {
+        sprintf(path, "/big/f%d", i);
+        expect(op->mknod(path, S_IFREG | 0644, 0) == 0, "mknod");
+    }
+    for (int i = 0; i < DIR_FILES; i += 3) {
+        sprintf(path, "/big/f%d", i);
+        sprintf(to, "/big/g%d", i);
+        expect(op->rename(path, to) == 0, "rename");
+        expect(op->unlink(to) == 0, "unlink");
+    }
+    struct wfs_dir *dir = (struct wfs_dir *)getInode(inodeOf(op, "/big"))->data;
+    expect(dir->buckets > DIR_FILES / DIR_BUCKET_ENTRIES, "directory is split into buckets");
+    expectBigDir(op);
+    crash();
+}
+
+// Write files, rename and overwrite some, then crash
+void testReplayWrite(const struct fuse_operations *op) {
+    char buf[10000];
+    expect(op->mkdir("/dir", 0755) == 0, "mkdir");
+    expect(op->mknod("/dir/a", S_IFREG | 0644, 0) == 0, "mknod");
+    pattern(buf, sizeof(buf), 1, 0);
+    expect(writeFile(op, "/dir/a", buf, sizeof(buf), 0) == sizeof(buf), "write");
+    // Overwrite middle of file, so it's made of several extents
+    pattern(buf, 3000, 2, 4000);
+    expect(writeFile(op, "/dir/a", buf, 3000, 4000) == 3000, "overwrite");
+    expect(op->mknod("/b", S_IFREG | 0644, 0) == 0, "mknod");
+    pattern(buf, 5000, 3, 0);
+    expect(writeFile(op, "/b", buf, 5000, 0) == 5000, "write");
+    expect(op->rename("/b", "/dir/c") == 0, "rename");
+    expect(op->mknod("/gone", S_IFREG | 0644, 0) == 0, "mknod");
+    expect(op->unlink("/gone") == 0, "unlink");
+    crash();
+}
+
+// Checkpoint, unlink a file and create another, then crash with deleted flags on disk that the log doesn't back. The
+// unlinked file's flag never made it, and the flag of the root's old log entry did while the new one didn't
+void testKillWrite(const struct fuse_operations *op) {
+    expect(op->mknod("/a", S_IFREG | 0644, 0) == 0, "mknod");
+    expect(op->mknod("/b", S_IFREG | 0644, 0) == 0, "mknod");
+    writeCheckpoint();
+    uint64_t unlinked = inodeMap[inodeOf(op, "/b")];
+    expect(op->unlink("/b") == 0, "unlink");
+    logEntryAt(unlinked)->inode.deleted = 0;
+    uint64_t oldHead = superblock->head;
+    uint64_t oldRoot = inodeMap[0];
+    expect(op->mknod("/f", S_IFREG | 0644, 0) == 0, "mknod");
+    expect(logEntryAt(oldRoot)->inode.deleted == 1, "root's old log entry is marked deleted");
+    superblock->head = oldHead;
+    crash();
+}
+
+// Checkpoint and create a file, then crash with the update torn after the root's old log entry was marked deleted
+void testKillTorn(const struct fuse_operations *op) {
+    expect(op->mknod("/a", S_IFREG | 0644, 0) == 0, "mknod");
+    writeCheckpoint();
+    uint64_t oldRoot = inodeMap[0];
+    expect(op->mknod("/f", S_IFREG | 0644, 0) == 0, "mknod");
+    expect(logEntryAt(oldRoot)->inode.deleted == 1, "root's old log entry is marked deleted");
+    getInode(0)->inode.checksum ^= 1;
+    crash();
+}
+
+// Check that replay kept the root's old log entry, and the unlinked file stays gone
+void testKillCheck(const struct fuse_operations *op) {
+    struct stat stbuf;
+    expect(op->getattr("/", &stbuf) == 0, "root survives");
+    expect(inodeOf(op, "/a") > 0, "file created before survives");
+    expect(inodeOf(op, "/b") == -1, "unlinked file stays gone");
+    expect(inodeOf(op, "/f") == -1, "file created by lost update is gone");
+    expect(countInodes() == 2, "only root and one file are left");
+    expect(getInode(0)->inode.deleted == 0, "root's log entry is live again");
+}
+
+// Check that replay recovered everything written before crash
+void testReplayCheck(const struct fuse_operations *op) {
+    char want[10000];
+    char buf[10000];
+    pattern(want, sizeof(want), 1, 0);
+    pattern(want + 4000, 3000, 2, 4000);
+    struct fuse_file_info fi = {0};
+    expect(op->open("/dir/a", &fi) == 0, "overwritten file survives");
+    expect(op->read("/dir/a", buf, sizeof(buf), 0, &fi) == sizeof(buf), "overwritten file keeps its size");
+    expect(memcmp(buf, want, sizeof(buf)) == 0, "overwrite survives");
+    op->release("/dir/a", &fi);
+    expectFile(op, "/dir/c", 5000, 3);
+    expect(inodeOf(op, "/b") == -1, "renamed file leaves old name");
+    expect(inodeOf(op, "/gone") == -1, "unlinked file stays gone");
+    expect(countInodes() == 4, "only root, dir and two files are left");
+}
+
+// Count chunks in use, and references to them
+void countChunks(int *count, int *refs) {
+    *count = 0;
+    *refs = 0;
+    for (uint32_t i = 1; i <= chunkCounter; i++) {
+        if ((i < chunkMapSize) && (chunks[i].entry != 0)) {
+            *count += 1;
+            *refs += chunks[i].refs;
+        }
+    }
+}
+
+// Write the same chunks to two files, then crash
+void testDedupWrite(const struct fuse_operations *op) {
+    char buf[2 * CHUNK_SIZE];
+    pattern(buf, sizeof(buf), 8, 0);
+    expect(op->mknod("/a", S_IFREG | 0644, 0) == 0, "mknod");
+    expect(op->mknod("/b", S_IFREG | 0644, 0) == 0, "mknod");
+    expect(writeFile(op, "/a", buf, sizeof(buf), 0) == sizeof(buf), "write");
+    expect(writeFile(op, "/b", buf, sizeof(buf), 0) == sizeof(buf), "write");
+
+    int count;
+    int refs;
+    countChunks(&count, &refs);
+    expect(count == 2, "identical chunks are stored once");
+    expect(refs == 4, "each file refers to both chunks");
+    expectFile(op, "/b", sizeof(buf), 8);
+
+    // Overwriting a file drops references of its old chunks
+    pattern(buf, sizeof(buf), 9, 0);
+    expect(writeFile(op, "/a", buf, sizeof(buf), 0) == sizeof(buf), "overwrite");
+    countChunks(&count, &refs);
+    expect((count == 4) && (refs == 4), "overwritten chunks lose a reference");
+    crash();
+}
+
+// Check that replay counts chunk references again, and removing files drops them
+void testDedupCheck(const struct fuse_operations *op) {
+    int count;
+    int refs;
+    countChunks(&count, &refs);
+    expect((count == 4) && (refs == 4), "replay counts chunk references");
+    expectFile(op, "/a", 2 * CHUNK_SIZE, 9);
+    expectFile(op, "/b", 2 * CHUNK_SIZE, 8);
+
+    expect(op->unlink("/b") == 0, "unlink");
+    countChunks(&count, &refs);
+    expect((count == 2) && (refs == 2), "unlinked file drops its references");
+    expect(op->unlink("/a") == 0, "unlink");
+    countChunks(&count, &refs);
+    expect((count == 0) && (refs == 0), "chunks nothing refers to are removed");
+}
+
+// List a directory a few names per call, changing it between calls
+void testReaddir(const struct fuse_operations *op) {
+    char path[MAX_PATH_LENGTH];
+    expect(op->mkdir("/dir", 0755) == 0, "mkdir");
+    for (int i = 0; i < TEST_FILES; i++) {
+        sprintf(path, "/dir/f%d", i);
+        expect(op->mknod(path, S_IFREG | 0644, 0) == 0, "mknod");
+    }
+
+    struct fuse_file_info fi = {0};
+    expect(op->opendir("/dir", &fi) == 0, "opendir");
+    listedCount = 0;
+    listCookie = 0;
+    int added = 0;
+    int removed = -1;
+    while (1) {
+        int before = listedCount;
+        listBudget = 7;
+        expect(op->readdir(NULL, NULL, listDentry, listCookie, &fi) == 0, "readdir");
+        if (listedCount == before) {
+            break;
+        }
+        // Remove a name already listed and add new ones, so dentries after cookie shift
+        if (removed == -1) {
+            expect(sscanf(listed[0], "f%d", &removed) == 1, "names are listed");
+            sprintf(path, "/dir/f%d", removed);
+            expect(op->unlink(path) == 0, "unlink");
+        }
+        sprintf(path, "/dir/new%d", added++);
+        expect(op->mknod(path, S_IFREG | 0644, 0) == 0, "mknod");
+        expect(listedCount < TEST_FILES * 2 - 7, "listing ends");
+    }
+
+    // Names there all along are listed exactly once
+    for (int i = 0; i < TEST_FILES; i++) {
+        sprintf(path, "f%d", i);
+        expect(timesListed(path) == 1, "every name is listed once");
+    }
+    for (int i = 0; i < added; i++) {
+        sprintf(path, "new%d", i);
+        expect(timesListed(path) <= 1, "no name is listed twice");
+    }
+    expect(op->releasedir(NULL, &fi) == 0, "releasedir");
+}
+
+// List a directory one name per call, and remove the first of two names sharing a hash right after it is listed
+void testReaddirCollide(const struct fuse_operations *op) {
+    const char *first = COLLIDE_FIRST;
+    const char *second = COLLIDE_SECOND;
+    char path[MAX_PATH_LENGTH];
+    expect((wfs_hash(first) == wfs_hash(second)) && (strcmp(first, second) < 0), "names share a hash");
+    expect(op->mkdir("/dir", 0755) == 0, "mkdir");
+    for (int i = 0; i < 10; i++) {
+        sprintf(path, "/dir/f%d", i);
+        expect(op->mknod(path, S_IFREG | 0644, 0) == 0, "mknod");
+    }
+    sprintf(path, "/dir/%s", first);
+    expect(op->mknod(path, S_IFREG | 0644, 0) == 0, "mknod");
+    sprintf(path, "/dir/%s", second);
+    expect(op->mknod(path, S_IFREG | 0644, 0) == 0, "mknod");
+
+    struct fuse_file_info fi = {0};
+    expect(op->opendir("/dir", &fi) == 0, "opendir");
+    listedCount = 0;
+    listCookie = 0;
+    while (1) {
+        int before = listedCount;
+        listBudget = 1;
+        expect(op->readdir(NULL, NULL, listDentry, listCookie, &fi) == 0, "readdir");
+        if (listedCount == before) {
+            break;
+        }
+        if (strcmp(listed[listedCount - 1], first) == 0) {
+            sprintf(path, "/dir/%s", first);
+            expect(op->unlink(path) == 0, "unlink");
+        }
+        expect(listedCount < 20, "listing ends");
+    }
+    expect(timesListed(first) == 1, "removed name was listed");
+    expect(timesListed(second) == 1, "name sharing hash of removed one is still listed");
+    for (int i = 0; i < 10; i++) {
+        sprintf(path, "f%d", i);
+        expect(timesListed(path) == 1, "every name is listed once");
+    }
+    expect(op->releasedir(NULL, &fi) == 0, "releasedir");
+}
+
+// Unlink a file while a handle holds it open
+void testUnlinkOpen(const struct fuse_operations *op) {
+    char buf[3000];
+    char got[4000];
+    expect(op->mknod("/file", S_IFREG | 0644, 0) == 0, "mknod");
+    pattern(buf, sizeof(buf), 6, 0);
+    expect(writeFile(op, "/file", buf, sizeof(buf), 0) == sizeof(buf), "write");
+    int inodeNum = inodeOf(op, "/file");
+    int inodes = countInodes();
+
+    struct fuse_file_info fi = {0};
+    struct fuse_file_info other = {0};
+    expect(op->open("/file", &fi) == 0, "open");
+    expect(op->open("/file", &other) == 0, "open");
+    expect(op->unlink("/file") == 0, "unlink");
+    expect(inodeOf(op, "/file") == -1, "unlinked file has no name");
+
+    // Handles keep working
+    struct stat stbuf;
+    expect((op->getattr("/", &stbuf) == 0) && (stbuf.st_ino == 1), "root is FUSE_ROOT_ID");
+    expect(op->fgetattr(NULL, &stbuf, &fi) == 0, "fstat after unlink");
+    expect((stbuf.st_ino == (ino_t)inodeNum + 1) && (stbuf.st_size == sizeof(buf)), "fstat reports unlinked file");
+    expect(op->read(NULL, got, sizeof(got), 0, &fi) == sizeof(buf), "read after unlink");
+    expect(memcmp(got, buf, sizeof(buf)) == 0, "unlinked file keeps its bytes");
+    pattern(buf, sizeof(buf), 7, 1000);
+    expect(op->write(NULL, buf, sizeof(buf), 1000, &fi) == sizeof(buf), "write after unlink");
+    expect(op->read(NULL, got, sizeof(got), 1000, &other) == sizeof(buf), "other handle sees write");
+    expect(memcmp(got, buf, sizeof(buf)) == 0, "other handle reads bytes written");
+
+    // New file by the same name is another file
+    expect(op->mknod("/file", S_IFREG | 0644, 0) == 0, "mknod same name");
+    expect(inodeOf(op, "/file") != inodeNum, "new file gets its own inode");
+    expect(op->unlink("/file") == 0, "unlink");
+
+    // Last release removes file
+    expect(op->release(NULL, &fi) == 0, "release");
+    expect(inodeMap[inodeNum] != 0, "file lives while a handle is open");
+    expect(op->release(NULL, &other) == 0, "release");
+    expect(inodeMap[inodeNum] == 0, "last release removes file");
+    expect(countInodes() == inodes - 1, "nothing else is left");
+}
+
+// Unlink a file while a handle holds it open, take a checkpoint, write to it through the handle, then crash
+void testOrphanWrite(const struct fuse_operations *op) {
+    char buf[3000];
+    expect(op->mknod("/keep", S_IFREG | 0644, 0) == 0, "mknod");
+    pattern(buf, sizeof(buf), 8, 0);
+    expect(writeFile(op, "/keep", buf, sizeof(buf), 0) == sizeof(buf), "write");
+    expect(op->mknod("/file", S_IFREG | 0644, 0) == 0, "mknod");
+    expect(writeFile(op, "/file", buf, sizeof(buf), 0) == sizeof(buf), "write");
+
+    struct fuse_file_info fi = {0};
+    expect(op->open("/file", &fi) == 0, "open");
+    expect(op->unlink("/file") == 0, "unlink");
+    // Checkpoint is taken after the tombstone, so mount finds the file in its list of orphans
+    writeCheckpoint();
+    expect(checkpointRegion(0)->orphan_count + checkpointRegion(1)->orphan_count == 1, "checkpoint lists file");
+    pattern(buf, sizeof(buf), 9, 1000);
+    expect(op->write(NULL, buf, sizeof(buf), 1000, &fi) == sizeof(buf), "write after unlink");
+    expect(op->fsync(NULL, 0, &fi) == 0, "fsync after unlink");
+    // File is still open
+    crash();
+}
+
+// Unlink a file while a handle holds it open, then checkpoint twice and let the cleaner drop its tombstone before
+// crashing. Only the checkpoints' list of orphans still says the file is gone
+void testOrphanClean(const struct fuse_operations *op) {
+    char buf[16 * 1024];
+    expect(op->mknod("/keep", S_IFREG | 0644, 0) == 0, "mknod");
+    pattern(buf, 3000, 8, 0);
+    expect(writeFile(op, "/keep", buf, 3000, 0) == 3000, "write");
+    expect(op->mknod("/file", S_IFREG | 0644, 0) == 0, "mknod");
+    expect(writeFile(op, "/file", buf, 3000, 0) == 3000, "write");
+
+    struct fuse_file_info fi = {0};
+    expect(op->open("/file", &fi) == 0, "open");
+    expect(op->unlink("/file") == 0, "unlink");
+    uint32_t tombstoneSegment = headSegment;
+    uint32_t tombstoneSeq = segmentUsage[tombstoneSegment].seq;
+
+    // Move head on, so the segment holding the tombstone can be cleaned
+    expect(op->mknod("/filler", S_IFREG | 0644, 0) == 0, "mknod");
+    for (int i = 0; i < 12; i++) {
+        pattern(buf, sizeof(buf), i, 0);
+        expect(writeFile(op, "/filler", buf, sizeof(buf), i * sizeof(buf)) == sizeof(buf), "write");
+    }
+    expect(op->unlink("/filler") == 0, "unlink");
+    writeCheckpoint();
+    writeCheckpoint();
+
+    // Clean every segment with a dead byte until the tombstone's segment is reused
+    cleanerThreshold = 100;
+    for (int tries = 0; (segmentUsage[tombstoneSegment].seq == tombstoneSeq) && (tries < 5000); tries++) {
+        wakeCleaner();
+        usleep(1000);
+    }
+    expect(segmentUsage[tombstoneSegment].seq != tombstoneSeq, "cleaner reclaims tombstone's segment");
+    // File is still open
+    crash();
+}
+
+// Check that the file unlinked while open is gone, and nothing else is
+void testOrphanCheck(const struct fuse_operations *op) {
+    expect(inodeOf(op, "/file") == -1, "unlinked file stays gone");
+    expectFile(op, "/keep", 3000, 8);
+    expect(countInodes() == 2, "file unlinked while open is removed at mount");
+}
+
+// Rename over files and directories while a handle holds the replaced file open, then crash
+void testRenameWrite(const struct fuse_operations *op) {
+    char buf[6000];
+    expect(op->mkdir("/x", 0755) == 0, "mkdir");
+    expect(op->mkdir("/y", 0755) == 0, "mkdir");
+    expect(op->mknod("/x/a", S_IFREG | 0644, 0) == 0, "mknod");
+    expect(op->mknod("/y/b", S_IFREG | 0644, 0) == 0, "mknod");
+    pattern(buf, sizeof(buf), 4, 0);
+    expect(writeFile(op, "/x/a", buf, sizeof(buf), 0) == sizeof(buf), "write");
+    pattern(buf, 2000, 5, 0);
+    expect(writeFile(op, "/y/b", buf, 2000, 0) == 2000, "write");
+
+    int inodeA = inodeOf(op, "/x/a");
+    struct fuse_file_info fi = {0};
+    expect(op->open("/y/b", &fi) == 0, "open");
+    expect(op->rename("/x/a", "/y/b") == 0, "rename over file");
+
+    // Exactly one name for moved file, and target is replaced
+    expect(inodeOf(op, "/x/a") == -1, "moved file leaves old name");
+    expect(inodeOf(op, "/y/b") == inodeA, "target names moved file");
+    expectFile(op, "/y/b", 6000, 4);
+    listedCount = 0;
+    listBudget = -1;
+    expect(op->readdir("/x", NULL, listDentry, 0, NULL) == 0, "readdir");
+    expect(listedCount == 0, "source directory is empty");
+    expect(op->readdir("/y", NULL, listDentry, 0, NULL) == 0, "readdir");
+    expect((listedCount == 1) && (strcmp(listed[0], "b") == 0), "target directory lists target once");
+
+    // Handle on replaced file still reads what it held
+    char got[2000];
+    expect(op->read("/y/b", got, sizeof(got), 0, &fi) == 2000, "replaced file stays readable");
+    expect(memcmp(got, buf, sizeof(got)) == 0, "replaced file keeps its bytes");
+
+    // Directories move with what they hold
+    expect(op->mknod("/x/child", S_IFREG | 0644, 0) == 0, "mknod");
+    expect(op->rename("/x", "/z") == 0, "rename directory");
+    expect(inodeOf(op, "/x/child") == -1, "children leave old directory name");
+    expect(inodeOf(op, "/z/child") != -1, "children follow directory");
+    // Replaced file is still open
+    crash();
+}
+
+// Check that renames survived crash, and the file replaced while open is gone
+void testRenameCheck(const struct fuse_operations *op) {
+    expect(inodeOf(op, "/x") == -1, "renamed directory leaves old name");
+    expect(inodeOf(op, "/z/child") != -1, "renamed directory keeps children");
+    expectFile(op, "/y/b", 6000, 4);
+    expect(countInodes() == 5, "file replaced while open is removed at mount");
+}
+
+// Create three files and unlink two of them, then unmount
+void testTombstoneWrite(const struct fuse_operations *op) {
+    char buf[3000];
+    pattern(buf, sizeof(buf), 5, 0);
+    const char *paths[] = { "/a", "/b", "/keep" };
+    for (int i = 0; i < 3; i++) {
+        expect(op->mknod(paths[i], S_IFREG | 0644, 0) == 0, "mknod");
+        expect(writeFile(op, paths[i], buf, sizeof(buf), 0) == sizeof(buf), "write");
+    }
+    expect(op->unlink("/a") == 0, "unlink");
+    expect(op->unlink("/b") == 0, "unlink");
+    expect(countTombstones() == 2, "unlink appends a tombstone");
+}
+
+// Check that fsck dropped the unlinked files and their tombstones
+void testTombstoneCheck(const struct fuse_operations *op) {
+    expect(inodeOf(op, "/a") == -1, "unlinked file stays gone");
+    expect(inodeOf(op, "/b") == -1, "unlinked file stays gone");
+    expectFile(op, "/keep", 3000, 5);
+    expect(countInodes() == 2, "only root and one file are left");
+    expect(countTombstones() == 0, "fsck drops tombstones");
+}
+
+// Run scenario on mounted filesystem. Called by mount.wfs main in place of fuse_main
+int runTest(const struct fuse_operations *op) {
+    struct fuse_conn_info conn = {0};
+    op->init(&conn);
+    if (strcmp(scenario, "map-write") == 0) {
+        testMapWrite(op);
+    } else if (strcmp(scenario, "map-check") == 0) {
+        testMapCheck(op);
+    } else if (strcmp(scenario, "cleaner") == 0) {
+        testCleaner(op);
+    } else if (strcmp(scenario, "cleaner-check") == 0) {
+        testCleanerCheck(op);
+    } else if (strcmp(scenario, "grow") == 0) {
+        testGrow(op);
+    } else if (strcmp(scenario, "write-error") == 0) {
+        testWriteError(op);
+    } else if (strcmp(scenario, "write-error-check") == 0) {
+        testWriteErrorCheck(op);
+    } else if (strcmp(scenario, "kill-write") == 0) {
+        testKillWrite(op);
+    } else if (strcmp(scenario, "kill-torn") == 0) {
+        testKillTorn(op);
+    } else if (strcmp(scenario, "kill-check") == 0) {
+        testKillCheck(op);
+    } else if (strcmp(scenario, "replay-write") == 0) {
+        testReplayWrite(op);
+    } else if (strcmp(scenario, "replay-check") == 0) {
+        testReplayCheck(op);
+    } else if (strcmp(scenario, "dedup-write") == 0) {
+        testDedupWrite(op);
+    } else if (strcmp(scenario, "dedup-check") == 0) {
+        testDedupCheck(op);
+    } else if (strcmp(scenario, "readdir") == 0) {
+        testReaddir(op);
+    } else if (strcmp(scenario, "readdir-collide") == 0) {
+        testReaddirCollide(op);
+    } else if (strcmp(scenario, "unlink-open") == 0) {
+        testUnlinkOpen(op);
+    } else if (strcmp(scenario, "orphan-write") == 0) {
+        testOrphanWrite(op);
+    } else if (strcmp(scenario, "orphan-clean") == 0) {
+        testOrphanClean(op);
+    } else if (strcmp(scenario, "orphan-check") == 0) {
+        testOrphanCheck(op);
+    } else if (strcmp(scenario, "tombstone-write") == 0) {
+        testTombstoneWrite(op);
+    } else if (strcmp(scenario, "tombstone-check") == 0) {
+        testTombstoneCheck(op);
+    } else if (strcmp(scenario, "write-buf") == 0) {
+        testWriteBuf(op);
+    } else if (strcmp(scenario, "full") == 0) {
+        testFull(op);
+    } else if (strcmp(scenario, "big-dir-write") == 0) {
+        testBigDirWrite(op);
+    } else if (strcmp(scenario, "big-dir-check") == 0) {
+        expectBigDir(op);
+    } else if (strcmp(scenario, "rename-write") == 0) {
+        testRenameWrite(op);
+    } else if (strcmp(scenario, "rename-check") == 0) {
+        testRenameCheck(op);
+    } else {
+        expect(0, "scenario exists");
+    }
+    op->destroy(NULL);
+
+    return 0;
+}
+
+// Make empty scratch image of size bytes, formatted with mkfs options
+void makeImage(uint64_t size, const char *options) {
+    int fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if ((fd == -1) || (ftruncate(fd, size) == -1)) {
+        perror("Error creating scratch image");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    char command[256];
+    snprintf(command, sizeof(command), "./mkfs.wfs %s %s", options, image);
+    if (system(command) != 0) {
+        fprintf(stderr, "Error formatting scratch image\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Drop both checkpoints from scratch image, so the next mount replays the whole log
+void dropCheckpoints(void) {
+    int fd = open(image, O_RDWR);
+    struct wfs_sb sb;
+    if ((fd == -1) || (pread(fd, &sb, sizeof(struct wfs_sb), 0) != sizeof(struct wfs_sb))) {
+        perror("Error reading scratch image");
+        exit(EXIT_FAILURE);
+    }
+    struct wfs_checkpoint empty;
+    memset(&empty, 0, sizeof(struct wfs_checkpoint));
+    for (int i = 0; i < 2; i++) {
+        if (pwrite(fd, &empty, sizeof(struct wfs_checkpoint), sb.checkpoints + (uint64_t)i * sb.checkpoint_size) != sizeof(struct wfs_checkpoint)) {
+            perror("Error writing scratch image");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+}
+
+int failures; // Scenarios failed
+
+// Mount scratch image in a child process and run scenario on it with storage options given, separated by spaces.
+// Each run starts from fresh in-memory state
+void run(const char *name, const char *storage) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Error forking");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        // Handlers report every missing path on stderr
+        if (freopen("/dev/null", "w", stderr) == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        scenario = name;
+        char options[strlen(storage) + 1];
+        strcpy(options, storage);
+        char *argv[8] = { "test.wfs", "-f", "-s" };
+        int argc = 3;
+        for (char *option = strtok(options, " "); (option != NULL) && (argc < 5); option = strtok(NULL, " ")) {
+            argv[argc++] = option;
+        }
+        argv[argc++] = (char *)image;
+        argv[argc++] = "/mnt";
+        argv[argc] = NULL;
+        exit(mountMain(argc, argv));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    int ok = WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+    printf("%-4s %-18s %s\n", ok ? "ok" : "FAIL", name, storage);
+    failures += !ok;
+}
+
+// Compact scratch image with fsck.wfs
+void fsck(const char *storage) {
+    fflush(stdout);
+    char command[256];
+    snprintf(command, sizeof(command), "./fsck.wfs %s 2>/dev/null", image);
+    int ok = (system(command) == 0);
+    printf("%-4s %-18s %s\n", ok ? "ok" : "FAIL", "fsck", storage);
+    failures += !ok;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [<scratchImagePath>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc == 2) {
+        image = argv[1];
+    }
+
+    // The pwrite engine runs once more with only CACHE_MIN_SEGMENTS segments mapped at a time
+    const char *storages[] = { "--storage=mmap", "--storage=pwrite", "--storage=pwrite --cache-size=0" };
+    for (int i = 0; i < 3; i++) {
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("map-write", storages[i]);
+        run("map-check", storages[i]);
+
+        // Image may not grow past 16 segments
+        makeImage(1024 * 1024, "-s 64K -m 1M");
+        run("cleaner", storages[i]);
+        dropCheckpoints();
+        run("cleaner-check", storages[i]);
+
+        makeImage(1024 * 1024, "-s 64K -m 64M");
+        run("grow", storages[i]);
+
+        makeImage(1024 * 1024, "-s 64K -m 1M");
+        run("full", storages[i]);
+
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("write-buf", storages[i]);
+
+        // Directory of many buckets, replayed from a checkpoint and from the start of the log, and compacted
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("big-dir-write", storages[i]);
+        run("big-dir-check", storages[i]);
+        dropCheckpoints();
+        run("big-dir-check", storages[i]);
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("big-dir-write", storages[i]);
+        fsck(storages[i]);
+        run("big-dir-check", storages[i]);
+
+        // Crash and replay, from a checkpoint and from the start of the log
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("replay-write", storages[i]);
+        run("replay-check", storages[i]);
+        dropCheckpoints();
+        run("replay-check", storages[i]);
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("replay-write", storages[i]);
+        fsck(storages[i]);
+        run("replay-check", storages[i]);
+
+        // Crash with deleted flags on disk ahead of the log, replayed from a checkpoint and from the start of the log
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("kill-write", storages[i]);
+        run("kill-check", storages[i]);
+        dropCheckpoints();
+        run("kill-check", storages[i]);
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("kill-torn", storages[i]);
+        run("kill-check", storages[i]);
+        dropCheckpoints();
+        run("kill-check", storages[i]);
+        // fsck replays the log the way mount does
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("kill-write", storages[i]);
+        fsck(storages[i]);
+        run("kill-check", storages[i]);
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("kill-torn", storages[i]);
+        fsck(storages[i]);
+        run("kill-check", storages[i]);
+
+        makeImage(16 * 1024 * 1024, "-s 64K -d");
+        run("dedup-write", storages[i]);
+        dropCheckpoints();
+        run("dedup-check", storages[i]);
+        makeImage(16 * 1024 * 1024, "-s 64K -d");
+        run("dedup-write", storages[i]);
+        fsck(storages[i]);
+        run("dedup-check", storages[i]);
+
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("tombstone-write", storages[i]);
+        fsck(storages[i]);
+        run("tombstone-check", storages[i]);
+
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("readdir", storages[i]);
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("readdir-collide", storages[i]);
+
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("unlink-open", storages[i]);
+
+        // Crash while a file unlinked before the checkpoint is open, replayed from the checkpoint and from the start of
+        // the log
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("orphan-write", storages[i]);
+        run("orphan-check", storages[i]);
+        dropCheckpoints();
+        run("orphan-check", storages[i]);
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("orphan-write", storages[i]);
+        fsck(storages[i]);
+        run("orphan-check", storages[i]);
+
+        // fsck drops a file unlinked while open whose tombstone the cleaner let go, even once mount has checkpointed
+        // without it
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("orphan-clean", storages[i]);
+        fsck(storages[i]);
+        run("orphan-check", storages[i]);
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("orphan-clean", storages[i]);
+        run("orphan-check", storages[i]);
+        fsck(storages[i]);
+        run("orphan-check", storages[i]);
+
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("rename-write", storages[i]);
+        dropCheckpoints();
+        run("rename-check", storages[i]);
+        makeImage(16 * 1024 * 1024, "-s 64K");
+        run("rename-write", storages[i]);
+        fsck(storages[i]);
+        run("rename-check", storages[i]);
+    }
+
+    makeImage(16 * 1024 * 1024, "-s 64K");
+    run("write-error", "--storage=pwrite");
+    run("write-error-check", "--storage=pwrite");
+    unlink(image);
+
+    if (failures > 0) {
+        printf("%d scenarios failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -11,14 +11,42 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <limits.h>
 #include <string.h>
 #include <stddef.h>
 
-#define MAX_SIZE 1000000 // 1 MB File
 #define MAX_PATH_LENGTH 128
 #define MAX_INODES 1000
+#define DCACHE_SIZE 4096 // Number of slots in dentry cache
+#define WRITE_BUFFER_SIZE (64 * 1024) // Buffered bytes per open file before they are flushed to log
+#define INODE_LOCK_COUNT 64 // Number of stripes serializing updates to files and directories
+#define DCACHE_LOCK_COUNT 64 // Number of stripes protecting dentry cache slots
+#define ZCACHE_SIZE 64 // Number of decompressed extents kept in memory
+#define COMPRESS_MIN 64 // Extents shorter than this are never compressed
+#define CHUNK_SIZE 4096 // Bytes per deduplicated chunk. Chunks start at file offsets that are multiples of it
+#define CHUNK_BUCKETS (64 * 1024) // Number of chunk fingerprint hash buckets
+#define SEGMENT_SIZE (64 * 1024) // Default bytes per segment
+#define CLEANER_THRESHOLD 50 // Default percentage of live bytes at or below which the cleaner reclaims a segment
+#define CLEANER_RATE (4 * 1024 * 1024) // Default bytes of log the cleaner may reclaim per second. 0 means unlimited
+#define CLEANER_SEGMENTS 2 // Free segments only the cleaner may use, so it can always copy live data forward
+#define REMOVAL_SEGMENTS 1 // Free segments past the cleaner's that only unlink may use, so a full disk can still be emptied
+#define UPDATE_SEGMENTS (CLEANER_SEGMENTS + REMOVAL_SEGMENTS) // Free segments every other update leaves
+#define SYNC_INTERVAL (10 * 1000 * 1000) // Nanoseconds between group commits
+#define CHECKPOINT_INTERVAL 30 // Seconds between checkpoints while the log keeps changing
+#define CHECKPOINT_MIN_SIZE (16 * 1024) // Smallest checkpoint region
+#define DIR_BUCKET_ENTRIES 64 // Average dentries per directory bucket above which the next bucket splits
+#define DIR_UPDATE_BUCKETS 4 // Most buckets of one directory an update rewrites: a split bucket's two halves, and the buckets a dentry leaves and joins
+#define DIR_COOKIE_NAME_BITS 16 // Low bits of a readdir offset cookie. They pick the name a dentry sharing its hash was listed under
+#define STATS_PATH "/.wfs_stats" // Read-only virtual file serving live metrics
+#define STATS_HANDLE 1 // fh of an open stats file
+#define FILE_HANDLE 2 // fh of an open file is its inode number plus this, so it is neither 0 (no handle) nor STATS_HANDLE
+#define STATS_INO ((ino_t)UINT32_MAX + 1) // st_ino of stats file, above that of every inode
+#define FUSE_OPTIONS "use_ino,hard_remove" // Report our inode numbers, and let handles outlive unlink
+#define STATS_BUCKETS 24 // Latency histogram buckets. Bucket i counts calls of at most 2^i microseconds, the last one all others
 #define FUSE_USE_VERSION 30
 
 #ifndef S_IFDIR
@@ -31,20 +59,161 @@
 #ifndef MOUNT_WFS_H_
 #define MOUNT_WFS_H_
 
-#define MAX_FILE_NAME_LEN 32
+#define MAX_FILE_NAME_LEN NAME_MAX // Longest name a dentry holds, as on other Linux file systems
 #define WFS_MAGIC 0xdeadbeef
+#define WFS_VERSION 8 // On-disk format version. 2 has 64-bit disk offsets and file sizes, 3 adds checkpoint regions, 4 adds log entry checksums, 5 adds compressed extents, 6 adds shared chunks, 7 adds tombstones, 8 splits directories into hash buckets
+#define WFS_LOG_EXTENT 0x1 // inode.flags: log entry holds one extent of file data instead of the whole file
+#define WFS_LOG_CONTINUED 0x2 // inode.flags: next log entry belongs to the same update. Mount replays an update only if all of it is intact
+#define WFS_LOG_COMPRESSED 0x4 // inode.flags: extent data is zlib compressed. wfs_extent.length still counts uncompressed bytes
+#define WFS_LOG_CHUNK 0x8 // inode.flags: log entry holds one shared chunk. inode_number is the chunk id and wfs_extent.file_size its fingerprint
+#define WFS_LOG_SHARED 0x10 // inode.flags: extent data is kept in shared chunks, listed in a wfs_shared after the wfs_extent
+#define WFS_LOG_REMOVED 0x20 // inode.flags: tombstone. Log entry has no data, and its inode was removed. Mount drops it and ignores its later log entries
+#define WFS_SB_COMPRESS 0x1 // superblock flags: compress file data by default
+#define WFS_SB_DEDUP 0x2 // superblock flags: deduplicate file data by default
+#define STORAGE_IOV_MAX 1024 // Buffers per pwritev call. Linux takes no more
+#define CACHE_SIZE (64 * 1024 * 1024) // Default bytes of segments the pwrite engine keeps mapped
+#define CACHE_MIN_SEGMENTS 4 // Fewest segments the pwrite engine keeps mapped
+#define WFS_SYNC_NONE 0 // Log reaches disk when the kernel writes it back, or when fsync asks for it
+#define WFS_SYNC_GROUP 1 // A background thread syncs what was committed since its last pass every SYNC_INTERVAL
+#define WFS_SYNC_STRICT 2 // Every update is synced before its handler returns
+#define WFS_OP_GETATTR 0 // Index of each timed handler in opStats
+#define WFS_OP_OPEN 1
+#define WFS_OP_READ 2
+#define WFS_OP_READ_BUF 3
+#define WFS_OP_MKNOD 4
+#define WFS_OP_MKDIR 5
+#define WFS_OP_WRITE 6
+#define WFS_OP_WRITE_BUF 7
+#define WFS_OP_FLUSH 8
+#define WFS_OP_RELEASE 9
+#define WFS_OP_READDIR 10
+#define WFS_OP_UNLINK 11
+#define WFS_OP_FSYNC 12
+#define WFS_OP_OPENDIR 13
+#define WFS_OP_RENAME 14
+#define WFS_OP_RELEASEDIR 15
+#define WFS_OP_COUNT 16
 
 int inodeCounter = 0; // Counter for inode numbers
-int totalSize; // Total size of log
+uint32_t crcTable[8][256]; // Slicing-by-8 tables for CRC32C
 char *disk; // Path to disk image file
 char *mnt; // Path to mount point
-char *head; // Head of log
-char *tail; // Tail of log
+char *head; // Head of log. Everything before it is committed
+char *tail; // Start of disk image mapping. It never moves, even when the image grows
+int diskFd; // Open disk image file
+uint64_t diskSize; // Bytes of disk image mapped
 struct wfs_sb *superblock; // Superblock of filesystem
+uint64_t *inodeMap; // Offset of latest log entry for each inode number
+int inodeMapSize; // Number of slots in inode map
+struct wfs_dcache_entry *dcache; // Path to inode number cache
+struct wfs_extent_map *extentMaps; // Live extents of each file, indexed by inode number
+uint64_t *coveredEntries; // Log entries addExtent found overwritten. Protected by fsLock
+uint32_t coveredCapacity; // Slots in coveredEntries
+struct wfs_open_file *openFiles; // Open handles and write buffer of each file, indexed by inode number. Protected by fsLock
+pthread_rwlock_t fsLock = PTHREAD_RWLOCK_INITIALIZER; // Readers share it. Publishing new log entries to the maps takes it exclusively
+pthread_mutex_t inodeLocks[INODE_LOCK_COUNT]; // Serialize updates to the same file or directory
+pthread_mutex_t dcacheLocks[DCACHE_LOCK_COUNT]; // Protect dentry cache slots
+struct wfs_zcache_entry *zcache; // Decompressed data of recently read compressed extents
+pthread_mutex_t zcacheLocks[ZCACHE_SIZE]; // Protect decompressed extent cache slots
+int compressData; // 1 if file data written is compressed
+int dedupData; // 1 if file data written is deduplicated
+const struct wfs_storage_ops *storage; // How log entries reach disk image and file data is read back, chosen at mount
+uint64_t cacheSize = CACHE_SIZE; // Bytes of segments the pwrite engine keeps mapped
+uint32_t cacheSlots; // Segments the pwrite engine keeps mapped while no thread holds more
+uint32_t *cacheRing; // Segments the pwrite engine has mapped, in no particular order. Protected by cacheLock
+uint32_t cacheCount; // Number of segments in cacheRing
+uint32_t cacheHand; // Position in cacheRing where the search for a segment to unmap goes on
+uint32_t *cacheRefs; // Threads holding each segment mapped, indexed by segment. Protected by cacheLock
+char *cacheMapped; // 1 if segment is mapped, 2 if it was also used since cacheHand last passed it. Protected by cacheLock
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER; // Protects the pwrite engine's segment cache
+pthread_key_t cacheKey; // Segments each thread holds mapped (struct wfs_pins) until it calls cacheRelease
+uint64_t cacheLoads; // Segments the pwrite engine mapped since mount
+pthread_key_t stageKey; // Scratch space of each thread (struct wfs_stage) that the pwrite engine builds log entries in
+pthread_key_t writeStageKey; // Scratch space of each thread (struct wfs_stage) that write data FUSE hands over in pieces is gathered in
+int syncMode = WFS_SYNC_NONE; // When committed log entries are forced to disk, WFS_SYNC_*
+struct wfs_chunk *chunks; // Shared chunks, indexed by chunk id
+uint32_t chunkMapSize; // Number of slots in chunks
+uint32_t chunkCounter; // Highest chunk id handed out
+uint32_t *chunkBuckets; // First chunk of each fingerprint hash bucket
+pthread_mutex_t chunkLock = PTHREAD_MUTEX_INITIALIZER; // Protects chunk reference counts and fingerprint buckets from threads holding fsLock for reading
+pthread_mutex_t commitLock = PTHREAD_MUTEX_INITIALIZER; // Protects reservations and orders their commits
+pthread_cond_t commitCond = PTHREAD_COND_INITIALIZER; // Signalled when head moves
+uint64_t logHead; // Bytes committed since mount. Reservations commit in the order they were made
+uint64_t logReserved; // Bytes reserved since mount
+int logFailed; // 1 once a log write or strict sync failed. Later updates fail with EIO, so none lands past the hole it left. Protected by commitLock
+struct wfs_segment_usage *segmentUsage; // Segment usage table, mapped from disk
+uint32_t headSegment; // Segment new log entries go to
+uint32_t headUsed; // Bytes reserved in head segment
+uint32_t segmentSeq; // Sequence number of head segment
+uint32_t freeSegments; // Number of segments without log entries
+int cleanerThreshold = CLEANER_THRESHOLD; // Percentage of live bytes at or below which a segment is reclaimed
+int cleanerRate = CLEANER_RATE; // Bytes of log the cleaner may reclaim per second
+uint32_t *segmentPins; // Zero-copy read replies that may still point into each segment, indexed by segment
+pthread_key_t pinKey; // Segments pinned by the latest zero-copy read of each thread (struct wfs_pins)
+int cleanerStop; // 1 once cleaner thread should exit
+int cleanerRunning; // 1 if cleaner thread was started
+pthread_t cleanerThread; // Background thread reclaiming dead log space
+pthread_mutex_t cleanerLock = PTHREAD_MUTEX_INITIALIZER; // Protects cleanerStop
+pthread_cond_t cleanerCond = PTHREAD_COND_INITIALIZER; // Signalled when log runs low on space or at unmount
+pthread_cond_t cleanedCond = PTHREAD_COND_INITIALIZER; // Broadcast after each pass of cleaner thread
+uint64_t cleanerPasses; // Passes of cleaner thread so far. Protected by cleanerLock
+uint64_t cleanerReclaimed; // Bytes reclaimed by latest pass of cleaner thread. Protected by cleanerLock
+int64_t *segmentTickets; // Commit ticket of first byte of each segment filled since mount. Segments filled before mount start at or below 0
+struct wfs_sync_range *syncRanges; // Disk ranges committed since last sync, in commit order. Protected by commitLock
+uint32_t syncRangeCount; // Number of ranges in syncRanges
+uint32_t syncRangeCapacity; // Slots in syncRanges
+struct wfs_sync_range *syncBatch; // Ranges being synced. Only the syncing thread touches them
+uint32_t syncBatchCapacity; // Slots in syncBatch
+uint64_t syncedHead; // Commit ticket up to which log is on disk
+int syncing; // 1 while a thread syncs the log
+int syncError; // -EIO if a background sync failed since the last fsync. Protected by syncLock
+int syncStop; // 1 once group commit thread should exit
+int syncRunning; // 1 if group commit thread was started
+pthread_t syncThread; // Background thread syncing the log in group mode
+pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER; // Protects syncedHead, syncing, syncError and syncStop
+pthread_cond_t syncCond = PTHREAD_COND_INITIALIZER; // Signalled when a sync ends or at unmount
+uint64_t checkpointHead; // Commit ticket of last checkpoint
+time_t checkpointTime; // When last checkpoint was written
+struct wfs_op_stats *opStats; // Counters and latency histogram of each handler, indexed by WFS_OP_*
+uint64_t readBytes; // Bytes returned by reads since mount
+uint64_t writtenBytes; // Bytes accepted by writes since mount
+uint64_t cleanedSegments; // Segments reclaimed by cleaner since mount
+uint64_t logLiveBytes; // Sum of live bytes of all segments, kept in step with the segment usage table
+uint64_t logClosedBytes; // Sum of bytes written to segments in use, except head segment, kept in step with the segment usage table
 
 struct wfs_sb {
     uint32_t magic;
-    uint32_t head;
+    uint32_t version;           // WFS_VERSION
+    uint64_t head;
+    uint64_t segments;          // offset of first segment. The segment usage table sits between superblock and segments
+    uint64_t checkpoints;       // offset of the two checkpoint regions, right before the first segment
+    uint32_t checkpoint_size;   // bytes per checkpoint region
+    uint32_t segment_size;      // bytes per segment. A log entry never straddles two segments
+    uint32_t segment_count;     // segments in the image file
+    uint32_t segment_max;       // segments the usage table has room for. The image may grow until it holds that many
+    uint32_t flags;             // WFS_SB_COMPRESS, WFS_SB_DEDUP
+};
+
+// Entry of the segment usage table
+struct wfs_segment_usage {
+    uint32_t seq;               // order in which segments were filled. 0 if segment is free
+    uint32_t live;              // bytes of log entries not marked deleted
+    uint32_t written;           // bytes of log entries, once log has moved on to another segment
+};
+
+// Header of a checkpoint region. The inode map, the extent count of each inode (padded to 8 bytes),
+// the extents of all files and the disk offset of each shared chunk follow it
+struct wfs_checkpoint {
+    uint64_t seq;               // 0 if region holds no checkpoint. Mount uses the valid checkpoint with the highest seq
+    uint32_t checksum;          // CRC32C of everything after it, up to the end of the orphans
+    uint32_t head_seq;          // sequence number of head segment when checkpoint was taken
+    uint64_t head;              // head when checkpoint was taken. Mount replays only log entries after it
+    uint64_t size;              // bytes after header
+    uint64_t extent_count;
+    uint32_t inode_counter;     // highest inode number handed out
+    uint32_t inode_count;       // slots in inode map
+    uint32_t chunk_count;       // number of shared chunks
+    uint32_t orphan_count;      // number of inodes unlinked while open. Their numbers follow the chunks
 };
 
 struct wfs_inode {
@@ -54,16 +223,150 @@ struct wfs_inode {
     unsigned int uid;           // user id
     unsigned int gid;           // group id
     unsigned int flags;         // flags
-    unsigned int size;          // size in bytes
+    unsigned int size;          // size in bytes of log entry. Never more than a segment
     unsigned int atime;         // last access time
     unsigned int mtime;         // last modify time
     unsigned int ctime;         // inode change time (the last time any field of inode is modified)
     unsigned int links;         // number of hard links to this file (this can always be set to 1)
+    unsigned int checksum;      // CRC32C of log entry, taking deleted, atime and checksum as 0 since they change in place
 };
 
 struct wfs_dentry {
-    char name[MAX_FILE_NAME_LEN];
-    unsigned long inode_number;
+    uint32_t hash;              // hash of name. dentries are sorted by (hash, name)
+    uint32_t inode_number;
+    uint16_t name_len;          // length of name, not counting the null terminator
+    char name[];                // null terminated name, padded so the next dentry is 4 byte aligned
+};
+
+// Data field of a directory log entry: one bucket of the directory's dentries. Header, sorted index, then the packed
+// dentries. Buckets are split one at a time by linear hashing on the name hash with its bits reversed, so each bucket
+// holds one contiguous range of hashes and a create or unlink rewrites only the bucket it touches
+struct wfs_dir {
+    uint32_t bucket;            // which bucket of the directory this is
+    uint32_t buckets;           // number of buckets of the directory. Its latest log entry has the current count
+    uint32_t entries;           // number of dentries in all buckets. Its latest log entry has the current count
+    uint32_t count;             // number of dentries in this bucket
+    uint32_t index[];           // offset of each dentry from the end of the index, sorted by (hash, name)
+};
+
+// Buckets of one directory an update rewrites, copied to memory until they are appended
+struct wfs_dir_update {
+    int inode_number;           // directory
+    struct wfs_inode inode;     // latest metadata of directory, which every bucket rewritten is stamped with
+    uint32_t buckets;           // number of buckets once update is applied
+    uint32_t entries;           // number of dentries once update is applied
+    int count;                  // number of buckets rewritten
+    struct wfs_log_entry *copies[DIR_UPDATE_BUCKETS]; // buckets rewritten, each with room for one more dentry
+};
+
+// Data field of an extent log entry: header, then length bytes of file data. Log entries are only 4 byte aligned
+struct __attribute__((packed)) wfs_extent {
+    uint64_t offset;            // file offset of the first data byte
+    uint32_t length;            // number of data bytes
+    uint64_t file_size;         // size of the file once this extent is applied
+};
+
+// In-memory reference to the live part of an extent
+struct wfs_extent_ref {
+    uint64_t offset;            // file offset of the first byte
+    uint64_t length;            // number of bytes
+    uint64_t data;              // disk offset of the first byte
+    uint64_t entry;             // disk offset of the log entry holding the bytes
+};
+
+// Follows wfs_extent in a shared extent log entry
+struct wfs_shared {
+    uint32_t skip;              // bytes of first chunk before extent data
+    uint32_t count;             // number of chunks
+    uint32_t chunks[];          // chunk ids, in file order
+};
+
+// In-memory state of a shared chunk
+struct wfs_chunk {
+    uint64_t entry;             // disk offset of log entry holding chunk, 0 if chunk id isn't in use
+    uint32_t refs;              // number of times live shared extent log entries list chunk
+    uint32_t print;             // fingerprint (CRC32C) of chunk
+    uint32_t next;              // next chunk in fingerprint hash bucket, 0 at end
+};
+
+struct wfs_extent_map {
+    uint32_t count;             // number of extents
+    uint32_t capacity;          // slots in extents
+    struct wfs_extent_ref *extents; // sorted by offset and non-overlapping
+};
+
+// Dirty bytes of an open file, shared by all of its handles
+struct wfs_write_buffer {
+    int inode_number;
+    uint64_t offset;            // file offset of the first buffered byte
+    uint32_t length;            // number of buffered bytes
+    uint32_t capacity;          // size of data
+    char *data;
+};
+
+// Open handles of a file
+struct wfs_open_file {
+    int refs;                   // number of open handles, 0 if file isn't open
+    int unlinked;               // 1 once no directory lists the file. Last handle released removes it
+    struct wfs_write_buffer *buffer; // NULL until the first buffered write
+};
+
+// Open handle of a directory. Dentries sharing a name hash are ordered by name, so a cookie of one of them names the
+// dentry by its place in names rather than by its rank, which shifts when one before it is removed
+struct wfs_dir_handle {
+    int inode_number;
+    pthread_mutex_t lock;       // guards names
+    uint32_t count;             // number of names listed under a shared hash
+    uint32_t slots;
+    char **names;
+};
+
+// Segments a thread holds, one slot per hold: the pins of its latest zero-copy read, or the segments it keeps mapped
+struct wfs_pins {
+    uint32_t count;             // number of pins
+    uint32_t capacity;          // slots in segments
+    uint32_t segments[];
+};
+
+// Scratch space of one thread, grown as needed and freed when the thread exits
+struct wfs_stage {
+    uint64_t capacity;          // size of data
+    char data[];
+};
+
+struct wfs_dcache_entry {
+    char path[MAX_PATH_LENGTH];
+    int inode_number;           // -1 if path doesn't exist
+    int valid;                  // 1 if slot is in use, 0 otherwise
+};
+
+// Disk range of log entries committed but maybe not on disk yet
+struct wfs_sync_range {
+    uint64_t start;
+    uint64_t end;
+};
+
+// Storage engine: how log entries reach the disk image, how they are made durable and how file data is read back
+struct wfs_storage_ops {
+    const char *name;           // value of --storage
+    int whole;                  // 1 if the whole image stays mapped, 0 if segments are mapped by map as they are used
+    int (*read)(uint64_t offset, void *buf, size_t size); // read size bytes at disk offset into buf. Returns 0 or -EIO
+    int (*write)(uint64_t offset, struct iovec *iov, int count); // write buffers back to back at disk offset. Returns 0 or -EIO
+    int (*sync)(struct wfs_sync_range *ranges, uint32_t count); // make committed disk ranges durable. Returns 0 on success
+    void (*map)(uint32_t segment); // keep segment mapped until the calling thread calls cacheRelease
+};
+
+// Updated with relaxed atomics by every call, so handlers never wait on each other to count
+struct wfs_op_stats {
+    uint64_t calls;
+    uint64_t errors;            // calls that returned a negative error code
+    uint64_t nanoseconds;       // total time spent in handler
+    uint64_t buckets[STATS_BUCKETS]; // calls by latency
+};
+
+struct wfs_zcache_entry {
+    uint64_t entry;             // disk offset of compressed log entry, 0 if slot is empty
+    char *data;                 // its decompressed data
 };
 
 struct wfs_log_entry {
@@ -71,4 +374,170 @@ struct wfs_log_entry {
     char data[];
 };
 
+// Size of an extent log entry holding length data bytes, padded so the next log entry is 4 byte aligned
+#define WFS_EXTENT_ENTRY_SIZE(length) ((sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent) + (length) + 3) & ~3)
+
+// Size of a shared extent log entry listing count chunks
+#define WFS_SHARED_ENTRY_SIZE(count) WFS_EXTENT_ENTRY_SIZE(sizeof(struct wfs_shared) + (count) * sizeof(uint32_t))
+
+// Size of a dentry with a name of length len
+#define WFS_DENTRY_SIZE(len) ((offsetof(struct wfs_dentry, name) + (len) + 1 + 3) & ~3)
+
+// Get size of file from its latest log entry
+static inline uint64_t wfs_file_size(struct wfs_log_entry *logEntry) {
+    if (logEntry->inode.flags & WFS_LOG_EXTENT) {
+        return ((struct wfs_extent *)logEntry->data)->file_size;
+    }
+    // Whole file is stored in data field
+    return logEntry->inode.size - sizeof(struct wfs_log_entry);
+}
+
+// Fill CRC32C tables. Call once before checksumming
+static inline void wfs_crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0); // Reflected Castagnoli polynomial
+        }
+        crcTable[0][i] = crc;
+    }
+    // Table k advances a byte through k more zero bytes
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            crcTable[k][i] = (crcTable[k - 1][i] >> 8) ^ crcTable[0][crcTable[k - 1][i] & 0xff];
+        }
+    }
+}
+
+// CRC32C of len bytes of data (slicing-by-8), continuing from the CRC of the bytes before them. Start from 0
+static inline uint32_t wfs_crc32c(uint32_t crc, const void *data, uint64_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    crc = ~crc;
+    // Single bytes until aligned
+    while ((len > 0) && ((uintptr_t)bytes & 7)) {
+        crc = (crc >> 8) ^ crcTable[0][(crc ^ *bytes++) & 0xff];
+        len--;
+    }
+    // Eight bytes per step
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        word ^= crc; // Little endian
+        crc = crcTable[7][word & 0xff] ^ crcTable[6][(word >> 8) & 0xff] ^ crcTable[5][(word >> 16) & 0xff] ^ crcTable[4][(word >> 24) & 0xff]
+            ^ crcTable[3][(word >> 32) & 0xff] ^ crcTable[2][(word >> 40) & 0xff] ^ crcTable[1][(word >> 48) & 0xff] ^ crcTable[0][word >> 56];
+        bytes += 8;
+        len -= 8;
+    }
+    // Remaining bytes
+    while (len > 0) {
+        crc = (crc >> 8) ^ crcTable[0][(crc ^ *bytes++) & 0xff];
+        len--;
+    }
+    return ~crc;
+}
+
+// Checksum inode of log entry. Fields changed in place after the log entry is written are left out
+static inline uint32_t wfs_inode_checksum(const struct wfs_inode *logInode) {
+    struct wfs_inode inode = *logInode;
+    inode.deleted = 0;
+    inode.atime = 0;
+    inode.checksum = 0;
+    return wfs_crc32c(0, &inode, sizeof(struct wfs_inode));
+}
+
+// Checksum log entry: its inode, then its data
+static inline uint32_t wfs_log_entry_checksum(const struct wfs_log_entry *logEntry) {
+    return wfs_crc32c(wfs_inode_checksum(&logEntry->inode), logEntry->data, logEntry->inode.size - sizeof(struct wfs_log_entry));
+}
+
+// Verify the update starting at log entry addr, with len bytes of log after it. Returns its size,
+// or 0 if any of its log entries is torn or corrupt or the update doesn't end before len
+static inline uint64_t wfs_verify_update(char *addr, uint64_t len) {
+    uint64_t size = 0;
+    while (size < len) {
+        struct wfs_log_entry *logEntry = (struct wfs_log_entry *)(addr + size);
+        if ((len - size < sizeof(struct wfs_log_entry)) || (logEntry->inode.size < sizeof(struct wfs_log_entry)) || (logEntry->inode.size > len - size)) {
+            return 0;
+        }
+        if (logEntry->inode.checksum != wfs_log_entry_checksum(logEntry)) {
+            return 0;
+        }
+        size += logEntry->inode.size;
+        if (!(logEntry->inode.flags & WFS_LOG_CONTINUED)) {
+            return size;
+        }
+    }
+    return 0;
+}
+
+// Hash a file name (FNV-1a)
+static inline uint32_t wfs_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name != '\0') {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Reverse the bits of x
+static inline uint32_t wfs_reverse(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Get largest power of 2 not above buckets. Buckets below buckets minus it are split once more than the others
+static inline uint32_t wfs_dir_level(uint32_t buckets) {
+    uint32_t level = 1;
+    while ((level <= UINT32_MAX / 2) && (level * 2 <= buckets)) {
+        level *= 2;
+    }
+    return level;
+}
+
+// Get bucket holding hash in a directory of buckets buckets
+static inline uint32_t wfs_dir_bucket(uint32_t hash, uint32_t buckets) {
+    uint32_t level = wfs_dir_level(buckets);
+    uint32_t bucket = wfs_reverse(hash) & (2 * level - 1);
+    return (bucket < buckets) ? bucket : bucket - level;
+}
+
+// Get first hash past the range of hashes bucket holds, in a directory of buckets buckets. 1 << 32 for the last bucket
+static inline uint64_t wfs_dir_end(uint32_t bucket, uint32_t buckets) {
+    uint32_t level = wfs_dir_level(buckets);
+    uint64_t width = ((bucket < buckets - level) || (bucket >= level)) ? (1ull << 32) / level / 2 : (1ull << 32) / level;
+    return wfs_reverse(bucket) + width;
+}
+
+// Get dentry at position pos of the sorted index
+static inline struct wfs_dentry *wfs_dir_entry(struct wfs_dir *dir, uint32_t pos) {
+    return (struct wfs_dentry *)((char *)&dir->index[dir->count] + dir->index[pos]);
+}
+
+// Binary search directory for name. Returns 1 and sets pos if found, otherwise 0 and sets pos to the insert position
+static inline int wfs_dir_find(struct wfs_dir *dir, const char *name, uint32_t *pos) {
+    uint32_t hash = wfs_hash(name);
+    uint32_t low = 0;
+    uint32_t high = dir->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        struct wfs_dentry *dentry = wfs_dir_entry(dir, mid);
+        int cmp = (dentry->hash < hash) ? -1 : (dentry->hash > hash) ? 1 : strcmp(dentry->name, name);
+        if (cmp == 0) {
+            *pos = mid;
+            return 1;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *pos = low;
+    return 0;
+}
+
 #endif